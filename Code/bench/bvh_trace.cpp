@@ -0,0 +1,72 @@
+// Build and trace benchmark of the BVH over a random triangle soup.
+//
+// Usage: bvh_trace [triangles] [rays]
+// Builds a BVH over small random triangles in a cube (2M by default) and traces random rays
+// through it (200k by default), one closest-hit query each, best of three. Reports the build
+// time, the trace time and rate, and a checksum of the hit distances to compare runs by.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/TriangleMesh.h"
+#include "../geometry/bvh.h"
+
+int main(int argc, char* argv[]) {
+    const uint32_t triangles = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 2000000;
+    const uint32_t rays = argc > 2 ? static_cast<uint32_t>(std::atoi(argv[2])) : 200000;
+
+    auto mesh = make_shared<TriangleMesh>();
+    for (uint32_t t = 0; t < triangles; ++t) {
+        point3 center = vec3::random(-1, 1);
+        for (int k = 0; k < 3; ++k) {
+            point3 p = center + 0.01 * vec3::random(-1, 1);
+            mesh->px.push_back(static_cast<float>(p.x()));
+            mesh->py.push_back(static_cast<float>(p.y()));
+            mesh->pz.push_back(static_cast<float>(p.z()));
+            mesh->indices.push_back(3 * t + k);
+        }
+    }
+
+    HittableList list;
+    list.add(mesh);
+
+    auto start = std::chrono::steady_clock::now();
+    bvh_node world(list);
+    double build = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // From a shell around the cube towards points inside it
+    std::vector<Ray> queries;
+    for (uint32_t i = 0; i < rays; ++i) {
+        point3 origin = 3.0 * random_unit_vector();
+        queries.push_back(Ray(origin, vec3::random(-1, 1) - origin));
+    }
+
+    double best = INFTY;
+    double checksum = 0;
+    uint32_t hit_rays = 0;
+
+    for (int repetition = 0; repetition < 3; ++repetition) {
+        checksum = 0;
+        hit_rays = 0;
+        start = std::chrono::steady_clock::now();
+
+        for (const Ray& r : queries) {
+            RayHit hit;
+            if (world.closestHit(r, interval(0, INFTY), hit)) {
+                checksum += hit.t;
+                ++hit_rays;
+            }
+        }
+
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    std::printf("%u triangles: built in %.2f s, %zu nodes, SAH cost %.3f\n", triangles, build, world.nodeCount(), world.sahCost());
+    std::printf("%u rays: %.3f s, %.2f M rays/s, %.1f%% hit, checksum %.9g\n", rays, best, rays / best * 1e-6,
+                100.0 * hit_rays / rays, checksum);
+    return 0;
+}
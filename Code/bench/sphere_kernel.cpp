@@ -0,0 +1,186 @@
+// Microbenchmark of the batched sphere kernels against the scalar Sphere path.
+//
+// Usage: sphere_kernel [rays]
+// Spheres are packed into groups of n, the way a BVH leaf hands a run of spheres to the
+// kernel, and every ray is tested against one group whose box it passes through. For each
+// group size the scalar path (a Sphere object per primitive, tested through Hittable like the
+// leaves used to be) and every kernel this CPU runs are timed on the same rays, and last the
+// kernel the BVH picks for that run length; the kernels' nearest hits and any-hit answers are
+// checked against the scalar path before they are timed.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/Sphere.h"
+#include "../geometry/SphereKernel.h"
+
+struct Query {
+    Ray ray;
+    uint32_t group;
+};
+
+struct Scene {
+    uint32_t group_size;
+    std::vector<std::unique_ptr<Sphere>> objects;
+    std::vector<real> cx, cy, cz, radius;
+
+    SphereColumns group(uint32_t g) const {
+        uint32_t first = g * group_size;
+        return {cx.data() + first, cy.data() + first, cz.data() + first, radius.data() + first};
+    }
+};
+
+// Groups of spheres in unit cells along x; rays start outside the cell and aim into it
+static Scene make_scene(uint32_t group_size, uint32_t groups) {
+    Scene scene;
+    scene.group_size = group_size;
+
+    for (uint32_t g = 0; g < groups; ++g) {
+        for (uint32_t j = 0; j < group_size; ++j) {
+            point3 center(g * 4.0 + random_double(), random_double(), random_double());
+            real radius = random_double(0.05, 0.25);
+
+            scene.objects.push_back(std::make_unique<Sphere>(center, radius, 0));
+            scene.cx.push_back(center.x());
+            scene.cy.push_back(center.y());
+            scene.cz.push_back(center.z());
+            scene.radius.push_back(radius);
+        }
+    }
+
+    return scene;
+}
+
+static std::vector<Query> make_queries(uint32_t count, uint32_t groups) {
+    std::vector<Query> queries;
+    queries.reserve(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t g = static_cast<uint32_t>(random_int(0, static_cast<int>(groups) - 1));
+        point3 cell(g * 4.0 + 0.5, 0.5, 0.5);
+        point3 target = cell + vec3(random_double(-0.5, 0.5), random_double(-0.5, 0.5), random_double(-0.5, 0.5));
+        point3 origin = cell + 3.0 * unit_vector(vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+        queries.push_back({Ray(origin, target - origin), g});
+    }
+
+    return queries;
+}
+
+// The pre-kernel leaf loop: closest hit through each object, shrinking the interval
+static int scalar_nearest(const Scene& scene, const Query& q, interval ray_t, real& t) {
+    int winner = -1;
+    RayHit hit;
+
+    for (uint32_t j = 0; j < scene.group_size; ++j) {
+        if (scene.objects[q.group * scene.group_size + j]->closestHit(q.ray, ray_t, hit)) {
+            ray_t.max = t = hit.t;
+            winner = static_cast<int>(j);
+        }
+    }
+
+    return winner;
+}
+
+static bool scalar_any(const Scene& scene, const Query& q, interval ray_t) {
+    for (uint32_t j = 0; j < scene.group_size; ++j) {
+        if (scene.objects[q.group * scene.group_size + j]->occluded(q.ray, ray_t)) return true;
+    }
+    return false;
+}
+
+// Best of a few repetitions, in nanoseconds per ray
+template <typename Fn>
+static double time_per_ray(size_t rays, Fn fn) {
+    double best = INFTY;
+
+    for (int repetition = 0; repetition < 5; ++repetition) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / rays);
+    }
+
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    const uint32_t rays = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 1u << 20;
+    const uint32_t groups = 1024;
+    const interval ray_t(0, INFTY);
+
+    std::vector<const SphereKernel*> kernels = {&sphere_kernel_scalar};
+#if defined(__SSE2__)
+    kernels.push_back(&sphere_kernel_sse);
+    if (&sphere_kernel() == &sphere_kernel_avx2) kernels.push_back(&sphere_kernel_avx2);
+#endif
+
+    std::printf("%u rays, ns per ray (speedup over the Sphere objects)\n", rays);
+    std::printf("%-7s %-8s %18s", "spheres", "query", "objects");
+    for (const SphereKernel* kernel : kernels) std::printf(" %18s", kernel->name);
+    std::printf(" %18s\n", "selected");
+
+    for (uint32_t group_size : {1u, 2u, 3u, 4u, 6u, 8u, 16u, 64u}) {
+        std::vector<const SphereKernel*> columns = kernels;
+        columns.push_back(&sphere_kernel(sphere_kernel(), group_size));
+
+        Scene scene = make_scene(group_size, groups);
+        std::vector<Query> queries = make_queries(rays, groups);
+
+        // Every kernel must find the scalar path's sphere, at the same root, on every ray
+        for (const SphereKernel* kernel : columns) {
+            for (const Query& q : queries) {
+                real expected_t = 0, t = 0;
+                int expected = scalar_nearest(scene, q, ray_t, expected_t);
+                int winner = kernel->nearest(scene.group(q.group), group_size, q.ray, ray_t, t);
+
+                if (winner != expected || (winner >= 0 && t != expected_t) ||
+                    kernel->any(scene.group(q.group), group_size, q.ray, ray_t) != scalar_any(scene, q, ray_t)) {
+                    std::fprintf(stderr, "%s kernel disagrees with Sphere on %u spheres\n", kernel->name, group_size);
+                    return 1;
+                }
+            }
+        }
+
+        // Accumulated so the loops cannot be dropped
+        double sink = 0;
+
+        double objects_nearest = time_per_ray(rays, [&] {
+            for (const Query& q : queries) {
+                real t = 0;
+                sink += scalar_nearest(scene, q, ray_t, t) + t;
+            }
+        });
+        std::printf("%-7u %-8s %15.2f   ", group_size, "nearest", objects_nearest);
+        for (const SphereKernel* kernel : columns) {
+            double ns = time_per_ray(rays, [&] {
+                for (const Query& q : queries) {
+                    real t = 0;
+                    sink += kernel->nearest(scene.group(q.group), group_size, q.ray, ray_t, t) + t;
+                }
+            });
+            std::printf(" %10.2f (%4.2fx)", ns, objects_nearest / ns);
+        }
+        std::printf("\n");
+
+        double objects_any = time_per_ray(rays, [&] {
+            for (const Query& q : queries) sink += scalar_any(scene, q, ray_t);
+        });
+        std::printf("%-7u %-8s %15.2f   ", group_size, "any", objects_any);
+        for (const SphereKernel* kernel : columns) {
+            double ns = time_per_ray(rays, [&] {
+                for (const Query& q : queries) sink += kernel->any(scene.group(q.group), group_size, q.ray, ray_t);
+            });
+            std::printf(" %10.2f (%4.2fx)", ns, objects_any / ns);
+        }
+        std::printf("\n");
+
+        if (sink == 42) std::printf(" \n");
+    }
+
+    return 0;
+}
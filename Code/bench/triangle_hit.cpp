@@ -0,0 +1,69 @@
+// Microbenchmark of the watertight ray/triangle test.
+//
+// Usage: triangle_hit [rays]
+// Every ray is tested against every one of 256 random triangles around the origin, keeping the
+// closest hit the way a leaf does, so most tests are rejections and some are hits that shrink
+// the interval. Reports triangle tests per second and the share of rays that hit.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/Triangle.h"
+
+struct Vertices {
+    point3 p0, p1, p2;
+};
+
+int main(int argc, char* argv[]) {
+    const uint32_t rays = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 20000;
+    const uint32_t triangle_count = 256;
+
+    std::vector<Vertices> triangles;
+    for (uint32_t k = 0; k < triangle_count; ++k) {
+        point3 center = vec3::random(-1, 1);
+        triangles.push_back({center + 0.3 * vec3::random(-1, 1), center + 0.3 * vec3::random(-1, 1), center + 0.3 * vec3::random(-1, 1)});
+    }
+
+    // From a shell around the triangles towards points among them, so every dominant axis occurs
+    std::vector<Ray> queries;
+    for (uint32_t i = 0; i < rays; ++i) {
+        point3 origin = 4.0 * random_unit_vector();
+        queries.push_back(Ray(origin, vec3::random(-1, 1) - origin));
+    }
+
+    double best = INFTY;
+    uint32_t hit_rays = 0;
+    double sink = 0;
+
+    for (int repetition = 0; repetition < 5; ++repetition) {
+        hit_rays = 0;
+        auto start = std::chrono::steady_clock::now();
+
+        for (const Ray& r : queries) {
+            interval ray_t(0, INFTY);
+            bool hit = false;
+            for (const Vertices& v : triangles) {
+                real t, b0, b1, b2;
+                if (triangle_hit(v.p0, v.p1, v.p2, r, ray_t, t, b0, b1, b2)) {
+                    ray_t.max = t;
+                    sink += b1 + b2;
+                    hit = true;
+                }
+            }
+            hit_rays += hit;
+        }
+
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    double tests = static_cast<double>(rays) * triangle_count;
+    std::printf("%u rays x %u triangles: %.1f M tests/s, %.1f%% of rays hit\n", rays, triangle_count, tests / best * 1e-6,
+                100.0 * hit_rays / rays);
+
+    if (sink == 42) std::printf(" \n");
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Microbenchmark of the batched triangle kernels against the scalar Triangle path.
+//
+// Usage: triangle_kernel [rays]
+// Triangles are packed into groups of n, the way a BVH leaf hands a run of triangles to the
+// kernel, and every ray is tested against one group whose box it passes through. For each
+// group size the scalar path (a Triangle object per primitive, tested through Hittable) and
+// every kernel this CPU runs are timed on the same rays; the kernels' nearest hits and any-hit
+// answers are checked against the scalar path before they are timed.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/Triangle.h"
+#include "../geometry/TriangleKernel.h"
+
+struct Query {
+    Ray ray;
+    uint32_t group;
+};
+
+struct Scene {
+    uint32_t group_size;
+    std::vector<std::unique_ptr<Triangle>> objects;
+    std::vector<real> x[3], y[3], z[3];
+
+    TriangleColumns group(uint32_t g) const {
+        uint32_t first = g * group_size;
+        TriangleColumns columns;
+        for (int k = 0; k < 3; ++k) {
+            columns.x[k] = x[k].data() + first;
+            columns.y[k] = y[k].data() + first;
+            columns.z[k] = z[k].data() + first;
+        }
+        return columns;
+    }
+};
+
+// Groups of triangles in unit cells along x; rays start outside the cell and aim into it
+static Scene make_scene(uint32_t group_size, uint32_t groups) {
+    Scene scene;
+    scene.group_size = group_size;
+
+    for (uint32_t g = 0; g < groups; ++g) {
+        for (uint32_t j = 0; j < group_size; ++j) {
+            point3 center(g * 4.0 + random_double(), random_double(), random_double());
+            point3 p[3];
+            for (int k = 0; k < 3; ++k) {
+                p[k] = center + 0.4 * vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1));
+                scene.x[k].push_back(p[k].x());
+                scene.y[k].push_back(p[k].y());
+                scene.z[k].push_back(p[k].z());
+            }
+            scene.objects.push_back(std::make_unique<Triangle>(p[0], p[1], p[2], 0));
+        }
+    }
+
+    // The kernels read whole blocks past the end of the last run
+    for (int k = 0; k < 3; ++k) {
+        scene.x[k].resize(scene.x[k].size() + triangle_lanes - 1);
+        scene.y[k].resize(scene.y[k].size() + triangle_lanes - 1);
+        scene.z[k].resize(scene.z[k].size() + triangle_lanes - 1);
+    }
+
+    return scene;
+}
+
+static std::vector<Query> make_queries(uint32_t count, uint32_t groups) {
+    std::vector<Query> queries;
+    queries.reserve(count);
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t g = static_cast<uint32_t>(random_int(0, static_cast<int>(groups) - 1));
+        point3 cell(g * 4.0 + 0.5, 0.5, 0.5);
+        point3 target = cell + vec3(random_double(-0.5, 0.5), random_double(-0.5, 0.5), random_double(-0.5, 0.5));
+        point3 origin = cell + 3.0 * unit_vector(vec3(random_double(-1, 1), random_double(-1, 1), random_double(-1, 1)));
+        queries.push_back({Ray(origin, target - origin), g});
+    }
+
+    return queries;
+}
+
+// Leaf loop over Triangle objects: closest hit through each, shrinking the interval
+static int scalar_nearest(const Scene& scene, const Query& q, interval ray_t, RayHit& hit) {
+    int winner = -1;
+
+    for (uint32_t j = 0; j < scene.group_size; ++j) {
+        if (scene.objects[q.group * scene.group_size + j]->closestHit(q.ray, ray_t, hit)) {
+            ray_t.max = hit.t;
+            winner = static_cast<int>(j);
+        }
+    }
+
+    return winner;
+}
+
+static bool scalar_any(const Scene& scene, const Query& q, interval ray_t) {
+    for (uint32_t j = 0; j < scene.group_size; ++j) {
+        if (scene.objects[q.group * scene.group_size + j]->occluded(q.ray, ray_t)) return true;
+    }
+    return false;
+}
+
+// Best of a few repetitions, in nanoseconds per ray
+template <typename Fn>
+static double time_per_ray(size_t rays, Fn fn) {
+    double best = INFTY;
+
+    for (int repetition = 0; repetition < 5; ++repetition) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count() / rays);
+    }
+
+    return best;
+}
+
+int main(int argc, char* argv[]) {
+    const uint32_t rays = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 1u << 19;
+    const uint32_t groups = 1024;
+    const interval ray_t(0, INFTY);
+
+    std::vector<const TriangleKernel*> kernels;
+    for (int level = 0; level <= static_cast<int>(simd_level()); ++level) kernels.push_back(&triangle_kernels[level]);
+
+    std::printf("%u rays, ns per ray (speedup over the Triangle objects)\n", rays);
+    std::printf("%-9s %-8s %18s", "triangles", "query", "objects");
+    for (const TriangleKernel* kernel : kernels) std::printf(" %18s", kernel->name);
+    std::printf("\n");
+
+    for (uint32_t group_size : {1u, 2u, 3u, 4u, 8u, 16u, 32u}) {
+        Scene scene = make_scene(group_size, groups);
+        std::vector<Query> queries = make_queries(rays, groups);
+
+        // Every kernel must find the scalar path's triangle, with the same distance and
+        // barycentric weights, on every ray
+        for (const TriangleKernel* kernel : kernels) {
+            for (const Query& q : queries) {
+                RayHit expected;
+                real t = 0, b1 = 0, b2 = 0;
+                int expected_winner = scalar_nearest(scene, q, ray_t, expected);
+                int winner = kernel->nearest(scene.group(q.group), group_size, q.ray, ray_t, t, b1, b2);
+
+                if (winner != expected_winner || (winner >= 0 && (t != expected.t || b1 != expected.u || b2 != expected.v)) ||
+                    kernel->any(scene.group(q.group), group_size, q.ray, ray_t) != scalar_any(scene, q, ray_t)) {
+                    std::fprintf(stderr, "%s kernel disagrees with Triangle on %u triangles\n", kernel->name, group_size);
+                    return 1;
+                }
+            }
+        }
+
+        // Accumulated so the loops cannot be dropped
+        double sink = 0;
+
+        double objects_nearest = time_per_ray(rays, [&] {
+            for (const Query& q : queries) {
+                RayHit hit;
+                sink += scalar_nearest(scene, q, ray_t, hit) + hit.t;
+            }
+        });
+        std::printf("%-9u %-8s %15.2f   ", group_size, "nearest", objects_nearest);
+        for (const TriangleKernel* kernel : kernels) {
+            double ns = time_per_ray(rays, [&] {
+                for (const Query& q : queries) {
+                    real t = 0, b1, b2;
+                    sink += kernel->nearest(scene.group(q.group), group_size, q.ray, ray_t, t, b1, b2) + t;
+                }
+            });
+            std::printf(" %10.2f (%4.2fx)", ns, objects_nearest / ns);
+        }
+        std::printf("\n");
+
+        double objects_any = time_per_ray(rays, [&] {
+            for (const Query& q : queries) sink += scalar_any(scene, q, ray_t);
+        });
+        std::printf("%-9u %-8s %15.2f   ", group_size, "any", objects_any);
+        for (const TriangleKernel* kernel : kernels) {
+            double ns = time_per_ray(rays, [&] {
+                for (const Query& q : queries) sink += kernel->any(scene.group(q.group), group_size, q.ray, ray_t);
+            });
+            std::printf(" %10.2f (%4.2fx)", ns, objects_any / ns);
+        }
+        std::printf("\n");
+
+        if (sink == 42) std::printf(" \n");
+    }
+
+    return 0;
+}
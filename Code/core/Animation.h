@@ -0,0 +1,189 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "Camera.h"
+#include "../geometry/bvh.h"
+#include "../geometry/Instance.h"
+#include "../lights/Light.h"
+#include "../math/transform.h"
+#include "../misc/utils.h"
+
+// Placement of an instance as the scene file gives it: scale, then rotation about x, y and z
+// (degrees), then translation, all in the file's left-handed coordinates
+struct Placement {
+    vec3 scale = vec3(1, 1, 1);
+    vec3 rotate;
+    vec3 translate;
+
+    Transform transform() const {
+        Transform t = Transform::scale(scale);
+        t = Transform::rotate(vec3(1, 0, 0), rotate.x()) * t;
+        t = Transform::rotate(vec3(0, 1, 0), rotate.y()) * t;
+        t = Transform::rotate(vec3(0, 0, 1), rotate.z()) * t;
+        t = Transform::translate(translate) * t;
+
+        // Geometry is flipped into the renderer's right-handed space while parsing, so the
+        // transform has to be flipped the same way
+        return t.mirrorZ();
+    }
+};
+
+// Where the camera is and what it looks at
+struct CameraPose {
+    point3 lookfrom;
+    point3 lookat;
+    vec3 vup;
+};
+
+inline vec3 interpolate(const vec3& a, const vec3& b, double s) {
+    return a + s * (b - a);
+}
+
+// Rotations are interpolated angle by angle, like the per-frame steps add up
+inline Placement interpolate(const Placement& a, const Placement& b, double s) {
+    return {interpolate(a.scale, b.scale, s), interpolate(a.rotate, b.rotate, s), interpolate(a.translate, b.translate, s)};
+}
+
+inline CameraPose interpolate(const CameraPose& a, const CameraPose& b, double s) {
+    return {interpolate(a.lookfrom, b.lookfrom, s), interpolate(a.lookat, b.lookat, s), interpolate(a.vup, b.vup, s)};
+}
+
+// Values set at some frames: linearly interpolated between them, held before the first and
+// after the last
+template <typename T>
+class Keyframes {
+    public:
+        void add(int frame, const T& value) {
+            auto next = std::lower_bound(keys.begin(), keys.end(), frame, [](const std::pair<int, T>& key, int f) { return key.first < f; });
+            if (next != keys.end() && next->first == frame) {
+                throw std::runtime_error("Two keyframes for frame " + std::to_string(frame));
+            }
+            keys.insert(next, {frame, value});
+        }
+
+        bool empty() const { return keys.empty(); }
+
+        T at(int frame) const {
+            auto next = std::lower_bound(keys.begin(), keys.end(), frame, [](const std::pair<int, T>& key, int f) { return key.first < f; });
+            if (next == keys.begin()) return keys.front().second;
+            if (next == keys.end()) return keys.back().second;
+
+            auto previous = next - 1;
+            double s = static_cast<double>(frame - previous->first) / (next->first - previous->first);
+            return interpolate(previous->second, next->second, s);
+        }
+
+    private:
+        std::vector<std::pair<int, T>> keys;   // Sorted by frame
+};
+
+// An instance that moves, along its keyframes if it has any; otherwise every frame adds one
+// step of rotation and translation to its starting placement
+struct InstanceMotion {
+    shared_ptr<Instance> instance;
+    Placement start;
+    vec3 rotate_step;
+    vec3 translate_step;
+    Keyframes<Placement> keyframes;
+
+    Transform transformAt(int frame) const {
+        if (!keyframes.empty()) return keyframes.at(frame).transform();
+
+        Placement placement = start;
+        placement.rotate += frame * rotate_step;
+        placement.translate += frame * translate_step;
+        return placement.transform();
+    }
+};
+
+// A light moving along keyframes of its position
+struct LightMotion {
+    shared_ptr<Light> light;
+    Keyframes<point3> keyframes;
+};
+
+// Frame sequence of a scene with moving instances, camera or lights. Moving an instance only
+// changes the top-level BVH, which is refit in place every frame. Once the refit tree's SAH
+// cost grows past rebuild_threshold times what a fresh build last achieved, the tree is built
+// again, and the fresh tree is kept only if it is cheaper than the refit one.
+class Animation {
+    public:
+        int frames = 0;                   // Frames in the sequence (0 renders a single still)
+        double rebuild_threshold = 1.1;   // Allowed SAH cost growth before a full rebuild
+
+        // What bringing the top-level BVH up to date cost for one frame
+        struct FrameUpdate {
+            bool rebuilt = false;
+            double milliseconds = 0;
+            double sah_cost = 0;
+        };
+
+        void setTopLevel(shared_ptr<bvh_node> _top_level) {
+            top_level = _top_level;
+            built_cost = top_level->sahCost();
+        }
+
+        void addMotion(const InstanceMotion& motion) {
+            motions.push_back(motion);
+        }
+
+        void setCameraMotion(shared_ptr<Camera> _camera, const Keyframes<CameraPose>& keyframes) {
+            camera = _camera;
+            camera_keyframes = keyframes;
+        }
+
+        void addLightMotion(const LightMotion& motion) {
+            light_motions.push_back(motion);
+        }
+
+        size_t animatedCount() const { return motions.size(); }
+
+        // Move the camera, lights and animated instances to the frame and refit (or rebuild)
+        // the top-level BVH
+        FrameUpdate setFrame(int frame) {
+            if (camera && !camera_keyframes.empty()) {
+                CameraPose pose = camera_keyframes.at(frame);
+                camera->lookfrom = pose.lookfrom;
+                camera->lookat = pose.lookat;
+                camera->vup = pose.vup;
+            }
+            for (const LightMotion& motion : light_motions) {
+                motion.light->setPosition(motion.keyframes.at(frame));
+            }
+
+            auto start = std::chrono::steady_clock::now();
+            FrameUpdate update;
+
+            for (const InstanceMotion& motion : motions) {
+                motion.instance->setTransform(motion.transformAt(frame));
+            }
+
+            if (top_level && !motions.empty()) {
+                top_level->refit();
+
+                if (top_level->sahCost() > rebuild_threshold * built_cost) {
+                    update.rebuilt = top_level->rebuildIfCheaper(built_cost);
+                }
+            }
+
+            if (top_level) update.sah_cost = top_level->sahCost();
+            update.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return update;
+        }
+
+    private:
+        shared_ptr<bvh_node> top_level;   // Null when the scene has no instances
+        double built_cost = 0;            // SAH cost of the latest fresh build
+        std::vector<InstanceMotion> motions;
+        shared_ptr<Camera> camera;
+        Keyframes<CameraPose> camera_keyframes;
+        std::vector<LightMotion> light_motions;
+};
+
+#endif
@@ -2,11 +2,16 @@
 #define CAMERA_H
 
 #include <algorithm>
+#include <stdexcept>
+#include <vector>
 
 #include "../misc/utils.h"
 
+#include "../core/Framebuffer.h"
 #include "../core/Hittable.h"
+#include "../core/TileScheduler.h"
 #include "../misc/color.h"
+#include "../misc/ImageWriter.h"
 #include "../materials/Material.h"
 
 using std::string;
@@ -17,11 +22,17 @@ class Camera {
         string render_mode       = "phong";  // Rendering mode used by the camera
         color  background        = color(0, 0, 0);  // Background colour
         int    nbounces          = 1;    // Number of bounces for indirect illumination
+        int    rr_min_depth      = 3;    // Bounces before Russian roulette may end a path (pathtracer_rr)
         double aspect_ratio      = 1.0;  // Ratio of image width over height
         int    image_width       = 100;  // Rendered image width in pixel count
         int    image_height      = 0;    // Rendered image height in pixel count
         int    samples_per_pixel = 20;   // Count of random samples for each pixel
 
+        bool   adaptive_sampling  = false;  // Sample each pixel until its noise estimate is low enough
+        int    min_samples        = 8;      // Adaptive: samples every pixel receives
+        int    max_samples        = 256;    // Adaptive: upper bound of samples per pixel
+        double adaptive_threshold = 0.02;   // Adaptive: target standard error relative to the pixel mean
+
         double vfov              = 90;                  // Vertical view angle (field of view)
         double exposure          = 0.1;                 // Camera exposure for tone mapping
         point3 lookfrom          = point3(0, 0, -1);    // Point camera is looking from
@@ -29,76 +40,54 @@ class Camera {
         vec3   vup               = vec3(0, 1, 0);       // Camera-relative "up" direction
 
         double lens_radius       = 0;    // Radius of camera lens
+
+        int      num_threads     = 0;    // Render threads (0 uses every hardware thread)
+        int      tile_size       = 16;   // Width and height of a render tile in pixels
+        uint32_t seed            = 0;    // Key of the counter-based random streams
         
-        void render(const Hittable& world, const std::vector<shared_ptr<Light>>& lights) {
+        // Render the scene into a linear HDR framebuffer
+        Framebuffer renderFramebuffer(const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) {
             initialize();
-            std::cout << "P3\n" << image_width << " " << image_height << "\n255\n";
-
-            for (int j = 0; j < image_height; ++j) {
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; ++i) {
-                    color pixel_color(0,0,0);
-
-                    // If camera type is 'binary', use binary_ray_color method
-                    if (render_mode == "binary") {
-                        Ray r = get_ray(i, j, 1);
-                        pixel_color = binary(r, world);
-                        write_color(std::cout, pixel_color, 1, 1);
-                    } else if (render_mode == "phong") {
-                        for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                            Ray r = get_ray(i, j, sample);
-                            pixel_color += blinn_phong(r, world, lights, nbounces);
-                        }
-                        write_color(std::cout, pixel_color, samples_per_pixel, exposure);
-                    } else if (render_mode == "pathtracer") {
-                        // Otherwise, use pathtracer code
-                        for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                            Ray r = get_ray(i, j, sample);
-                            pixel_color += pathtrace(r, nbounces, world, lights);
-                        }
-                        write_color(std::cout, pixel_color, samples_per_pixel, exposure);
-                    }
-                }
+
+            Framebuffer framebuffer(image_width, image_height);
+
+            // Resolve the render mode once; every mode gets its own compiled tile loop
+            if (render_mode == "binary") {
+                renderWith<BinaryKernel>(framebuffer, world, lights, materials);
+            } else if (render_mode == "phong") {
+                renderWith<PhongKernel>(framebuffer, world, lights, materials);
+            } else if (render_mode == "pathtracer") {
+                renderWith<PathTracerKernel>(framebuffer, world, lights, materials);
+            } else if (render_mode == "pathtracer_rr") {
+                renderWith<PathTracerRRKernel>(framebuffer, world, lights, materials);
+            } else {
+                throw std::runtime_error("Unknown render mode " + render_mode);
             }
 
             std::clog << "\rDone.           \n";
+            if (adaptive_sampling) {
+                std::clog << "Adaptive sampling: " << framebuffer.totalSamples() << " samples, "
+                          << static_cast<double>(framebuffer.totalSamples()) / (image_width * image_height) << " per pixel\n";
+            }
+            return framebuffer;
         }
 
-        void renderToPPM(const Hittable& world, const std::vector<shared_ptr<Light>>& lights, std::ostream& output) {
-            initialize();
-            output << "P3\n" << image_width << " " << image_height << "\n255\n";
-
-            for (int j = 0; j < image_height; ++j) {
-                std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-                for (int i = 0; i < image_width; ++i) {
-                    color pixel_color(0,0,0);
-
-                    // If camera type is 'binary', use binary_ray_color method
-                    if (render_mode == "binary") {
-                        Ray r = get_ray(i, j, 1);
-                        pixel_color = binary(r, world);
-                        write_color(output, pixel_color, 1, 1);
-                    } else if (render_mode == "phong") {
-                        for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                            Ray r = get_ray(i, j, sample);
-                            pixel_color += blinn_phong(r, world, lights, nbounces);
-                        }
-                        write_color(output, pixel_color, samples_per_pixel, exposure);
-                    } else if (render_mode == "pathtracer") {
-                        // Otherwise, use pathtracer code
-                        for (int sample = 0; sample < samples_per_pixel; ++sample) {
-                            Ray r = get_ray(i, j, sample);
-                            pixel_color += pathtrace(r, nbounces, world, lights);
-                        }
-                        write_color(output, pixel_color, samples_per_pixel, exposure);
-                    }
-                }
-            }
+        void render(const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) {
+            renderToPPM(world, lights, materials, std::cout);
+        }
 
-            std::clog << "\rDone.           \n";
+        void renderToPPM(const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials, std::ostream& output) {
+            write_ppm_ascii(output, renderFramebuffer(world, lights, materials), outputExposure());
+        }
+
+        // Exposure the output stage should tone map with; binary renders are written without exposure
+        double outputExposure() const {
+            return (render_mode == "binary") ? 1 : exposure;
         }
 
     private:
+        static constexpr int adaptive_batch = 4;  // Adaptive: samples taken between two error checks
+
         point3  origin;         // Camera origin
         point3  pixel00_loc;    // Location of pixel 0, 0
         vec3    pixel_delta_u;  // Offset to pixel to the right
@@ -148,57 +137,217 @@ class Camera {
             defocus_disk_v = lens_radius * v;
         }
 
-        Ray get_ray(int i, int j, int sampleIndex) const {
-            auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
+        // Render mode kernels. A kernel gives the radiance of one camera ray and says whether the
+        // mode takes a single sample per pixel and whether it samples the pixel area and lens.
+        // Modes whose camera rays depend on the pixel alone set packet_primary instead: their
+        // camera rays are traced in packets, once per pixel, and the kernel shades the first hit
+        // (null on a miss). A new mode is a new kernel plus one line in renderFramebuffer.
+        struct BinaryKernel {
+            static constexpr bool single_sample = true;
+            static constexpr bool stochastic_camera = false;
+            static constexpr bool packet_primary = true;
+
+            static color shade(const Camera& camera, const Ray& r, const HitRecord* rec, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) {
+                return camera.binary(rec);
+            }
+        };
 
-            // If pathtracer, apply defocus and antialiasing
-            if (render_mode == "pathtracer") {
-                // Defocus: Uniform sampling
-                vec3 lensPoint = uniformSamplingDefocus();
-                vec3 focalPoint = origin + (defocus_disk_u * lensPoint[0]) + (defocus_disk_v * lensPoint[1]);
+        struct PhongKernel {
+            static constexpr bool single_sample = false;
+            static constexpr bool stochastic_camera = false;
+            static constexpr bool packet_primary = true;
+
+            static color shade(const Camera& camera, const Ray& r, const HitRecord* rec, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) {
+                return camera.blinn_phong(r, rec, world, lights, materials);
+            }
+        };
 
-                // AA: Jitter the ray within the pixel
-                int jitterX, jitterY;
-                int baseX = 2;
-                int baseY = 3;
+        struct PathTracerKernel {
+            static constexpr bool single_sample = false;
+            static constexpr bool stochastic_camera = true;
+            static constexpr bool packet_primary = false;
 
-                // Generate 2D Halton sample for jittering
-                halton2D(sampleIndex, jitterX, jitterY, baseX, baseY);
+            static color radiance(const Camera& camera, const Ray& r, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) {
+                return camera.pathtrace(r, camera.nbounces, world, lights, materials);
+            }
+        };
 
-                // Jitter the ray within the pixel
-                float jitterXNormalized = jitterX / static_cast<float>(image_width);
-                float jitterYNormalized = jitterY / static_cast<float>(image_height);
+        // Iterative pathtracer with Russian roulette
+        struct PathTracerRRKernel {
+            static constexpr bool single_sample = false;
+            static constexpr bool stochastic_camera = true;
+            static constexpr bool packet_primary = false;
 
-                pixel_center += (jitterXNormalized * pixel_delta_u) + (jitterYNormalized * pixel_delta_v);
+            static color radiance(const Camera& camera, const Ray& r, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) {
+                return camera.pathtraceIterative(r, world, lights, materials);
+            }
+        };
 
-                auto ray_direction = pixel_center - focalPoint;
+        enum class LensModel { Pinhole, ThinLens };
 
-                return Ray(focalPoint, ray_direction);
+        // Pick the lens model: only modes that sample the camera use the lens, and a zero radius is a pinhole
+        template <typename Kernel>
+        void renderWith(Framebuffer& framebuffer, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) const {
+            if (Kernel::stochastic_camera && lens_radius > 0) {
+                renderTiles<Kernel, LensModel::ThinLens>(framebuffer, world, lights, materials);
+            } else {
+                renderTiles<Kernel, LensModel::Pinhole>(framebuffer, world, lights, materials);
             }
+        }
 
-            auto ray_direction = pixel_center - origin;
+        template <typename Kernel, LensModel lens>
+        void renderTiles(Framebuffer& framebuffer, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) const {
+            TileScheduler scheduler(image_width, image_height, tile_size, num_threads);
+
+            scheduler.run([&](const Tile& tile) {
+                thread_sampler().setSeed(seed);
+
+                if constexpr (Kernel::packet_primary) {
+                    renderPacketTile<Kernel>(tile, framebuffer, world, lights, materials);
+                } else {
+                    for (int j = tile.y0; j < tile.y1; ++j) {
+                        for (int i = tile.x0; i < tile.x1; ++i) {
+                            int sample_count;
+                            color pixel_color = renderPixel<Kernel>(i, j, [&]() {
+                                return Kernel::radiance(*this, get_ray<Kernel::stochastic_camera, lens>(i, j), world, lights, materials);
+                            }, sample_count);
+
+                            framebuffer.setPixel(i, j, pixel_color);
+                            framebuffer.setSampleCount(i, j, sample_count);
+                        }
+                    }
+                }
+            });
+        }
 
-            return Ray(origin, ray_direction);
+        // Packets of neighbouring pixels: 4 x 2 keeps the rays of a packet close together
+        static constexpr int packet_columns = 4;
+        static constexpr int packet_rows = packet_size / packet_columns;
+
+        // Tile loop of packet_primary modes: the camera rays of a packet are traced together, and
+        // every sample of a pixel shades its first hit
+        template <typename Kernel>
+        void renderPacketTile(const Tile& tile, Framebuffer& framebuffer, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) const {
+            for (int j0 = tile.y0; j0 < tile.y1; j0 += packet_rows) {
+                for (int i0 = tile.x0; i0 < tile.x1; i0 += packet_columns) {
+                    RayPacket packet;
+                    int pixel_i[packet_size], pixel_j[packet_size];
+
+                    for (int j = j0; j < std::min(j0 + packet_rows, tile.y1); ++j) {
+                        for (int i = i0; i < std::min(i0 + packet_columns, tile.x1); ++i) {
+                            pixel_i[packet.count] = i;
+                            pixel_j[packet.count] = j;
+                            packet.add(get_ray<false, LensModel::Pinhole>(i, j), interval(0, INFTY));
+                        }
+                    }
+
+                    HitRecord recs[packet_size];
+                    uint32_t hit_mask = world.intersectPacket(packet, packet.mask(), recs);
+
+                    for (int k = 0; k < packet.count; ++k) {
+                        const HitRecord* rec = (hit_mask & (1u << k)) ? &recs[k] : nullptr;
+
+                        int sample_count;
+                        color pixel_color = renderPixel<Kernel>(pixel_i[k], pixel_j[k], [&]() {
+                            return Kernel::shade(*this, packet.rays[k], rec, world, lights, materials);
+                        }, sample_count);
+
+                        framebuffer.setPixel(pixel_i[k], pixel_j[k], pixel_color);
+                        framebuffer.setSampleCount(pixel_i[k], pixel_j[k], sample_count);
+                    }
+                }
+            }
+        }
+
+        // Accumulate the samples of one pixel; sample_radiance gives the radiance of the current
+        // sample once the sampler has been started on it
+        template <typename Kernel, typename SampleRadiance>
+        color renderPixel(int i, int j, const SampleRadiance& sample_radiance, int& sample_count) const {
+            // Samples are keyed by (pixel, sample, bounce, dimension), never by which thread renders them
+            Sampler& sampler = thread_sampler();
+            uint64_t pixel_index = static_cast<uint64_t>(j) * image_width + i;
+
+            if constexpr (Kernel::single_sample) {
+                sampler.startSample(pixel_index, 0);
+                sample_count = 1;
+                return sample_radiance();
+            }
+
+            color pixel_color(0,0,0);
+
+            if (!adaptive_sampling) {
+                for (int sample = 0; sample < samples_per_pixel; ++sample) {
+                    sampler.startSample(pixel_index, sample);
+                    pixel_color += sample_radiance();
+                }
+
+                sample_count = samples_per_pixel;
+                return pixel_color * (1.0 / samples_per_pixel);
+            }
+
+            // Adaptive: track the running mean and variance of the sample luminance (Welford) and
+            // stop once the standard error of the mean drops below the threshold, relative to
+            // the mean itself (floored so near-black pixels do not demand endless samples)
+            double mean = 0, squared_deviations = 0;
+            int n = 0;
+
+            while (n < max_samples) {
+                sampler.startSample(pixel_index, n);
+                color sample_color = sample_radiance();
+                pixel_color += sample_color;
+                ++n;
+
+                double lum = luminance(sample_color);
+                double delta = lum - mean;
+                mean += delta / n;
+                squared_deviations += delta * (lum - mean);
+
+                if (n >= min_samples && (n - min_samples) % adaptive_batch == 0 && n > 1) {
+                    double standard_error = sqrt(squared_deviations / (n - 1) / n);
+                    if (standard_error <= adaptive_threshold * std::max(mean, 0.01))
+                        break;
+                }
+            }
+
+            sample_count = n;
+            return pixel_color * (1.0 / n);
         }
 
-        void halton2D(int index, int& x, int& y, int baseX, int baseY) const {
-            x = static_cast<int>(halton(index, baseX) * image_width);
-            y = static_cast<int>(halton(index, baseY) * image_height);
+        template <bool jitter, LensModel lens>
+        Ray get_ray(int i, int j) const {
+            auto pixel_center = pixel00_loc + (i * pixel_delta_u) + (j * pixel_delta_v);
+
+            // AA: Jitter the ray anywhere within the pixel footprint
+            if constexpr (jitter) {
+                vec2 offset = thread_sampler().get2D(SampleDimension::PixelJitter);
+                pixel_center += ((offset.x - 0.5) * pixel_delta_u) + ((offset.y - 0.5) * pixel_delta_v);
+            }
+
+            // Defocus: start the ray on a uniformly sampled point of the lens
+            if constexpr (lens == LensModel::ThinLens) {
+                vec3 lensPoint = uniformSamplingDefocus();
+                vec3 focalPoint = origin + (defocus_disk_u * lensPoint[0]) + (defocus_disk_v * lensPoint[1]);
+
+                return Ray(focalPoint, pixel_center - focalPoint);
+            }
+
+            auto ray_direction = pixel_center - origin;
+
+            return Ray(origin, ray_direction);
         }
 
         vec3 uniformSamplingDefocus() const {
-            float r = sqrt(random_float());
-            float theta = 2.0 * PI * random_float();
+            vec2 u = thread_sampler().get2D(SampleDimension::Lens);
+            real r = sqrt(real(u.x));
+            real theta = 2.0 * PI * u.y;
 
             // Compute sampled point on lens
             return vec3(r * cos(theta), r * sin(theta), 0);
         }
 
-        color binary(const Ray& r, const Hittable& world) {
-            HitRecord rec;
-
+        color binary(const HitRecord* rec) const {
             // If there is an intersection, output solid red colour
-            if (world.intersect(r, interval(0.001, INFTY), rec)) {
+            if (rec) {
                 return color(1, 0, 0);
             }
 
@@ -206,32 +355,35 @@ class Camera {
             return color(0, 0, 0);
         }
 
-        color blinn_phong(const Ray& r, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, int depth) {
-            HitRecord rec;
-
+        color blinn_phong(const Ray& r, const HitRecord* rec, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) const {
             // If there is an intersection
-            if (world.intersect(r, interval(0.001, INFTY), rec)) {
-                return rec.mat->getShading(world, lights, r, background, rec, nbounces);
+            if (rec) {
+                HitRecord hit = *rec;
+                return materials.getShading(world, lights, r, background, hit, nbounces);
             }
 
             return background;
         }
 
-        color pathtrace(const Ray& r, int depth, const Hittable& world, const std::vector<shared_ptr<Light>>& lights) const {
+        color pathtrace(const Ray& r, int depth, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) const {
             HitRecord rec;
 
             // If we've exceeded the ray bounce limit, no more light is gathered
             if (depth <= 0)
                 return color(0, 0, 0);
 
-            // Address Shadow Acne by setting min bound as 0.001
-            if (world.intersect(r, interval(0.001, INFTY), rec)) {
+            // Every path vertex draws from its own block of random dimensions
+            thread_sampler().setBounce(nbounces - depth);
+
+            // Bounce rays start off the surface they leave (HitRecord::spawn_ray), so no minimum
+            // distance is needed to avoid shadow acne
+            if (world.intersect(r, interval(0, INFTY), rec)) {
                 color directLighting = calculateDirectLighting(world, rec, lights);
 
                 Ray scattered;
                 color attenuation;
-                if (rec.mat->evaluate(r, rec, attenuation, scattered))
-                    return attenuation * directLighting + attenuation * pathtrace(scattered, depth-1, world, lights);
+                if (materials.evaluate(r, rec, attenuation, scattered))
+                    return attenuation * directLighting + attenuation * pathtrace(scattered, depth-1, world, lights, materials);
                 else
                     return directLighting;  // Surface is non-reflective, only consider direct lighting
             }
@@ -239,6 +391,51 @@ class Camera {
             return background;
         }
 
+        // Same estimator as pathtrace, as a loop: the path throughput (product of attenuations so
+        // far) weights each vertex's direct lighting, and after rr_min_depth bounces paths survive
+        // with probability equal to their throughput, reweighted so the estimate stays unbiased
+        color pathtraceIterative(const Ray& r, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const MaterialTable& materials) const {
+            Sampler& sampler = thread_sampler();
+            color radiance(0, 0, 0);
+            color throughput(1, 1, 1);
+            Ray ray = r;
+
+            for (int bounce = 0; bounce < nbounces; ++bounce) {
+                sampler.setBounce(bounce);
+
+                // Bounce rays start off the surface (HitRecord::spawn_ray): no minimum distance
+                HitRecord rec;
+                if (!world.intersect(ray, interval(0, INFTY), rec)) {
+                    radiance += throughput * background;
+                    break;
+                }
+
+                color directLighting = calculateDirectLighting(world, rec, lights);
+
+                Ray scattered;
+                color attenuation;
+                if (!materials.evaluate(ray, rec, attenuation, scattered)) {
+                    radiance += throughput * directLighting;  // Surface is non-reflective, path ends here
+                    break;
+                }
+
+                throughput = throughput * attenuation;
+                radiance += throughput * directLighting;
+
+                if (bounce + 1 >= rr_min_depth) {
+                    real survival = std::min<real>(0.95, std::max({throughput.x(), throughput.y(), throughput.z()}));
+                    if (sampler.get1D(SampleDimension::Roulette) >= survival)
+                        break;
+
+                    throughput /= survival;
+                }
+
+                ray = scattered;
+            }
+
+            return radiance;
+        }
+
         color calculateDirectLighting(const Hittable& world, const HitRecord& rec, const std::vector<shared_ptr<Light>>& lights) const {
             color directLighting = color(0, 0, 0);
 
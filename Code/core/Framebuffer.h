@@ -0,0 +1,69 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "../misc/color.h"
+
+// Linear HDR image the renderer accumulates into. Radiance is kept untouched (no exposure,
+// tone mapping or gamma) as interleaved float RGB, so the same render can be re-tonemapped
+// or written to several formats without tracing a single ray again.
+class Framebuffer {
+    public:
+        Framebuffer() : image_width(0), image_height(0) {}
+
+        Framebuffer(int _width, int _height)
+            : image_width(_width), image_height(_height),
+              rgb(static_cast<size_t>(_width) * _height * 3, 0.0f),
+              samples(static_cast<size_t>(_width) * _height, 0) {}
+
+        int width() const  { return image_width; }
+        int height() const { return image_height; }
+
+        void setPixel(int i, int j, const color& c) {
+            float* pixel = &rgb[index(i, j)];
+            pixel[0] = static_cast<float>(c.x());
+            pixel[1] = static_cast<float>(c.y());
+            pixel[2] = static_cast<float>(c.z());
+        }
+
+        color getPixel(int i, int j) const {
+            const float* pixel = &rgb[index(i, j)];
+            return color(pixel[0], pixel[1], pixel[2]);
+        }
+
+        // Number of samples that went into a pixel (the sample-count map of adaptive renders)
+        void setSampleCount(int i, int j, int count) {
+            samples[static_cast<size_t>(j) * image_width + i] = static_cast<uint32_t>(count);
+        }
+
+        int sampleCount(int i, int j) const {
+            return static_cast<int>(samples[static_cast<size_t>(j) * image_width + i]);
+        }
+
+        uint64_t totalSamples() const {
+            uint64_t total = 0;
+            for (uint32_t count : samples) {
+                total += count;
+            }
+            return total;
+        }
+
+        // Raw row-major, top-to-bottom RGB triples
+        const float* data() const {
+            return rgb.data();
+        }
+
+    private:
+        int image_width;
+        int image_height;
+        std::vector<float> rgb;
+        std::vector<uint32_t> samples;
+
+        size_t index(int i, int j) const {
+            return (static_cast<size_t>(j) * image_width + i) * 3;
+        }
+};
+
+#endif
@@ -1,21 +1,23 @@
 #ifndef HITTABLE_H
 #define HITTABLE_H
 
+#include <type_traits>
+
 #include "../core/Ray.h"
+#include "../core/RayPacket.h"
 #include "../geometry/aabb.h"
+#include "../materials/MaterialId.h"
 #include "../misc/utils.h"
 
-class Material;
-
 class HitRecord {
     public:
         point3 p;
         vec3 normal;
-        shared_ptr<Material> mat;
-        double t;
+        real t;
+        real texture_u;
+        real texture_v;
+        MaterialId material;    // Into the scene's MaterialTable
         bool front_face;
-        double texture_u;
-        double texture_v;
 
         void set_face_normal(const Ray& r, const vec3& outward_normal) {
             // Sets the hit record normal vector
@@ -26,10 +28,36 @@ class HitRecord {
         }
 
         // Helper method to assign UV mapped coordinates to hit
-        void set_uv(double u, double v) {
+        void set_uv(real u, real v) {
             texture_u = u;
             texture_v = v;
         }
+
+        // Where rays leaving the surface towards `direction` start: p pushed off the surface
+        // (offset_ray_origin), so they are traced from t = 0 without hitting it again
+        point3 spawn_origin(const vec3& direction) const {
+            return offset_ray_origin(p, normal, direction);
+        }
+
+        Ray spawn_ray(const vec3& direction) const {
+            return Ray(spawn_origin(direction), direction);
+        }
+};
+
+// Hit records are copied around freely (recursive shading, light sampling), so they hold no
+// owning pointers: copying one is a plain memcpy with no reference counting
+static_assert(std::is_trivially_copyable<HitRecord>::value, "HitRecord must stay trivially copyable");
+
+class Hittable;
+
+// Result of the closest-hit search: only what is needed to build the shading data of the
+// winning hit afterwards
+struct RayHit {
+    real t;
+    const Hittable* primitive = nullptr;  // Leaf primitive (or instance) that was hit
+    const Hittable* instanced = nullptr;  // Instances: the primitive hit inside the instance
+    real u, v;                          // Primitive-specific hit parameters (e.g. barycentrics)
+    uint32_t index = 0;                 // Which part of the primitive (a BVH entry, a mesh triangle)
 };
 
 class Hittable {
@@ -37,10 +65,76 @@ class Hittable {
         // Default destructor
         virtual ~Hittable() = default;
 
-        // Intersection method
-        virtual bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const = 0;
+        // Closest hit inside ray_t. Records only the distance, the primitive and its raw hit
+        // parameters, so candidates that lose to a closer hit never pay for shading data.
+        virtual bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const = 0;
+
+        // Shading data (point, normal, material, texture coordinates) of a hit on this primitive
+        virtual void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const = 0;
+
+        // Intersection method: closest hit, with shading data computed once for the winner
+        bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const {
+            RayHit hit;
+            if (!closestHit(r, ray_t, hit))
+                return false;
+
+            hit.primitive->computeSurfaceInteraction(r, hit, rec);
+            return true;
+        }
+
+        // Any-hit query for shadow rays: true as soon as anything blocks the ray inside ray_t.
+        // Never computes shading data and need not find the closest hit.
+        virtual bool occluded(const Ray& r, interval ray_t) const = 0;
+
+        // Packet queries over the rays in active. closestHitPacket fills hits[i] and shrinks
+        // packet.ray_t[i] for every ray that found a closer hit, and returns the mask of those
+        // rays; occludedPacket returns the mask of blocked rays. The defaults trace the rays one
+        // at a time; trees and the common primitives override them to share the work.
+        virtual uint32_t closestHitPacket(RayPacket& packet, uint32_t active, RayHit hits[]) const {
+            uint32_t hit_mask = 0;
+
+            for (uint32_t bits = active; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                if (closestHit(packet.rays[i], packet.ray_t[i], hits[i])) {
+                    packet.ray_t[i].max = hits[i].t;
+                    hit_mask |= 1u << i;
+                }
+            }
+
+            return hit_mask;
+        }
+
+        virtual uint32_t occludedPacket(const RayPacket& packet, uint32_t active) const {
+            uint32_t blocked = 0;
+
+            for (uint32_t bits = active; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                if (occluded(packet.rays[i], packet.ray_t[i]))
+                    blocked |= 1u << i;
+            }
+
+            return blocked;
+        }
+
+        // Packet form of intersect: shading data for every ray of active that hit something.
+        // Returns the mask of those rays.
+        uint32_t intersectPacket(RayPacket& packet, uint32_t active, HitRecord recs[]) const {
+            RayHit hits[packet_size];
+            uint32_t hit_mask = closestHitPacket(packet, active, hits);
+
+            for (uint32_t bits = hit_mask; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                hits[i].primitive->computeSurfaceInteraction(packet.rays[i], hits[i], recs[i]);
+            }
+
+            return hit_mask;
+        }
 
         virtual aabb bounding_box() const = 0;
+
+        // Expected cost of one closestHit call, in primitive intersections. Aggregates report
+        // their own SAH cost, so a tree over instances can weigh what each leaf really costs.
+        virtual double intersectionCost() const { return 1; }
 };
 
 #endif
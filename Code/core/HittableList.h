@@ -24,22 +24,53 @@ class HittableList : public Hittable {
             bbox = aabb(bbox, object->bounding_box());
         }
 
-        bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const override {
-            HitRecord temp_rec;
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
             bool hit_anything = false;
-            auto closest_so_far = ray_t.max;
 
             for (const auto& object : objects) {
-                if (object->intersect(r, interval(ray_t.min, closest_so_far), temp_rec)) {
+                if (object->closestHit(r, ray_t, hit)) {
                     hit_anything = true;
-                    closest_so_far = temp_rec.t;
-                    rec = temp_rec;
+                    ray_t.max = hit.t;
                 }
             }
 
             return hit_anything;
         }
 
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            hit.primitive->computeSurfaceInteraction(r, hit, rec);
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            for (const auto& object : objects) {
+                if (object->occluded(r, ray_t))
+                    return true;
+            }
+
+            return false;
+        }
+
+        uint32_t closestHitPacket(RayPacket& packet, uint32_t active, RayHit hits[]) const override {
+            uint32_t hit_mask = 0;
+
+            for (const auto& object : objects) {
+                hit_mask |= object->closestHitPacket(packet, active, hits);
+            }
+
+            return hit_mask;
+        }
+
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t active) const override {
+            uint32_t blocked = 0;
+
+            for (const auto& object : objects) {
+                blocked |= object->occludedPacket(packet, active & ~blocked);
+                if (blocked == active) break;
+            }
+
+            return blocked;
+        }
+
         aabb bounding_box() const override { return bbox; }
 
     private:
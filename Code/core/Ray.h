@@ -1,23 +1,103 @@
 #ifndef RAY_H
 #define RAY_H
 
+#include <cstdint>
+#include <cstring>
+
 #include "../math/vec3.h"
 
-class Ray {
+// Ray over the scalar type T; the renderer uses Ray, over the build's `real`
+template <typename T>
+class Ray_t {
     public:
-        Ray() {}
-        Ray(const point3& origin, const vec3& direction) : orig(origin), dir(direction) {}
+        Ray_t() : kz(), shear_x(), shear_y(), shear_z(), inv_dir(), dir_is_neg() {}
+        Ray_t(const vec3_t<T>& origin, const vec3_t<T>& direction) : orig(origin), dir(direction) {
+            // Shear of the watertight triangle test: kz is the dominant direction axis
+            kz = (std::fabs(dir.x()) > std::fabs(dir.y()))
+                ? (std::fabs(dir.x()) > std::fabs(dir.z()) ? 0 : 2)
+                : (std::fabs(dir.y()) > std::fabs(dir.z()) ? 1 : 2);
+
+            shear_z = T(1) / dir[kz];
+            shear_x = dir[(kz + 1) % 3] * shear_z;
+            shear_y = dir[(kz + 2) % 3] * shear_z;
 
-        point3 origin() const  { return orig; }
-        vec3 direction() const { return dir; }
+            // Slab tests against bounding boxes
+            for (int a = 0; a < 3; ++a) {
+                inv_dir[a] = T(1) / dir[a];
+                dir_is_neg[a] = inv_dir[a] < 0;
+            }
+        }
 
-        point3 at(double t) const {
+        vec3_t<T> origin() const  { return orig; }
+        vec3_t<T> direction() const { return dir; }
+
+        vec3_t<T> at(T t) const {
             return orig + t*dir;
         }
 
+        // Ray-aligned frame, computed once per ray instead of once per triangle test
+        int kz;
+        T shear_x, shear_y, shear_z;
+
+        // Inverse direction and its signs, for box tests
+        T inv_dir[3];
+        int dir_is_neg[3];
+
     private:
-        point3 orig;
-        vec3 dir;
+        vec3_t<T> orig;
+        vec3_t<T> dir;
+};
+
+using Ray = Ray_t<real>;
+
+// Scales of offset_ray_origin. The float constants are Waechter and Binder's; double keeps the
+// same margin relative to its precision: 256 float ulps are 2^37 double ulps.
+template <typename T> struct RayOffset;
+
+template <> struct RayOffset<float> {
+    using Bits = int32_t;
+    static constexpr float origin = 1.0f / 32;          // Below this |coordinate|, offset in absolute terms
+    static constexpr float float_scale = 1.0f / 65536;  // Absolute offset near the origin
+    static constexpr float int_scale = 256;              // Offset in ulps elsewhere
+};
+
+template <> struct RayOffset<double> {
+    using Bits = int64_t;
+    static constexpr double origin = 1.0 / 32;
+    static constexpr double float_scale = 1.0 / 65536 / (1ull << 29);
+    static constexpr double int_scale = 256.0 * (1ull << 29);
 };
 
+// Origin of a ray leaving a surface point p with normal n (Waechter and Binder, "A Fast and
+// Robust Method for Avoiding Self-Intersection", Ray Tracing Gems ch. 6): p is pushed along n,
+// to the side the direction leaves on, by a number of ulps of each coordinate. The push grows
+// with the rounding error of p, where a fixed t_min is too large near the origin and too small
+// far from it, so spawned rays are traced from t = 0.
+template <typename T>
+vec3_t<T> offset_ray_origin(const vec3_t<T>& p, vec3_t<T> n, const vec3_t<T>& direction) {
+    using Offset = RayOffset<T>;
+    using Bits = typename Offset::Bits;
+
+    if (dot(n, direction) < 0) n = -n;
+
+    vec3_t<T> origin;
+    for (int a = 0; a < 3; ++a) {
+        if (std::fabs(p[a]) < Offset::origin) {
+            origin[a] = p[a] + Offset::float_scale * n[a];
+            continue;
+        }
+
+        // Step the bit pattern: away from zero when n points away from zero, towards it otherwise
+        Bits of = static_cast<Bits>(Offset::int_scale * n[a]);
+        T coordinate = p[a];
+        Bits bits;
+        std::memcpy(&bits, &coordinate, sizeof(T));
+        bits += (coordinate < 0) ? -of : of;
+        std::memcpy(&coordinate, &bits, sizeof(T));
+        origin[a] = coordinate;
+    }
+
+    return origin;
+}
+
 #endif  // RAY_H
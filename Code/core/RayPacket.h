@@ -0,0 +1,34 @@
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include <cstdint>
+
+#include "../core/Ray.h"
+#include "../math/interval.h"
+
+// Rays traced together: camera rays of neighbouring pixels, or the shadow rays of one hit
+// point. Which rays take part in a query is a bit mask (bit i for rays[i]), so rays can drop
+// out (missed a box, found a blocker) without reordering the packet. Queries shrink ray_t[i]
+// to the closest hit found so far, like the single-ray closestHit does with its own interval.
+constexpr int packet_size = 8;
+
+struct RayPacket {
+    Ray rays[packet_size];
+    interval ray_t[packet_size];
+    int count = 0;   // Rays in use, always the first ones
+
+    void add(const Ray& r, interval t) {
+        rays[count] = r;
+        ray_t[count] = t;
+        ++count;
+    }
+
+    uint32_t mask() const { return (1u << count) - 1; }
+};
+
+// Index of the lowest ray in a mask; loops over a mask clear that bit with bits &= bits - 1
+inline int first_ray(uint32_t bits) {
+    return __builtin_ctz(bits);
+}
+
+#endif
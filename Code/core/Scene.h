@@ -1,16 +1,20 @@
 #ifndef SCENE_H
 #define SCENE_H
 
+#include <utility>
+
+#include "Animation.h"
 #include "Camera.h"
 #include "HittableList.h"
 #include "../geometry/bvh.h"
 #include "../lights/Light.h"
+#include "../materials/Material.h"
 #include "../misc/utils.h"
 
 class Scene {
     public:
-        Scene(shared_ptr<Camera> camera, HittableList& world, std::vector<shared_ptr<Light>>& lights) 
-            : camera(camera), world(world), lights(lights) {}
+        Scene(shared_ptr<Camera> camera, HittableList& world, std::vector<shared_ptr<Light>>& lights, MaterialTable materials, Animation animation = Animation())
+            : camera(camera), world(world), lights(lights), materials(std::move(materials)), animation(std::move(animation)) {}
 
         // Get the camera in the scene
         const shared_ptr<Camera>& getCamera() const {
@@ -27,10 +31,22 @@ class Scene {
             return world;
         }
 
+        // Get the materials the scene's primitives refer to
+        const MaterialTable& getMaterials() const {
+            return materials;
+        }
+
+        // Get the frame sequence (moving instances and their top-level BVH)
+        Animation& getAnimation() {
+            return animation;
+        }
+
     private:
         shared_ptr<Camera> camera;
         HittableList world;
         std::vector<shared_ptr<Light>> lights;
+        MaterialTable materials;
+        Animation animation;
 
 };
 
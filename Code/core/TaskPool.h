@@ -0,0 +1,107 @@
+#ifndef TASKPOOL_H
+#define TASKPOOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of threads running tasks from one shared queue. A thread waiting for its tasks
+// runs queued ones meanwhile, so tasks may spawn and wait for tasks of their own, and at most
+// threadCount() tasks ever run at once: the workers plus the thread that created the pool.
+class TaskPool {
+    public:
+        // Tasks waited for together
+        class Group {
+            friend class TaskPool;
+            int pending = 0;
+        };
+
+        explicit TaskPool(int threads) {
+            for (int id = 1; id < threads; ++id) {
+                workers.emplace_back([this]() { work(); });
+            }
+        }
+
+        ~TaskPool() {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            changed.notify_all();
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+        TaskPool(const TaskPool&) = delete;
+        TaskPool& operator=(const TaskPool&) = delete;
+
+        int threadCount() const {
+            return static_cast<int>(workers.size()) + 1;
+        }
+
+        void run(Group& group, std::function<void()> fn) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ++group.pending;
+                tasks.push_back({std::move(fn), &group});
+            }
+            changed.notify_one();
+        }
+
+        // Block until every task of the group has finished, running queued tasks meanwhile
+        void wait(Group& group) {
+            std::unique_lock<std::mutex> guard(lock);
+            while (group.pending > 0) {
+                if (!tasks.empty()) {
+                    runNext(guard);
+                } else {
+                    changed.wait(guard);
+                }
+            }
+        }
+
+    private:
+        struct Task {
+            std::function<void()> fn;
+            Group* group;
+        };
+
+        std::mutex lock;
+        std::condition_variable changed;   // A task was queued or finished, or the pool stops
+        std::deque<Task> tasks;
+        std::vector<std::thread> workers;
+        bool stopping = false;
+
+        void work() {
+            std::unique_lock<std::mutex> guard(lock);
+            while (true) {
+                if (!tasks.empty()) {
+                    runNext(guard);
+                } else if (stopping) {
+                    return;
+                } else {
+                    changed.wait(guard);
+                }
+            }
+        }
+
+        // Newest task first: it is the smallest and its data is the most recently touched
+        void runNext(std::unique_lock<std::mutex>& guard) {
+            Task task = std::move(tasks.back());
+            tasks.pop_back();
+
+            guard.unlock();
+            task.fn();
+            guard.lock();
+
+            --task.group->pending;
+            changed.notify_all();
+        }
+};
+
+#endif
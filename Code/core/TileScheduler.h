@@ -0,0 +1,127 @@
+#ifndef TILESCHEDULER_H
+#define TILESCHEDULER_H
+
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Rectangular block of pixels [x0, x1) x [y0, y1)
+struct Tile {
+    int x0, y0;
+    int x1, y1;
+};
+
+// Splits the image into tiles and renders them on a pool of worker threads.
+// Every worker owns a deque seeded with a contiguous run of tiles; it pops work from
+// the front of its own deque and, once that runs dry, steals from the back of another
+// worker's deque. Expensive tiles (refractive objects, soft shadows) therefore get
+// balanced across the pool instead of stalling a statically assigned stripe.
+class TileScheduler {
+    public:
+        TileScheduler(int image_width, int image_height, int tile_size, int num_threads) {
+            tile_size = std::max(1, tile_size);
+
+            for (int y = 0; y < image_height; y += tile_size) {
+                for (int x = 0; x < image_width; x += tile_size) {
+                    tiles.push_back({x, y, std::min(x + tile_size, image_width), std::min(y + tile_size, image_height)});
+                }
+            }
+
+            if (num_threads <= 0)
+                num_threads = static_cast<int>(std::thread::hardware_concurrency());
+            num_threads = std::max(1, std::min(num_threads, static_cast<int>(tiles.size())));
+
+            queues = std::vector<WorkQueue>(num_threads);
+
+            // Hand out contiguous runs of tiles so neighbouring tiles share cache lines of the scene
+            size_t per_worker = (tiles.size() + num_threads - 1) / num_threads;
+            for (size_t t = 0; t < tiles.size(); ++t) {
+                queues[t / per_worker].tiles.push_back(t);
+            }
+        }
+
+        int threadCount() const {
+            return static_cast<int>(queues.size());
+        }
+
+        size_t tileCount() const {
+            return tiles.size();
+        }
+
+        // Render every tile with `render_tile(const Tile&)`, blocking until all tiles are done.
+        // The calling thread takes part as worker 0.
+        template <typename TileFn>
+        void run(TileFn&& render_tile) {
+            tiles_done = 0;
+
+            std::vector<std::thread> workers;
+            for (int id = 1; id < threadCount(); ++id) {
+                workers.emplace_back([this, id, &render_tile]() { work(id, render_tile); });
+            }
+
+            work(0, render_tile);
+
+            for (auto& worker : workers) {
+                worker.join();
+            }
+        }
+
+    private:
+        struct WorkQueue {
+            std::mutex lock;
+            std::deque<size_t> tiles;
+        };
+
+        std::vector<Tile> tiles;
+        std::vector<WorkQueue> queues;
+        size_t tiles_done = 0;
+        std::mutex progress_lock;
+
+        template <typename TileFn>
+        void work(int id, TileFn& render_tile) {
+            size_t tile;
+
+            while (pop(id, tile) || steal(id, tile)) {
+                render_tile(tiles[tile]);
+                reportProgress();
+            }
+        }
+
+        // Take the next tile in scanline order from our own deque
+        bool pop(int id, size_t& tile) {
+            std::lock_guard<std::mutex> guard(queues[id].lock);
+            if (queues[id].tiles.empty()) return false;
+
+            tile = queues[id].tiles.front();
+            queues[id].tiles.pop_front();
+            return true;
+        }
+
+        // Take the last tile of the first other worker that still has some left, i.e. the one
+        // its owner would have reached last
+        bool steal(int id, size_t& tile) {
+            for (int offset = 1; offset < threadCount(); ++offset) {
+                WorkQueue& victim = queues[(id + offset) % threadCount()];
+
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if (victim.tiles.empty()) continue;
+
+                tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+
+            return false;
+        }
+
+        void reportProgress() {
+            std::lock_guard<std::mutex> guard(progress_lock);
+            ++tiles_done;
+            std::clog << "\rTiles remaining: " << (tiles.size() - tiles_done) << ' ' << std::flush;
+        }
+};
+
+#endif
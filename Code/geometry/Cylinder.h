@@ -1,149 +1,188 @@
 #ifndef CYLINDER_H
 #define CYLINDER_H
 
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
 #include "../core/Hittable.h"
 #include "../math/vec3.h"
 #include "../misc/utils.h"
 
+// Part of a cylinder a ray hits
+enum class CylinderPart { Body, BottomCap, TopCap };
+
+// Cylinder-local frame: the unit axis and two unit vectors across it, around the center
+struct CylinderFrame {
+    point3 center;
+    vec3 u, v, axis;
+
+    CylinderFrame() {}
+
+    // Any axis length is accepted; it only gives the direction
+    CylinderFrame(const point3& _center, const vec3& _axis) : center(_center), axis(unit_vector(_axis)) {
+        // Orthonormal basis without a branch on the axis (Duff et al. 2017)
+        real sign = std::copysign(1.0, axis.z());
+        real a = -1.0 / (sign + axis.z());
+        real b = axis.x() * axis.y() * a;
+        u = vec3(1.0 + sign * axis.x() * axis.x() * a, sign * b, -sign * axis.x());
+        v = vec3(b, sign + axis.y() * axis.y() * a, -axis.y());
+    }
+};
+
+// Intersects the ray with the solid cylinder of the given radius whose caps sit `height` above
+// and below the center. In the frame, the solid is the overlap of the tube x^2 + y^2 <= r^2 and
+// the slab |z| <= height; the ray is inside both from its entry to its exit, and the surface it
+// crosses at each end is whichever of tube and slab it crossed last on the way in (first on
+// the way out). The first of the two crossings inside ray_t is the hit. `projection` is the
+// hit's height along the axis.
+inline bool cylinder_hit(const CylinderFrame& frame, real radius, real height, const Ray& r, interval ray_t,
+                         real& t, CylinderPart& part, real& projection) {
+    vec3 oc = r.origin() - frame.center;
+    vec3 direction = r.direction();
+
+    real ox = dot(oc, frame.u), oy = dot(oc, frame.v), oz = dot(oc, frame.axis);
+    real dx = dot(direction, frame.u), dy = dot(direction, frame.v), dz = dot(direction, frame.axis);
+
+    // Between the caps
+    real slab_in = -INFTY, slab_out = INFTY;
+    CylinderPart cap_in = CylinderPart::BottomCap, cap_out = CylinderPart::TopCap;
+    if (dz != 0) {
+        slab_in = (-height - oz) / dz;
+        slab_out = (height - oz) / dz;
+        if (dz < 0) {
+            std::swap(slab_in, slab_out);
+            std::swap(cap_in, cap_out);
+        }
+    } else if (std::fabs(oz) > height) {
+        return false;
+    }
+
+    // Inside the tube; a ray along the axis is inside it everywhere or nowhere
+    real tube_in = -INFTY, tube_out = INFTY;
+    real a = dx*dx + dy*dy;
+    real b = ox*dx + oy*dy;
+    real c = ox*ox + oy*oy - radius*radius;
+    if (a != 0) {
+        real discriminant = b*b - a*c;
+        if (discriminant < 0) return false;
+
+        real root = std::sqrt(discriminant);
+        tube_in = (-b - root) / a;
+        tube_out = (-b + root) / a;
+    } else if (c > 0) {
+        return false;
+    }
+
+    real t_enter = std::max(slab_in, tube_in);
+    real t_exit = std::min(slab_out, tube_out);
+    if (t_enter > t_exit) return false;
+
+    if (ray_t.surrounds(t_enter)) {
+        t = t_enter;
+        part = tube_in >= slab_in ? CylinderPart::Body : cap_in;
+    } else if (ray_t.surrounds(t_exit)) {
+        t = t_exit;
+        part = tube_out <= slab_out ? CylinderPart::Body : cap_out;
+    } else {
+        return false;
+    }
+
+    projection = oz + t * dz;
+    return true;
+}
+
+// Each cap is a disc spanning radius * sqrt(1 - axis_i^2) along axis i, around its center at
+// height * axis_i from the cylinder's
+inline aabb cylinder_bounds(const CylinderFrame& frame, real radius, real height) {
+    vec3 extent;
+    for (int i = 0; i < 3; ++i) {
+        real along = frame.axis[i];
+        extent[i] = height * std::fabs(along) + radius * std::sqrt(std::max<real>(0, 1 - along * along));
+    }
+
+    return aabb(frame.center - extent, frame.center + extent);
+}
+
+// Shading data of a hit from cylinder_hit, whose part and projection are the hit's u and v.
+// Shared by Cylinder and the BVH's cylinder table.
+inline void cylinder_surface(const CylinderFrame& frame, real radius, real height, MaterialId material,
+                             const Ray& r, const RayHit& hit, HitRecord& rec) {
+    rec.t = hit.t;
+    rec.p = r.at(hit.t);
+    rec.material = material;
+
+    // The hit point is moved back onto the surface it hit: r.at(t) is off by the rounding
+    // error of t along the whole ray, which rays spawned from it would have to step over
+    CylinderPart part = static_cast<CylinderPart>(hit.u);
+    if (part != CylinderPart::Body) {
+        // Record hit information (intersection with one of the caps)
+        real cap = (part == CylinderPart::TopCap) ? height : -height;
+        rec.p += (cap - dot(rec.p - frame.center, frame.axis)) * frame.axis;
+        rec.set_face_normal(r, part == CylinderPart::TopCap ? frame.axis : -frame.axis);
+        return;
+    }
+
+    // Record hit information (intersection with main body)
+    real projection = hit.v;
+    vec3 radial = rec.p - frame.center - projection * frame.axis;
+    vec3 outward_normal = unit_vector(radial);
+    rec.p += (radius - radial.length()) * outward_normal;
+    rec.set_face_normal(r, outward_normal);
+
+    // Calculate texture coordinates if necessary: u is the angle around the axis, measured in
+    // the frame; v the height from the bottom cap to the top
+    if (material_textured(material)) {
+        real phi = atan2(dot(radial, frame.v), dot(radial, frame.u)) + PI;
+
+        rec.texture_u = phi / (2 * PI);
+        rec.texture_v = (projection / height + 1) / 2;
+    }
+}
+
 class Cylinder : public Hittable {
     public:
-        Cylinder(const point3& _center, vec3 _axis, double _radius, double _height, shared_ptr<Material> _material)
-            : center(_center), axis(_axis), radius(_radius), height(_height), mat(_material) {
-                vec3 minimumExtreme, maximumExtreme;
-
-                if (axis.x() == 1) {
-                    // If aligned with the x-axis...
-                    minimumExtreme = vec3(center.x() - height, center.y() - radius, center.z() - radius);
-                    maximumExtreme = vec3(center.x() + height, center.y() + radius, center.z() + radius);
-                } else if (axis.y() == 1) {
-                    // If aligned with the y-axis...
-                    minimumExtreme = vec3(center.x() - radius, center.y() - height, center.z() - radius);
-                    maximumExtreme = vec3(center.x() + radius, center.y() + height, center.z() + radius);
-                } else if (axis.z() == 1) {
-                    // If aligned with the z-axis...
-                    minimumExtreme = vec3(center.x() - radius, center.y() - radius, center.z() - height);
-                    maximumExtreme = vec3(center.x() + radius, center.y() + radius, center.z() + height);
-                }
-
-                bbox = aabb(minimumExtreme, maximumExtreme);
-            }
+        // The axis may have any length and direction; height is measured from the center to
+        // either cap
+        Cylinder(const point3& _center, vec3 _axis, real _radius, real _height, MaterialId _material)
+            : frame(_center, _axis), radius(_radius), height(_height), material(_material),
+              bbox(cylinder_bounds(frame, _radius, _height)) {}
 
         aabb bounding_box() const override { return bbox; }
 
-        bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const override {
-            // Define parameters
-            vec3 oc = r.origin() - center;
-
-            double a = r.direction().length_squared() - dot(r.direction(), axis) * dot(r.direction(), axis);
-            double b = 2.0 * (dot(oc, r.direction()) - dot(oc, axis) * dot(r.direction(), axis));
-            double c = oc.length_squared() - dot(oc, axis) * dot(oc, axis) - radius * radius;
-            double discriminant = b * b - 4 * a * c;
-
-            // Check for intersection
-            if (discriminant > 0) {
-                double root1 = (-b - sqrt(discriminant)) / (2.0 * a);
-                double root2 = (-b + sqrt(discriminant)) / (2.0 * a);
-
-                // Check if roots are within valid range
-                if (!ray_t.contains(root1) && !ray_t.contains(root2)) {
-                    return false;
-                }
-                
-                // Check for intersection within the height of the cylinder
-                double hit_point = root1 < root2 ? root1 : root2;
-                double projection = dot((r.origin() + hit_point * r.direction()) - center, axis);
-
-                /* Check for intersections with bottom and top planes
-                * Planes equations containing the c1 and c2 points with their d normals are
-                * d . (x - ci) = 0
-                * 
-                * Ray's parametric equation is
-                * x(t) = ray.direction() * t + ray.origin()
-                * 
-                * So we must solve
-                * d.(ray.direction()*t + ray.origin() - ci) = 0
-                * t = -(d.(ray.origin() - ci))/(d.ray.direction())
-                */
-
-               // If ray and axis are parallel, ray does not hit the caps
-               if (dot(r.direction(), axis) != 0) {
-                    vec3 c1 = center - height * axis;
-                    vec3 c2 = center + height * axis;
-                    double root3 = -(dot(axis, r.origin() - c1)) / (dot(axis, r.direction()));
-                    double root4 = -(dot(axis, r.origin() - c2)) / (dot(axis, r.direction()));
-                    vec3 point3 = r.at(root3);
-                    vec3 point4 = r.at(root4);
-
-                    // If hit_point is closer, do not render bottom cap (avoid superposition)
-                    if (hit_point >= root3 && root3 > 0 && (point3 - c1).length_squared() <= radius * radius) {
-                        // Record hit information (intersection with bottom cap)
-                        rec.t = root3;
-                        rec.p = point3;
-                        vec3 normal = unit_vector(axis);
-                        rec.set_face_normal(r, normal);
-                        rec.mat = mat;
-                        
-                        return true;
-                    }
-
-                    if (root4 > 0 && (point4 - c2).length_squared() <= radius * radius) {
-                        // Record hit information (intersection with top cap)
-                        rec.t = root4;
-                        rec.p = point4;
-                        vec3 normal = unit_vector(axis);
-                        rec.set_face_normal(r, normal);
-                        rec.mat = mat;
-
-                        return true;
-                    }
-               }
-
-                if (projection < -height || projection > height) {
-                    return false;
-                }
-
-                // Record hit information (intersection with main body)
-                rec.t = hit_point;
-                rec.p = r.at(rec.t);
-                vec3 normal = unit_vector(rec.p - center - projection * axis);
-                rec.set_face_normal(r, normal);
-                rec.mat = mat;
-
-                // Calculate texture coordinates if necessary
-                if (mat->isTextured())
-                    get_cylinder_uv(rec.p, rec.texture_u, rec.texture_v);
-
-                return true;
-            }
-
-            return false;
+        // The hit's u holds the CylinderPart that was hit, v its projection on the axis
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
+            real t, projection;
+            CylinderPart part;
+            if (!cylinder_hit(frame, radius, height, r, ray_t, t, part, projection))
+                return false;
+
+            // Only a winning candidate may touch the record
+            hit.t = t;
+            hit.primitive = this;
+            hit.u = static_cast<real>(part);
+            hit.v = projection;
+            return true;
         }
 
-    private:
-        point3 center;
-        vec3 axis;
-        double radius;
-        double height;
-        shared_ptr<Material> mat;
-        aabb bbox;
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            cylinder_surface(frame, radius, height, material, r, hit, rec);
+        }
 
-        void get_cylinder_uv(const point3& p, double& u, double& v) const {
-            // Calculate the azimuthal angle around the cylinder for any orientation
-            double phi;
-
-            if (axis.x() == 1) {
-                phi = atan2(p.y(), p.z());
-            } else if (axis.y() == 1) {
-                phi = atan2(p.x(), p.z());
-            } else if (axis.z() == 1) {
-                phi = atan2(p.y(), p.x());
-            }
-
-            // Map the projection of the point onto the cylinder's height to the v texture coordinate
-            v = dot(p - center, axis) / height;
-            v = (v + 1) / 2;
-            u = phi / (2 * PI);
+        bool occluded(const Ray& r, interval ray_t) const override {
+            real t, projection;
+            CylinderPart part;
+            return cylinder_hit(frame, radius, height, r, ray_t, t, part, projection);
         }
+
+    private:
+        friend class PrimitiveStore;
+
+        CylinderFrame frame;
+        real radius;
+        real height;
+        MaterialId material;
+        aabb bbox;
 };
 
 #endif
@@ -0,0 +1,126 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "../core/Hittable.h"
+#include "../math/transform.h"
+#include "../misc/utils.h"
+
+// A placement of shared geometry: an object-to-world transform plus a pointer to a
+// bottom-level BVH built once in object space. Rays are moved into object space instead of
+// the geometry being copied, so any number of instances share one tree, and moving an
+// instance only changes its world bounds (the top-level BVH over instances is all that needs
+// rebuilding). Directions are transformed without renormalizing, which keeps hit distances
+// the same in both spaces. Instances are one level deep: shared geometry holds no instances.
+class Instance : public Hittable {
+    public:
+        Instance(shared_ptr<Hittable> _object, const Transform& _object_to_world) : object(_object) {
+            setTransform(_object_to_world);
+        }
+
+        void setTransform(const Transform& _object_to_world) {
+            object_to_world = _object_to_world;
+            world_to_object = _object_to_world.inverse();
+            bbox = transformedBounds();
+        }
+
+        const Transform& transform() const { return object_to_world; }
+
+        const shared_ptr<Hittable>& geometry() const { return object; }
+
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
+            RayHit local_hit;
+            if (!object->closestHit(toObject(r), ray_t, local_hit))
+                return false;
+
+            // Remember which primitive inside the instance won; shading goes through the instance
+            hit.t = local_hit.t;
+            hit.u = local_hit.u;
+            hit.v = local_hit.v;
+            hit.index = local_hit.index;
+            hit.primitive = this;
+            hit.instanced = local_hit.primitive;
+            return true;
+        }
+
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            hit.instanced->computeSurfaceInteraction(toObject(r), hit, rec);
+
+            // Back to world space. Which side the ray came from does not change under an affine
+            // map, so front_face carries over as is.
+            rec.p = object_to_world.point(rec.p);
+            rec.normal = unit_vector(object_to_world.normal(rec.normal));
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            return object->occluded(toObject(r), ray_t);
+        }
+
+        // Packets move into object space as a whole and stay packets inside the shared tree
+        uint32_t closestHitPacket(RayPacket& packet, uint32_t active, RayHit hits[]) const override {
+            RayPacket local = toObject(packet, active);
+            RayHit local_hits[packet_size];
+            uint32_t hit_mask = object->closestHitPacket(local, active, local_hits);
+
+            for (uint32_t bits = hit_mask; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                hits[i].t = local_hits[i].t;
+                hits[i].u = local_hits[i].u;
+                hits[i].v = local_hits[i].v;
+                hits[i].index = local_hits[i].index;
+                hits[i].primitive = this;
+                hits[i].instanced = local_hits[i].primitive;
+                packet.ray_t[i].max = local_hits[i].t;
+            }
+
+            return hit_mask;
+        }
+
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t active) const override {
+            return object->occludedPacket(toObject(packet, active), active);
+        }
+
+        aabb bounding_box() const override { return bbox; }
+
+        // Moving the ray into object space costs about one primitive test on top of the geometry
+        double intersectionCost() const override { return 1 + object->intersectionCost(); }
+
+    private:
+        shared_ptr<Hittable> object;
+        Transform object_to_world;
+        Transform world_to_object;
+        aabb bbox;
+
+        Ray toObject(const Ray& r) const {
+            return Ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()));
+        }
+
+        RayPacket toObject(const RayPacket& packet, uint32_t active) const {
+            RayPacket local;
+            local.count = packet.count;
+
+            for (uint32_t bits = active; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                local.rays[i] = toObject(packet.rays[i]);
+                local.ray_t[i] = packet.ray_t[i];
+            }
+
+            return local;
+        }
+
+        // World box around the eight transformed corners of the object box
+        aabb transformedBounds() const {
+            aabb local = object->bounding_box();
+            aabb world;
+
+            for (int corner = 0; corner < 8; ++corner) {
+                point3 p = object_to_world.point(point3((corner & 1) ? local.x.max : local.x.min,
+                                                        (corner & 2) ? local.y.max : local.y.min,
+                                                        (corner & 4) ? local.z.max : local.z.min));
+                world = aabb(world, aabb(interval(p.x(), p.x()), interval(p.y(), p.y()), interval(p.z(), p.z())));
+            }
+
+            return world;
+        }
+};
+
+#endif
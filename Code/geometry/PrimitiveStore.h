@@ -0,0 +1,528 @@
+#ifndef PRIMITIVESTORE_H
+#define PRIMITIVESTORE_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../core/Hittable.h"
+#include "../misc/utils.h"
+#include "Cylinder.h"
+#include "Sphere.h"
+#include "SphereKernel.h"
+#include "Triangle.h"
+#include "TriangleKernel.h"
+#include "TriangleMesh.h"
+
+// Primitive types with a batch kernel; everything else (instances, nested trees, new shapes)
+// goes through the Hittable interface
+enum class PrimitiveType : uint8_t { Sphere, Triangle, MeshTriangle, Cylinder, Custom };
+
+// The primitives of a BVH, in leaf order. Spheres, cylinders and triangles live only as rows
+// of one structure-of-arrays table per type, mesh triangles as (mesh, triangle) references
+// into their mesh's buffers, and only Custom entries keep their Hittable. A run of one type in
+// a leaf is a contiguous range of its table, which one batch kernel tests. Hits on a table
+// entry name the owner (the BVH) as their primitive and the entry as their index.
+class PrimitiveStore {
+    public:
+        PrimitiveStore() {}
+
+        // The objects' primitives in the objects' order; a mesh becomes one entry per triangle
+        explicit PrimitiveStore(const std::vector<shared_ptr<Hittable>>& objects) {
+            for (const shared_ptr<Hittable>& object : objects) {
+                add(object);
+            }
+            finish();
+        }
+
+        void setOwner(const Hittable* _owner) { owner = _owner; }
+
+        void add(const shared_ptr<Hittable>& object) {
+            if (auto sphere = dynamic_cast<const Sphere*>(object.get())) {
+                addSphere(sphere->center, sphere->radius, sphere->material, sphere->rotationAngle);
+            } else if (auto triangle = dynamic_cast<const Triangle*>(object.get())) {
+                addTriangle(triangle->vertex1, triangle->vertex2, triangle->vertex3, triangle->material);
+            } else if (auto cylinder = dynamic_cast<const Cylinder*>(object.get())) {
+                addCylinder(cylinder->frame, cylinder->radius, cylinder->height, cylinder->material);
+            } else if (auto mesh = std::dynamic_pointer_cast<const TriangleMesh>(object)) {
+                uint32_t id = addMesh(mesh);
+                for (uint32_t t = 0; t < mesh->triangleCount(); ++t) {
+                    addMeshTriangle(id, t);
+                }
+            } else {
+                push(PrimitiveType::Custom, customs.size());
+                customs.push_back(object);
+            }
+        }
+
+        void addSphere(const point3& center, real radius, MaterialId material, real rotation) {
+            push(PrimitiveType::Sphere, spheres.radius.size());
+            spheres.cx.push_back(center.x());
+            spheres.cy.push_back(center.y());
+            spheres.cz.push_back(center.z());
+            spheres.radius.push_back(radius);
+            spheres.rotation.push_back(rotation);
+            spheres.material.push_back(material);
+        }
+
+        // The vertices of a Triangle, already in its counter-clockwise order
+        void addTriangle(const point3& p0, const point3& p1, const point3& p2, MaterialId material) {
+            push(PrimitiveType::Triangle, triangles.count);
+            triangles.add(p0, p1, p2);
+            triangles.material.push_back(material);
+        }
+
+        void addCylinder(const CylinderFrame& frame, real radius, real height, MaterialId material) {
+            push(PrimitiveType::Cylinder, cylinders.radius.size());
+            cylinders.frame.push_back(frame);
+            cylinders.radius.push_back(radius);
+            cylinders.height.push_back(height);
+            cylinders.material.push_back(material);
+        }
+
+        // Mesh triangles refer to their mesh by the number addMesh returns
+        uint32_t addMesh(const shared_ptr<const TriangleMesh>& mesh) {
+            meshes.push_back(mesh);
+            return static_cast<uint32_t>(meshes.size() - 1);
+        }
+
+        void addMeshTriangle(uint32_t mesh, uint32_t triangle) {
+            push(PrimitiveType::MeshTriangle, mesh_triangles.mesh.size());
+            mesh_triangles.mesh.push_back(mesh);
+            mesh_triangles.triangle.push_back(triangle);
+        }
+
+        // Once every entry is added
+        void finish() { triangles.pad(); }
+
+        size_t size() const { return types.size(); }
+
+        PrimitiveType type(uint32_t entry) const { return types[entry]; }
+
+        aabb bounds(uint32_t entry) const {
+            uint32_t slot = slots[entry];
+
+            switch (types[entry]) {
+                case PrimitiveType::Sphere:
+                    return sphere_bounds(spheres.center(slot), spheres.radius[slot]);
+                case PrimitiveType::Triangle: {
+                    point3 p0, p1, p2;
+                    triangles.vertices(slot, p0, p1, p2);
+                    return triangle_bounds(p0, p1, p2);
+                }
+                case PrimitiveType::MeshTriangle:
+                    return meshes[mesh_triangles.mesh[slot]]->triangleBounds(mesh_triangles.triangle[slot]);
+                case PrimitiveType::Cylinder:
+                    return cylinder_bounds(cylinders.frame[slot], cylinders.radius[slot], cylinders.height[slot]);
+                case PrimitiveType::Custom:
+                    break;
+            }
+            return customs[slot]->bounding_box();
+        }
+
+        // Cost of intersecting the entry, in primitive intersections
+        double cost(uint32_t entry) const {
+            return types[entry] == PrimitiveType::Custom ? customs[slots[entry]]->intersectionCost() : 1;
+        }
+
+        // The entries order[0], order[1], ... of this store, with its meshes and owner
+        PrimitiveStore reordered(const std::vector<uint32_t>& order) const {
+            PrimitiveStore result;
+            result.owner = owner;
+            result.meshes = meshes;
+            result.types.reserve(order.size());
+            result.slots.reserve(order.size());
+
+            for (uint32_t entry : order) {
+                uint32_t slot = slots[entry];
+
+                switch (types[entry]) {
+                    case PrimitiveType::Sphere:
+                        result.addSphere(spheres.center(slot), spheres.radius[slot], spheres.material[slot], spheres.rotation[slot]);
+                        break;
+                    case PrimitiveType::Triangle: {
+                        point3 p0, p1, p2;
+                        triangles.vertices(slot, p0, p1, p2);
+                        result.addTriangle(p0, p1, p2, triangles.material[slot]);
+                        break;
+                    }
+                    case PrimitiveType::MeshTriangle:
+                        result.addMeshTriangle(mesh_triangles.mesh[slot], mesh_triangles.triangle[slot]);
+                        break;
+                    case PrimitiveType::Cylinder:
+                        result.addCylinder(cylinders.frame[slot], cylinders.radius[slot], cylinders.height[slot], cylinders.material[slot]);
+                        break;
+                    case PrimitiveType::Custom:
+                        result.push(PrimitiveType::Custom, result.customs.size());
+                        result.customs.push_back(customs[slot]);
+                        break;
+                }
+            }
+
+            result.finish();
+            return result;
+        }
+
+        // Closest hit among the primitives [first, first + count), shrinking ray_t to it
+        bool closestHit(uint32_t first, uint32_t count, const Ray& r, interval& ray_t, RayHit& hit) const {
+            bool hit_anything = false;
+
+            forEachRun(first, count, [&](PrimitiveType type, uint32_t index, uint32_t n) {
+                if (closestHitRun(type, index, n, r, ray_t, hit)) hit_anything = true;
+                return true;
+            });
+
+            return hit_anything;
+        }
+
+        bool occluded(uint32_t first, uint32_t count, const Ray& r, interval ray_t) const {
+            bool blocked = false;
+
+            forEachRun(first, count, [&](PrimitiveType type, uint32_t index, uint32_t n) {
+                blocked = occludedRun(type, index, n, r, ray_t);
+                return !blocked;
+            });
+
+            return blocked;
+        }
+
+        // Packet forms, with the results of Hittable's packet queries. Custom primitives get
+        // the whole packet, so instances keep tracing it as a packet.
+        uint32_t closestHitPacket(uint32_t first, uint32_t count, RayPacket& packet, uint32_t active, RayHit hits[]) const {
+            uint32_t hit_mask = 0;
+
+            forEachRun(first, count, [&](PrimitiveType type, uint32_t index, uint32_t n) {
+                if (type == PrimitiveType::Custom) {
+                    for (uint32_t k = index; k < index + n; ++k) {
+                        hit_mask |= customs[slots[k]]->closestHitPacket(packet, active, hits);
+                    }
+                    return true;
+                }
+
+                for (uint32_t bits = active; bits; bits &= bits - 1) {
+                    int i = first_ray(bits);
+                    if (closestHitRun(type, index, n, packet.rays[i], packet.ray_t[i], hits[i]))
+                        hit_mask |= 1u << i;
+                }
+                return true;
+            });
+
+            return hit_mask;
+        }
+
+        uint32_t occludedPacket(uint32_t first, uint32_t count, const RayPacket& packet, uint32_t active) const {
+            uint32_t blocked = 0;
+
+            forEachRun(first, count, [&](PrimitiveType type, uint32_t index, uint32_t n) {
+                if (type == PrimitiveType::Custom) {
+                    for (uint32_t k = index; k < index + n && blocked != active; ++k) {
+                        blocked |= customs[slots[k]]->occludedPacket(packet, active & ~blocked);
+                    }
+                } else {
+                    for (uint32_t bits = active & ~blocked; bits; bits &= bits - 1) {
+                        int i = first_ray(bits);
+                        if (occludedRun(type, index, n, packet.rays[i], packet.ray_t[i]))
+                            blocked |= 1u << i;
+                    }
+                }
+                return blocked != active;
+            });
+
+            return blocked;
+        }
+
+        // Shading data of a hit on the table entry hit.index
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const {
+            uint32_t slot = slots[hit.index];
+
+            switch (types[hit.index]) {
+                case PrimitiveType::Sphere:
+                    sphere_surface(spheres.center(slot), spheres.radius[slot], spheres.material[slot], r, hit, rec);
+                    return;
+                case PrimitiveType::Triangle: {
+                    point3 p0, p1, p2;
+                    triangles.vertices(slot, p0, p1, p2);
+                    triangle_surface(p0, p1, p2, triangle_normal(p0, p1, p2), triangles.material[slot], r, hit, rec);
+                    return;
+                }
+                case PrimitiveType::MeshTriangle:
+                    meshes[mesh_triangles.mesh[slot]]->surface(mesh_triangles.triangle[slot], r, hit, rec);
+                    return;
+                case PrimitiveType::Cylinder:
+                    cylinder_surface(cylinders.frame[slot], cylinders.radius[slot], cylinders.height[slot], cylinders.material[slot], r, hit, rec);
+                    return;
+                case PrimitiveType::Custom:
+                    customs[slot]->computeSurfaceInteraction(r, hit, rec);
+                    return;
+            }
+        }
+
+    private:
+        friend class SceneCache;
+
+        struct Spheres {
+            std::vector<real> cx, cy, cz, radius, rotation;
+            std::vector<MaterialId> material;
+            const SphereKernel* kernel = &sphere_kernel();
+
+            point3 center(uint32_t slot) const {
+                return point3(cx[slot], cy[slot], cz[slot]);
+            }
+
+            SphereColumns columns(uint32_t first) const {
+                return {cx.data() + first, cy.data() + first, cz.data() + first, radius.data() + first};
+            }
+        };
+
+        // Vertex k of triangle j is (x[k][j], y[k][j], z[k][j])
+        struct Triangles {
+            std::vector<real> x[3], y[3], z[3];
+            std::vector<MaterialId> material;
+            uint32_t count = 0;
+            const TriangleKernel* kernel = &triangle_kernel();
+
+            void add(const point3& p0, const point3& p1, const point3& p2) {
+                const point3* vertices[3] = {&p0, &p1, &p2};
+                for (int k = 0; k < 3; ++k) {
+                    x[k].push_back(vertices[k]->x());
+                    y[k].push_back(vertices[k]->y());
+                    z[k].push_back(vertices[k]->z());
+                }
+                ++count;
+            }
+
+            void vertices(uint32_t slot, point3& p0, point3& p1, point3& p2) const {
+                p0 = point3(x[0][slot], y[0][slot], z[0][slot]);
+                p1 = point3(x[1][slot], y[1][slot], z[1][slot]);
+                p2 = point3(x[2][slot], y[2][slot], z[2][slot]);
+            }
+
+            // The kernel reads whole blocks of lanes, past the end of the last run
+            void pad() {
+                for (int k = 0; k < 3; ++k) {
+                    x[k].resize(count + triangle_lanes - 1);
+                    y[k].resize(count + triangle_lanes - 1);
+                    z[k].resize(count + triangle_lanes - 1);
+                }
+            }
+
+            TriangleColumns columns(uint32_t first) const {
+                return TriangleColumns{{x[0].data(), x[1].data(), x[2].data()},
+                                       {y[0].data(), y[1].data(), y[2].data()},
+                                       {z[0].data(), z[1].data(), z[2].data()}}.offset(first);
+            }
+        };
+
+        struct MeshTriangles {
+            std::vector<uint32_t> mesh, triangle;
+        };
+
+        // Up to gather_size mesh triangles copied out of their meshes, for the triangle kernel
+        static constexpr uint32_t gather_size = 16;
+        struct GatheredTriangles {
+            real x[3][gather_size + triangle_lanes - 1];
+            real y[3][gather_size + triangle_lanes - 1];
+            real z[3][gather_size + triangle_lanes - 1];
+
+            TriangleColumns columns() const {
+                return {{x[0], x[1], x[2]}, {y[0], y[1], y[2]}, {z[0], z[1], z[2]}};
+            }
+        };
+
+        struct Cylinders {
+            std::vector<CylinderFrame> frame;
+            std::vector<real> radius, height;
+            std::vector<MaterialId> material;
+        };
+
+        const Hittable* owner = nullptr;
+
+        // Leaf order: each entry's type and its row in that type's table
+        std::vector<PrimitiveType> types;
+        std::vector<uint32_t> slots;
+
+        Spheres spheres;
+        Triangles triangles;
+        MeshTriangles mesh_triangles;
+        Cylinders cylinders;
+        std::vector<shared_ptr<const TriangleMesh>> meshes;
+        std::vector<shared_ptr<Hittable>> customs;
+
+        void push(PrimitiveType type, size_t slot) {
+            types.push_back(type);
+            slots.push_back(static_cast<uint32_t>(slot));
+        }
+
+        // Call fn(type, index, n) on each run of one type in [first, first + count), in order,
+        // until it returns false
+        template <typename Fn>
+        void forEachRun(uint32_t first, uint32_t count, Fn fn) const {
+            uint32_t end = first + count;
+
+            for (uint32_t index = first; index < end;) {
+                PrimitiveType type = types[index];
+                uint32_t n = 1;
+                while (index + n < end && types[index + n] == type) ++n;
+
+                if (!fn(type, index, n)) return;
+                index += n;
+            }
+        }
+
+        bool closestHitRun(PrimitiveType type, uint32_t index, uint32_t n, const Ray& r, interval& ray_t, RayHit& hit) const {
+            int winner = -1;
+
+            switch (type) {
+                case PrimitiveType::Sphere: {
+                    real t;
+                    winner = closestSphere(slots[index], n, r, ray_t, t);
+                    if (winner >= 0) hit.t = t;
+                    break;
+                }
+                case PrimitiveType::Triangle:
+                    winner = closestTriangle(triangles.columns(slots[index]), n, r, ray_t, hit);
+                    break;
+                case PrimitiveType::MeshTriangle:
+                    winner = closestMeshTriangle(slots[index], n, r, ray_t, hit);
+                    break;
+                case PrimitiveType::Cylinder:
+                    winner = closestCylinder(slots[index], n, r, ray_t, hit);
+                    break;
+                case PrimitiveType::Custom:
+                    for (uint32_t k = 0; k < n; ++k) {
+                        if (customs[slots[index + k]]->closestHit(r, ray_t, hit)) {
+                            ray_t.max = hit.t;
+                            winner = static_cast<int>(k);
+                        }
+                    }
+                    // The object already named what it hit (an instance also names the primitive)
+                    return winner >= 0;
+            }
+
+            if (winner < 0) return false;
+
+            hit.primitive = owner;
+            hit.index = index + winner;
+            return true;
+        }
+
+        bool occludedRun(PrimitiveType type, uint32_t index, uint32_t n, const Ray& r, interval ray_t) const {
+            switch (type) {
+                case PrimitiveType::Sphere:
+                    return sphere_kernel(*spheres.kernel, n).any(spheres.columns(slots[index]), n, r, ray_t);
+                case PrimitiveType::Triangle:
+                    return triangles.kernel->any(triangles.columns(slots[index]), n, r, ray_t);
+                case PrimitiveType::MeshTriangle:
+                    return occludedMeshTriangle(slots[index], n, r, ray_t);
+                case PrimitiveType::Cylinder:
+                    return occludedCylinder(slots[index], n, r, ray_t);
+                case PrimitiveType::Custom:
+                    for (uint32_t k = index; k < index + n; ++k) {
+                        if (customs[slots[k]]->occluded(r, ray_t)) return true;
+                    }
+                    return false;
+            }
+            return false;
+        }
+
+        // Spheres go to the widest SIMD kernel the CPU has, short runs to the scalar one
+        int closestSphere(uint32_t first, uint32_t count, const Ray& r, interval& ray_t, real& t) const {
+            int winner = sphere_kernel(*spheres.kernel, count).nearest(spheres.columns(first), count, r, ray_t, t);
+            if (winner >= 0) ray_t.max = t;
+            return winner;
+        }
+
+        // Triangles go to the watertight batch kernel built for the CPU's SIMD level
+        int closestTriangle(const TriangleColumns& columns, uint32_t count, const Ray& r, interval& ray_t, RayHit& hit) const {
+            real t, b1, b2;
+            int winner = triangles.kernel->nearest(columns, count, r, ray_t, t, b1, b2);
+            if (winner >= 0) {
+                ray_t.max = hit.t = t;
+                hit.u = b1;
+                hit.v = b2;
+            }
+            return winner;
+        }
+
+        // Mesh triangles [first, first + count) into gathered, padded with zeros to the end of
+        // the kernel's last block
+        void gather(uint32_t first, uint32_t count, GatheredTriangles& gathered) const {
+            for (uint32_t j = 0; j < count; ++j) {
+                const TriangleMesh& mesh = *meshes[mesh_triangles.mesh[first + j]];
+                const uint32_t* v = &mesh.indices[3 * static_cast<size_t>(mesh_triangles.triangle[first + j])];
+                for (int k = 0; k < 3; ++k) {
+                    gathered.x[k][j] = mesh.px[v[k]];
+                    gathered.y[k][j] = mesh.py[v[k]];
+                    gathered.z[k][j] = mesh.pz[v[k]];
+                }
+            }
+
+            for (uint32_t j = count; j % triangles.kernel->width != 0; ++j) {
+                for (int k = 0; k < 3; ++k) {
+                    gathered.x[k][j] = gathered.y[k][j] = gathered.z[k][j] = 0;
+                }
+            }
+        }
+
+        // Mesh triangles are gathered gather_size at a time for the same kernel. A later group
+        // only wins with a strictly closer hit, so ties still go to the lowest index.
+        int closestMeshTriangle(uint32_t first, uint32_t count, const Ray& r, interval& ray_t, RayHit& hit) const {
+            int winner = -1;
+            GatheredTriangles gathered;
+
+            for (uint32_t done = 0; done < count; done += gather_size) {
+                uint32_t n = std::min(gather_size, count - done);
+                gather(first + done, n, gathered);
+
+                int group_winner = closestTriangle(gathered.columns(), n, r, ray_t, hit);
+                if (group_winner >= 0) winner = static_cast<int>(done) + group_winner;
+            }
+
+            return winner;
+        }
+
+        bool occludedMeshTriangle(uint32_t first, uint32_t count, const Ray& r, interval ray_t) const {
+            GatheredTriangles gathered;
+
+            for (uint32_t done = 0; done < count; done += gather_size) {
+                uint32_t n = std::min(gather_size, count - done);
+                gather(first + done, n, gathered);
+
+                if (triangles.kernel->any(gathered.columns(), n, r, ray_t)) return true;
+            }
+
+            return false;
+        }
+
+        int closestCylinder(uint32_t first, uint32_t count, const Ray& r, interval& ray_t, RayHit& hit) const {
+            int winner = -1;
+
+            for (uint32_t j = 0; j < count; ++j) {
+                real t, projection;
+                CylinderPart part;
+                if (cylinder_hit(cylinders.frame[first + j], cylinders.radius[first + j], cylinders.height[first + j], r, ray_t, t, part, projection)) {
+                    ray_t.max = hit.t = t;
+                    hit.u = static_cast<real>(part);
+                    hit.v = projection;
+                    winner = static_cast<int>(j);
+                }
+            }
+
+            return winner;
+        }
+
+        bool occludedCylinder(uint32_t first, uint32_t count, const Ray& r, interval ray_t) const {
+            for (uint32_t j = first; j < first + count; ++j) {
+                real t, projection;
+                CylinderPart part;
+                if (cylinder_hit(cylinders.frame[j], cylinders.radius[j], cylinders.height[j], r, ray_t, t, part, projection))
+                    return true;
+            }
+
+            return false;
+        }
+};
+
+#endif
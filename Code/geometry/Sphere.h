@@ -5,63 +5,122 @@
 #include "../math/vec3.h"
 #include "../misc/utils.h"
 
+// Shading data of a hit on the sphere, shared by Sphere and the BVH's sphere table
+inline void sphere_surface(const point3& center, real radius, MaterialId material, const Ray& r, const RayHit& hit, HitRecord& rec) {
+    // Record hit information
+    rec.t = hit.t;
+    vec3 outward_normal = unit_vector(r.at(rec.t) - center);
+
+    // Reprojected onto the sphere: r.at(t) is off by the rounding error of t along the
+    // whole ray, which rays spawned from the hit would have to step over
+    rec.p = center + radius * outward_normal;
+    rec.set_face_normal(r, outward_normal);
+    rec.material = material;
+
+    // Calculate texture coordinates if necessary
+    if (material_textured(material)) {
+        real theta = acos(-outward_normal.y());
+        real phi = atan2(-outward_normal.z(), outward_normal.x()) + PI;
+
+        rec.texture_u = phi / (2 * PI);
+        rec.texture_v = theta / PI;
+    }
+}
+
+inline aabb sphere_bounds(const point3& center, real radius) {
+    auto rvec = vec3(radius, radius, radius);
+    return aabb(center - rvec, center + rvec);
+}
+
 class Sphere : public Hittable {
     public:
 
-        Sphere(point3 _center, double _radius, shared_ptr<Material> _material, double _rotationAngle = 0) 
-            : center(_center), radius(_radius), mat(_material), rotationAngle(_rotationAngle)
-        {
-            auto rvec = vec3(radius, radius, radius);
-            bbox = aabb(center - rvec, center + rvec);    
-        }
+        Sphere(point3 _center, real _radius, MaterialId _material, real _rotationAngle = 0) 
+            : center(_center), radius(_radius), material(_material), rotationAngle(_rotationAngle),
+              bbox(sphere_bounds(_center, _radius)) {}
 
         aabb bounding_box() const override { return bbox; }
 
-        bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const override {
-            vec3 oc = r.origin() - center;
-            double a = dot(r.direction(), r.direction());
-            double b = dot(oc, r.direction());
-            double c = dot(oc, oc) - radius*radius;
-            double discriminant = b*b - a*c;
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
+            real t;
+            if (!this->hit(r, ray_t, t))
+                return false;
 
-            if (discriminant < 0) return false;
-            double root = sqrt(discriminant);
+            // Only a winning candidate may touch the record
+            hit.t = t;
+            hit.primitive = this;
+            return true;
+        }
 
-            // Check the two possible solutions for t
-            auto temp = (-b - root) / a;
-            if (!ray_t.surrounds(temp)) {
-                temp = (-b + root) / a;
-                if (!ray_t.surrounds(temp))
-                    return false;
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            sphere_surface(center, radius, material, r, hit, rec);
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            real t;
+            return hit(r, ray_t, t);
+        }
+
+        // One call tests the sphere against a whole packet; center and radius stay in registers
+        uint32_t closestHitPacket(RayPacket& packet, uint32_t active, RayHit hits[]) const override {
+            uint32_t hit_mask = 0;
+
+            for (uint32_t bits = active; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                real t;
+                if (hit(packet.rays[i], packet.ray_t[i], t)) {
+                    hits[i].t = t;
+                    hits[i].primitive = this;
+                    packet.ray_t[i].max = t;
+                    hit_mask |= 1u << i;
+                }
             }
 
-            // Record hit information
-            rec.t = temp;
-            rec.p = r.at(rec.t);
-            vec3 outward_normal = (rec.p - center) / radius;
-            rec.set_face_normal(r, outward_normal);
-            rec.mat = mat;
+            return hit_mask;
+        }
 
-            // Calculate texture coordinates if necessary
-            if (mat->isTextured())
-                get_sphere_uv(outward_normal, rec.texture_u, rec.texture_v);
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t active) const override {
+            uint32_t blocked = 0;
 
-            return true;
+            for (uint32_t bits = active; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                real t;
+                if (hit(packet.rays[i], packet.ray_t[i], t))
+                    blocked |= 1u << i;
+            }
+
+            return blocked;
         }
 
     private:
+        friend class PrimitiveStore;
+
         point3 center;
-        double radius;
-        shared_ptr<Material> mat;
-        double rotationAngle;
+        real radius;
+        MaterialId material;
+        real rotationAngle;
         aabb bbox;
 
-        static void get_sphere_uv(const point3& p, double& u, double& v) {
-            double theta = acos(-p.y());
-            double phi = atan2(-p.z(), p.x()) + PI;
+        // Nearest root of the ray-sphere quadratic inside ray_t
+        bool hit(const Ray& r, interval ray_t, real& t) const {
+            vec3 oc = r.origin() - center;
+            real a = dot(r.direction(), r.direction());
+            real b = dot(oc, r.direction());
+            real c = dot(oc, oc) - radius*radius;
+            real discriminant = b*b - a*c;
 
-            u = phi / (2 * PI);
-            v = theta / PI;
+            if (discriminant < 0) return false;
+            real root = sqrt(discriminant);
+
+            // Check the two possible solutions for t
+            t = (-b - root) / a;
+            if (!ray_t.surrounds(t)) {
+                t = (-b + root) / a;
+                if (!ray_t.surrounds(t))
+                    return false;
+            }
+
+            return true;
         }
 };
 
@@ -0,0 +1,439 @@
+#ifndef SPHEREKERNEL_H
+#define SPHEREKERNEL_H
+
+#include <cmath>
+#include <cstdint>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "../core/Ray.h"
+#include "../math/interval.h"
+#include "../math/vec3.h"
+#include "../misc/simd.h"
+
+// Sphere centers and radii as structure-of-arrays columns; sphere j is
+// (cx[j], cy[j], cz[j]) with radius radius[j]
+struct SphereColumns {
+    const real* cx;
+    const real* cy;
+    const real* cz;
+    const real* radius;
+
+    SphereColumns offset(uint32_t first) const {
+        return {cx + first, cy + first, cz + first, radius + first};
+    }
+};
+
+// One ray against n spheres at a time. nearest returns the index of the sphere with the
+// nearest root inside ray_t (the lowest index on a tie), or -1, and leaves that root in t;
+// any reports whether some sphere has a root inside ray_t. Both do the same arithmetic as
+// Sphere in the same order, so every width finds exactly the roots the scalar test does.
+// Neither touches hit points or normals: shading data is computed for the winner afterwards.
+struct SphereKernel {
+    const char* name;
+    uint32_t width;     // Spheres per register
+    int (*nearest)(const SphereColumns& spheres, uint32_t n, const Ray& r, interval ray_t, real& t);
+    bool (*any)(const SphereColumns& spheres, uint32_t n, const Ray& r, interval ray_t);
+};
+
+// Scalar kernel, the reference the vector widths are checked against
+inline int sphere_nearest_scalar(const SphereColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t) {
+    const point3 origin = r.origin();
+    const vec3 direction = r.direction();
+    const real a = dot(direction, direction);
+    int winner = -1;
+
+    for (uint32_t j = 0; j < n; ++j) {
+        real ocx = origin.x() - s.cx[j];
+        real ocy = origin.y() - s.cy[j];
+        real ocz = origin.z() - s.cz[j];
+
+        real b = ocx * direction.x() + ocy * direction.y() + ocz * direction.z();
+        real c = (ocx * ocx + ocy * ocy + ocz * ocz) - s.radius[j] * s.radius[j];
+        real discriminant = b*b - a*c;
+        if (discriminant < 0) continue;
+
+        real root = std::sqrt(discriminant);
+        real candidate = (-b - root) / a;
+        if (!ray_t.surrounds(candidate)) candidate = (-b + root) / a;
+        if (ray_t.surrounds(candidate)) {
+            ray_t.max = t = candidate;
+            winner = static_cast<int>(j);
+        }
+    }
+
+    return winner;
+}
+
+inline bool sphere_any_scalar(const SphereColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+    real t;
+    for (uint32_t j = 0; j < n; ++j) {
+        if (sphere_nearest_scalar(s.offset(j), 1, r, ray_t, t) >= 0) return true;
+    }
+    return false;
+}
+
+#if defined(__SSE2__)
+// SSE2 kernel: two doubles or four floats per register
+namespace sphere_sse {
+    template <typename T> struct Lanes;
+
+    template <> struct Lanes<double> {
+        using V = __m128d;
+        static constexpr uint32_t width = 2;
+
+        static V set1(double x) { return _mm_set1_pd(x); }
+        static V zero() { return _mm_setzero_pd(); }
+        static V iota() { return _mm_set_pd(1, 0); }
+        static V add(V a, V b) { return _mm_add_pd(a, b); }
+        static V sub(V a, V b) { return _mm_sub_pd(a, b); }
+        static V mul(V a, V b) { return _mm_mul_pd(a, b); }
+        static V div(V a, V b) { return _mm_div_pd(a, b); }
+        static V sqrt(V a) { return _mm_sqrt_pd(a); }
+        static V negate(V a) { return _mm_xor_pd(a, _mm_set1_pd(-0.0)); }
+        static V greater(V a, V b) { return _mm_cmpgt_pd(a, b); }
+        static V less(V a, V b) { return _mm_cmplt_pd(a, b); }
+        static V at_least(V a, V b) { return _mm_cmpge_pd(a, b); }
+        static V both(V a, V b) { return _mm_and_pd(a, b); }
+        static V select(V mask, V a, V b) { return _mm_or_pd(_mm_and_pd(mask, a), _mm_andnot_pd(mask, b)); }
+        static bool any(V mask) { return _mm_movemask_pd(mask) != 0; }
+        static void store(double* out, V a) { _mm_storeu_pd(out, a); }
+        static V load(const double* p) { return _mm_loadu_pd(p); }
+
+        // The count < width lanes left at the end of a run, the rest zero, and their mask
+        static V load_tail(const double* p, uint32_t) { return _mm_load_sd(p); }
+        static V tail_mask(uint32_t) { return _mm_castsi128_pd(_mm_set_epi64x(0, -1)); }
+    };
+
+    template <> struct Lanes<float> {
+        using V = __m128;
+        static constexpr uint32_t width = 4;
+
+        static V set1(float x) { return _mm_set1_ps(x); }
+        static V zero() { return _mm_setzero_ps(); }
+        static V iota() { return _mm_set_ps(3, 2, 1, 0); }
+        static V add(V a, V b) { return _mm_add_ps(a, b); }
+        static V sub(V a, V b) { return _mm_sub_ps(a, b); }
+        static V mul(V a, V b) { return _mm_mul_ps(a, b); }
+        static V div(V a, V b) { return _mm_div_ps(a, b); }
+        static V sqrt(V a) { return _mm_sqrt_ps(a); }
+        static V negate(V a) { return _mm_xor_ps(a, _mm_set1_ps(-0.0f)); }
+        static V greater(V a, V b) { return _mm_cmpgt_ps(a, b); }
+        static V less(V a, V b) { return _mm_cmplt_ps(a, b); }
+        static V at_least(V a, V b) { return _mm_cmpge_ps(a, b); }
+        static V both(V a, V b) { return _mm_and_ps(a, b); }
+        static V select(V mask, V a, V b) { return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b)); }
+        static bool any(V mask) { return _mm_movemask_ps(mask) != 0; }
+        static void store(float* out, V a) { _mm_storeu_ps(out, a); }
+        static V load(const float* p) { return _mm_loadu_ps(p); }
+
+        static V load_tail(const float* p, uint32_t count) {
+            if (count == 1) return _mm_load_ss(p);
+            V pair = _mm_castpd_ps(_mm_load_sd(reinterpret_cast<const double*>(p)));
+            return count == 2 ? pair : _mm_movelh_ps(pair, _mm_load_ss(p + 2));
+        }
+        static V tail_mask(uint32_t count) {
+            static const int32_t bits[8] = {-1, -1, -1, -1, 0, 0, 0, 0};
+            return _mm_loadu_ps(reinterpret_cast<const float*>(bits + 4 - count));
+        }
+    };
+
+    using L = Lanes<real>;
+    using V = L::V;
+
+    // Lanes [j, j + width) of a column; past the end of the run they read as zero
+    inline V load(const real* column, uint32_t j, uint32_t n) {
+        return j + L::width <= n ? L::load(column + j) : L::load_tail(column + j, n - j);
+    }
+
+    struct RayLanes {
+        V origin[3], direction[3], a, t_min, t_max;
+
+        RayLanes(const Ray& r, interval ray_t) {
+            const point3 o = r.origin();
+            const vec3 d = r.direction();
+            for (int axis = 0; axis < 3; ++axis) {
+                origin[axis] = L::set1(o[axis]);
+                direction[axis] = L::set1(d[axis]);
+            }
+            a = L::set1(dot(d, d));
+            t_min = L::set1(ray_t.min);
+            t_max = L::set1(ray_t.max);
+        }
+    };
+
+    // Root of each lane's sphere that Sphere would report against (t_min, t_max); lanes
+    // without one (past the end of the run, or with a negative discriminant, whose square
+    // root is NaN) are masked off in valid
+    inline V roots(const RayLanes& l, const SphereColumns& s, uint32_t j, uint32_t n, V& valid) {
+        V ocx = L::sub(l.origin[0], load(s.cx, j, n));
+        V ocy = L::sub(l.origin[1], load(s.cy, j, n));
+        V ocz = L::sub(l.origin[2], load(s.cz, j, n));
+        V radius = load(s.radius, j, n);
+
+        V b = L::add(L::add(L::mul(ocx, l.direction[0]), L::mul(ocy, l.direction[1])), L::mul(ocz, l.direction[2]));
+        V c = L::sub(L::add(L::add(L::mul(ocx, ocx), L::mul(ocy, ocy)), L::mul(ocz, ocz)), L::mul(radius, radius));
+        V discriminant = L::sub(L::mul(b, b), L::mul(l.a, c));
+
+        // Most tests miss; they skip the square root and divisions, as Sphere's test does. Lanes
+        // past the end of the run hold a zero sphere, which is masked off only once it matters.
+        V real_roots = L::at_least(discriminant, L::zero());
+        if (!L::any(real_roots)) {
+            valid = L::zero();
+            return valid;
+        }
+        if (j + L::width > n) real_roots = L::both(real_roots, L::tail_mask(n - j));
+
+        V root = L::sqrt(discriminant);
+        V minus_b = L::negate(b);
+        V near = L::div(L::sub(minus_b, root), l.a);
+        V far = L::div(L::add(minus_b, root), l.a);
+
+        V near_inside = L::both(L::greater(near, l.t_min), L::less(near, l.t_max));
+        V t = L::select(near_inside, near, far);
+        valid = L::both(real_roots, L::both(L::greater(t, l.t_min), L::less(t, l.t_max)));
+        return t;
+    }
+
+    inline int nearest(const SphereColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t) {
+        const RayLanes lanes(r, ray_t);
+
+        // Per lane, the nearest root so far and its sphere; a lane only takes a strictly nearer
+        // root, so it keeps the lowest index on a tie
+        V best_t = lanes.t_max;
+        V best_index = L::set1(-1);
+        V index = L::iota();
+        const V step = L::set1(L::width);
+
+        for (uint32_t j = 0; j < n; j += L::width, index = L::add(index, step)) {
+            V valid;
+            V roots_t = roots(lanes, s, j, n, valid);
+
+            V nearer = L::both(valid, L::less(roots_t, best_t));
+            best_t = L::select(nearer, roots_t, best_t);
+            best_index = L::select(nearer, index, best_index);
+        }
+
+        if (!L::any(L::at_least(best_index, L::zero()))) return -1;
+
+        real lane_t[L::width], lane_index[L::width];
+        L::store(lane_t, best_t);
+        L::store(lane_index, best_index);
+
+        int winner = -1;
+        for (uint32_t lane = 0; lane < L::width; ++lane) {
+            if (lane_index[lane] < 0) continue;
+            if (winner < 0 || lane_t[lane] < t || (lane_t[lane] == t && lane_index[lane] < winner)) {
+                t = lane_t[lane];
+                winner = static_cast<int>(lane_index[lane]);
+            }
+        }
+
+        return winner;
+    }
+
+    inline bool any(const SphereColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+        const RayLanes lanes(r, ray_t);
+
+        for (uint32_t j = 0; j < n; j += L::width) {
+            V valid;
+            roots(lanes, s, j, n, valid);
+            if (L::any(valid)) return true;
+        }
+
+        return false;
+    }
+}
+
+// AVX2 kernel: four doubles or eight floats per register, with masked loads at the end of a
+// run. Everything in this section is compiled for AVX2, and only runs once sphere_kernel()
+// has found AVX2 on the CPU.
+#pragma GCC push_options
+#pragma GCC target("avx2")
+
+namespace sphere_avx2 {
+    template <typename T> struct Lanes;
+
+    template <> struct Lanes<double> {
+        using V = __m256d;
+        static constexpr uint32_t width = 4;
+
+        static V set1(double x) { return _mm256_set1_pd(x); }
+        static V zero() { return _mm256_setzero_pd(); }
+        static V iota() { return _mm256_set_pd(3, 2, 1, 0); }
+        static V add(V a, V b) { return _mm256_add_pd(a, b); }
+        static V sub(V a, V b) { return _mm256_sub_pd(a, b); }
+        static V mul(V a, V b) { return _mm256_mul_pd(a, b); }
+        static V div(V a, V b) { return _mm256_div_pd(a, b); }
+        static V sqrt(V a) { return _mm256_sqrt_pd(a); }
+        static V negate(V a) { return _mm256_xor_pd(a, _mm256_set1_pd(-0.0)); }
+        static V greater(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GT_OQ); }
+        static V less(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+        static V at_least(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_GE_OQ); }
+        static V both(V a, V b) { return _mm256_and_pd(a, b); }
+        static V select(V mask, V a, V b) { return _mm256_blendv_pd(b, a, mask); }
+        static bool any(V mask) { return _mm256_movemask_pd(mask) != 0; }
+        static void store(double* out, V a) { _mm256_storeu_pd(out, a); }
+
+        // Load mask of the lanes [j, j + width) that are below n
+        static __m256i in_run(uint32_t j, uint32_t n) {
+            __m256i lane = _mm256_add_epi64(_mm256_set1_epi64x(j), _mm256_set_epi64x(3, 2, 1, 0));
+            return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), lane);
+        }
+        static V load(const double* p, __m256i mask) { return _mm256_maskload_pd(p, mask); }
+        static V as_mask(__m256i mask) { return _mm256_castsi256_pd(mask); }
+    };
+
+    template <> struct Lanes<float> {
+        using V = __m256;
+        static constexpr uint32_t width = 8;
+
+        static V set1(float x) { return _mm256_set1_ps(x); }
+        static V zero() { return _mm256_setzero_ps(); }
+        static V iota() { return _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0); }
+        static V add(V a, V b) { return _mm256_add_ps(a, b); }
+        static V sub(V a, V b) { return _mm256_sub_ps(a, b); }
+        static V mul(V a, V b) { return _mm256_mul_ps(a, b); }
+        static V div(V a, V b) { return _mm256_div_ps(a, b); }
+        static V sqrt(V a) { return _mm256_sqrt_ps(a); }
+        static V negate(V a) { return _mm256_xor_ps(a, _mm256_set1_ps(-0.0f)); }
+        static V greater(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GT_OQ); }
+        static V less(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+        static V at_least(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+        static V both(V a, V b) { return _mm256_and_ps(a, b); }
+        static V select(V mask, V a, V b) { return _mm256_blendv_ps(b, a, mask); }
+        static bool any(V mask) { return _mm256_movemask_ps(mask) != 0; }
+        static void store(float* out, V a) { _mm256_storeu_ps(out, a); }
+
+        static __m256i in_run(uint32_t j, uint32_t n) {
+            __m256i lane = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(j)), _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0));
+            return _mm256_cmpgt_epi32(_mm256_set1_epi32(static_cast<int>(n)), lane);
+        }
+        static V load(const float* p, __m256i mask) { return _mm256_maskload_ps(p, mask); }
+        static V as_mask(__m256i mask) { return _mm256_castsi256_ps(mask); }
+    };
+
+    using L = Lanes<real>;
+    using V = L::V;
+
+    struct RayLanes {
+        V origin[3], direction[3], a, t_min, t_max;
+
+        RayLanes(const Ray& r, interval ray_t) {
+            const point3 o = r.origin();
+            const vec3 d = r.direction();
+            for (int axis = 0; axis < 3; ++axis) {
+                origin[axis] = L::set1(o[axis]);
+                direction[axis] = L::set1(d[axis]);
+            }
+            a = L::set1(dot(d, d));
+            t_min = L::set1(ray_t.min);
+            t_max = L::set1(ray_t.max);
+        }
+    };
+
+    // As in the SSE2 kernel
+    inline V roots(const RayLanes& l, const SphereColumns& s, uint32_t j, uint32_t n, V& valid) {
+        __m256i in_run = L::in_run(j, n);
+        V ocx = L::sub(l.origin[0], L::load(s.cx + j, in_run));
+        V ocy = L::sub(l.origin[1], L::load(s.cy + j, in_run));
+        V ocz = L::sub(l.origin[2], L::load(s.cz + j, in_run));
+        V radius = L::load(s.radius + j, in_run);
+
+        V b = L::add(L::add(L::mul(ocx, l.direction[0]), L::mul(ocy, l.direction[1])), L::mul(ocz, l.direction[2]));
+        V c = L::sub(L::add(L::add(L::mul(ocx, ocx), L::mul(ocy, ocy)), L::mul(ocz, ocz)), L::mul(radius, radius));
+        V discriminant = L::sub(L::mul(b, b), L::mul(l.a, c));
+
+        V real_roots = L::both(L::at_least(discriminant, L::zero()), L::as_mask(in_run));
+        if (!L::any(real_roots)) {
+            valid = L::zero();
+            return valid;
+        }
+
+        V root = L::sqrt(discriminant);
+        V minus_b = L::negate(b);
+        V near = L::div(L::sub(minus_b, root), l.a);
+        V far = L::div(L::add(minus_b, root), l.a);
+
+        V near_inside = L::both(L::greater(near, l.t_min), L::less(near, l.t_max));
+        V t = L::select(near_inside, near, far);
+        valid = L::both(real_roots, L::both(L::greater(t, l.t_min), L::less(t, l.t_max)));
+        return t;
+    }
+
+    inline int nearest(const SphereColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t) {
+        const RayLanes lanes(r, ray_t);
+
+        V best_t = lanes.t_max;
+        V best_index = L::set1(-1);
+        V index = L::iota();
+        const V step = L::set1(L::width);
+
+        for (uint32_t j = 0; j < n; j += L::width, index = L::add(index, step)) {
+            V valid;
+            V roots_t = roots(lanes, s, j, n, valid);
+
+            V nearer = L::both(valid, L::less(roots_t, best_t));
+            best_t = L::select(nearer, roots_t, best_t);
+            best_index = L::select(nearer, index, best_index);
+        }
+
+        if (!L::any(L::at_least(best_index, L::zero()))) return -1;
+
+        real lane_t[L::width], lane_index[L::width];
+        L::store(lane_t, best_t);
+        L::store(lane_index, best_index);
+
+        int winner = -1;
+        for (uint32_t lane = 0; lane < L::width; ++lane) {
+            if (lane_index[lane] < 0) continue;
+            if (winner < 0 || lane_t[lane] < t || (lane_t[lane] == t && lane_index[lane] < winner)) {
+                t = lane_t[lane];
+                winner = static_cast<int>(lane_index[lane]);
+            }
+        }
+
+        return winner;
+    }
+
+    inline bool any(const SphereColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+        const RayLanes lanes(r, ray_t);
+
+        for (uint32_t j = 0; j < n; j += L::width) {
+            V valid;
+            roots(lanes, s, j, n, valid);
+            if (L::any(valid)) return true;
+        }
+
+        return false;
+    }
+}
+
+#pragma GCC pop_options
+
+inline const SphereKernel sphere_kernel_sse = {"sse2", sphere_sse::L::width, sphere_sse::nearest, sphere_sse::any};
+inline const SphereKernel sphere_kernel_avx2 = {"avx2", sphere_avx2::L::width, sphere_avx2::nearest, sphere_avx2::any};
+#endif
+
+inline const SphereKernel sphere_kernel_scalar = {"scalar", 1, sphere_nearest_scalar, sphere_any_scalar};
+
+// The widest kernel the CPU's SIMD level runs: AVX2 also at the AVX-512 level, SSE2 below
+// AVX2, and the scalar kernel at the scalar level and everywhere without SSE2
+inline const SphereKernel& sphere_kernel() {
+#if defined(__SSE2__)
+    if (simd_level() == SimdLevel::Scalar) return sphere_kernel_scalar;
+    return simd_level() >= SimdLevel::AVX2 ? sphere_kernel_avx2 : sphere_kernel_sse;
+#else
+    return sphere_kernel_scalar;
+#endif
+}
+
+// Kernel for a run of n spheres: runs shorter than one register go to the scalar kernel, as
+// loading, masking and reducing a register costs more there than the lanes it fills save
+inline const SphereKernel& sphere_kernel(const SphereKernel& widest, uint32_t n) {
+    return n < widest.width ? sphere_kernel_scalar : widest;
+}
+
+#endif
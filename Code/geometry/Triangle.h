@@ -1,139 +1,192 @@
 #ifndef TRIANGLE_H
 #define TRIANGLE_H
 
-#include <vector>
 #include <algorithm>
 
 #include "../core/Hittable.h"
 #include "../math/vec3.h"
 
-// Overall structure and barycentric coordinate calculation inspired by scratchapixel tutorial (https://scratchapixel.com/lessons/3d-basic-rendering/ray-tracing-rendering-a-triangle/barycentric-coordinates.html)
+// Watertight ray/triangle test (Woop, Benthin and Wald, "Watertight Ray/Triangle Intersection").
+// The vertices are moved into the ray-aligned frame that Ray precomputes (translated to the ray
+// origin and sheared so the ray runs along its dominant axis kz), where the inside test reduces
+// to three 2D edge functions. A shared edge yields exactly negated edge functions in both of
+// its triangles, so rays through edges and vertices never slip through a mesh. Rejections cost
+// no division. The kernel is instantiated per dominant axis, so every index is a constant.
+template <int kz>
+inline bool triangle_hit_axis(const point3& p0, const point3& p1, const point3& p2, const Ray& r, interval ray_t,
+                              real& t, real& b0, real& b1, real& b2) {
+    constexpr int kx = (kz + 1) % 3;
+    constexpr int ky = (kz + 2) % 3;
+
+    const point3 origin = r.origin();
+    const real Sx = r.shear_x, Sy = r.shear_y, Sz = r.shear_z;
+
+    const vec3 A = p0 - origin;
+    const vec3 B = p1 - origin;
+    const vec3 C = p2 - origin;
+
+    const real Ax = A[kx] - Sx * A[kz], Ay = A[ky] - Sy * A[kz];
+    const real Bx = B[kx] - Sx * B[kz], By = B[ky] - Sy * B[kz];
+    const real Cx = C[kx] - Sx * C[kz], Cy = C[ky] - Sy * C[kz];
+
+    // Edge functions: scaled barycentric weights of p0, p1 and p2. The test is two-sided, so
+    // only their agreement in sign matters, not the winding.
+    const real U = Cx * By - Cy * Bx;
+    const real V = Ax * Cy - Ay * Cx;
+    const real W = Bx * Ay - By * Ax;
+
+    if (std::min({U, V, W}) < 0 && std::max({U, V, W}) > 0)
+        return false;
+
+    const real det = U + V + W;
+    if (det == 0)
+        return false;  // Ray is parallel to the triangle plane (or the triangle is degenerate)
+
+    // Scaled hit distance, range-checked before the division
+    const real T = Sz * (U * A[kz] + V * B[kz] + W * C[kz]);
+    const real abs_det = fabs(det);
+    const real signed_T = (det < 0) ? -T : T;
+    if (signed_T <= ray_t.min * abs_det || signed_T >= ray_t.max * abs_det)
+        return false;
+
+    const real inv_det = 1.0 / det;
+    t = T * inv_det;
+    b0 = U * inv_det;
+    b1 = V * inv_det;
+    b2 = W * inv_det;
+    return true;
+}
+
+// Outputs the distance and the barycentric weights of p0, p1 and p2
+inline bool triangle_hit(const point3& p0, const point3& p1, const point3& p2, const Ray& r, interval ray_t,
+                         real& t, real& b0, real& b1, real& b2) {
+    switch (r.kz) {
+        case 0:  return triangle_hit_axis<0>(p0, p1, p2, r, ray_t, t, b0, b1, b2);
+        case 1:  return triangle_hit_axis<1>(p0, p1, p2, r, ray_t, t, b0, b1, b2);
+        default: return triangle_hit_axis<2>(p0, p1, p2, r, ray_t, t, b0, b1, b2);
+    }
+}
+
+// Packet forms: the vertices are fetched once and tested against every active ray, with the
+// same per-ray test (and results) as triangle_hit
+inline uint32_t triangle_hit_packet(const point3& p0, const point3& p1, const point3& p2, const Hittable* primitive,
+                                    RayPacket& packet, uint32_t active, RayHit hits[]) {
+    uint32_t hit_mask = 0;
+
+    for (uint32_t bits = active; bits; bits &= bits - 1) {
+        int i = first_ray(bits);
+        real b0;
+        if (triangle_hit(p0, p1, p2, packet.rays[i], packet.ray_t[i], hits[i].t, b0, hits[i].u, hits[i].v)) {
+            hits[i].primitive = primitive;
+            packet.ray_t[i].max = hits[i].t;
+            hit_mask |= 1u << i;
+        }
+    }
+
+    return hit_mask;
+}
+
+inline uint32_t triangle_occluded_packet(const point3& p0, const point3& p1, const point3& p2, const RayPacket& packet, uint32_t active) {
+    uint32_t blocked = 0;
+
+    for (uint32_t bits = active; bits; bits &= bits - 1) {
+        int i = first_ray(bits);
+        real t, b0, b1, b2;
+        if (triangle_hit(p0, p1, p2, packet.rays[i], packet.ray_t[i], t, b0, b1, b2))
+            blocked |= 1u << i;
+    }
+
+    return blocked;
+}
+
+inline aabb triangle_bounds(const point3& p0, const point3& p1, const point3& p2) {
+    return aabb(point3(std::min({p0.x(), p1.x(), p2.x()}), std::min({p0.y(), p1.y(), p2.y()}), std::min({p0.z(), p1.z(), p2.z()})),
+                point3(std::max({p0.x(), p1.x(), p2.x()}), std::max({p0.y(), p1.y(), p2.y()}), std::max({p0.z(), p1.z(), p2.z()})));
+}
+
+// Unit geometric normal, by the right-hand rule over the vertices' order
+inline vec3 triangle_normal(const point3& p0, const point3& p1, const point3& p2) {
+    return unit_vector(cross(p1 - p0, p2 - p0));
+}
+
+// Shading data of a hit on a Triangle's vertices, whose barycentric weights of p1 and p2 are
+// the hit's u and v. The normal is turned to face the ray, as on every other shape, so neither
+// shading nor front_face depends on the winding. Shared by Triangle and the BVH's triangle table.
+inline void triangle_surface(const point3& p0, const point3& p1, const point3& p2, const vec3& normal, MaterialId material,
+                             const Ray& r, const RayHit& hit, HitRecord& rec) {
+    // Record the hit information
+    // The point comes from the barycentrics, which are exact up to the vertices' own
+    // rounding, rather than from r.at(t), whose error grows with the length of the ray
+    real b1 = hit.u, b2 = hit.v, b0 = 1 - b1 - b2;
+    rec.t = hit.t;
+    rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+    rec.set_face_normal(r, normal);
+    rec.material = material;
+
+    // Calculate texture coordinates if necessary
+    if (material_textured(material)) {
+        // Find barycentric point on surface
+        vec2 uv1 = vec2(0, 0);
+        vec2 uv2 = vec2(0, 1);
+        vec2 uv3 = vec2(1, 1);
+        vec2 barycentric_point = uv1 * b0 + uv2 * b1 + uv3 * b2;
+
+        rec.texture_u = barycentric_point.x;
+        rec.texture_v = barycentric_point.y;
+    }
+}
+
+// Vertices keep the order the scene gives them, so a triangle is the same in float and double
+// builds; texture coordinates map them onto (0, 0), (0, 1), (1, 1)
 class Triangle : public Hittable {
     public:
-        // Barycentric coordinates
-        double alpha, beta, gamma;
-
-        Triangle(vec3 _vertex1, vec3 _vertex2, vec3 _vertex3, shared_ptr<Material> _material) 
-            : vertex1(_vertex1), vertex2(_vertex2), vertex3(_vertex3), mat(_material) {
-                // Sort the vertices counter-clockwise
-                std::vector<vec3> sortedVertices = sortCounterClockwise();
-                vertex1 = sortedVertices[0];
-                vertex2 = sortedVertices[1];
-                vertex3 = sortedVertices[2];
-
-                // Calculate the bounding box
-                vec3 minimumExtreme = vec3(
-                    std::min({vertex1.x(), vertex2.x(), vertex3.x()}),
-                    std::min({vertex1.y(), vertex2.y(), vertex3.y()}),
-                    std::min({vertex1.z(), vertex2.z(), vertex3.z()})
-                );
-
-                vec3 maximumExtreme = vec3(
-                    std::max({vertex1.x(), vertex2.x(), vertex3.x()}),
-                    std::max({vertex1.y(), vertex2.y(), vertex3.y()}),
-                    std::max({vertex1.z(), vertex2.z(), vertex3.z()})
-                );
-
-                bbox = aabb(minimumExtreme, maximumExtreme);
+        Triangle(vec3 _vertex1, vec3 _vertex2, vec3 _vertex3, MaterialId _material) 
+            : vertex1(_vertex1), vertex2(_vertex2), vertex3(_vertex3), material(_material) {
+                setup();
             }
 
         aabb bounding_box() const override { return bbox; }
 
-        bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const override {
-            // Calculate the normal of the triangle
-            // This cross-product computes area of the paralellogram formed by the two edges
-            vec3 normal = cross(vertex2 - vertex1, vertex3 - vertex1);
-            float denom = dot(normal, normal);
-
-            // Check if ray is parallel to the triangle (no intersection)
-            float NdotRayDirection = dot(normal, r.direction());
-            if (fabs(NdotRayDirection) < std::numeric_limits<double>::epsilon()) {
+        // The hit's u and v are the barycentric weights of vertex 2 and vertex 3
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
+            real b0;
+            if (!triangle_hit(vertex1, vertex2, vertex3, r, ray_t, hit.t, b0, hit.u, hit.v))
                 return false;
-            }
 
-            // Calculate the distance from the ray origin to the triangle plane
-            float d = -dot(normal, vertex1);
-            double t = -(dot(r.origin(), normal) + d) / NdotRayDirection;
+            hit.primitive = this;
+            return true;
+        }
 
-            // Check if the intersection point is within the valid range
-            if (!ray_t.surrounds(t)) {
-                return false;
-            }
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            triangle_surface(vertex1, vertex2, vertex3, normal, material, r, hit, rec);
+        }
 
-            // Calculate the intersection point
-            point3 point_on_plane = r.at(t);
-
-            // Check if point is inside the triangle
-            vec3 edge1 = vertex2 - vertex1;
-            vec3 edge2 = vertex3 - vertex2;
-            vec3 edge3 = vertex1 - vertex3;
-
-            // Barycentric coordinates
-            double alpha, beta, gamma;
-
-            vec3 C1 = cross(edge1, point_on_plane - vertex1);
-            if (dot(normal, C1) < 0) return false;  // P is on the right side
-            vec3 C2 = cross(edge2, point_on_plane - vertex2);
-            alpha = dot(normal, C2);
-            if (alpha < 0) return false;  // P is on the right side
-            vec3 C3 = cross(edge3, point_on_plane - vertex3); 
-            beta = dot(normal, C3);
-            if (beta < 0) return false;  // P is on the right side
-
-            if (dot(C1, normal) >= 0 && alpha >= 0 && beta >= 0) {
-                // Record the hit information
-                rec.t = t;
-                rec.p = point_on_plane;
-                rec.normal = -unit_vector(normal);
-                rec.mat = mat;
-
-                // Calculate texture coordinates if necessary
-                if (mat->isTextured()) {
-                    alpha /= denom;
-                    beta /= denom;
-                    gamma = 1 - alpha - beta;
-
-                    // Find barycentric point on surface
-                    vec2 uv1 = vec2(0, 0);
-                    vec2 uv2 = vec2(0, 1);
-                    vec2 uv3 = vec2(1, 1);
-                    vec2 barycentric_point = uv1 * alpha + uv2 * beta + uv3 * gamma;
-
-                    rec.texture_u = barycentric_point.x;
-                    rec.texture_v = barycentric_point.y;
-                }
-                
-                return true;
-            }
+        bool occluded(const Ray& r, interval ray_t) const override {
+            real t, b0, b1, b2;
+            return triangle_hit(vertex1, vertex2, vertex3, r, ray_t, t, b0, b1, b2);
+        }
+
+        uint32_t closestHitPacket(RayPacket& packet, uint32_t active, RayHit hits[]) const override {
+            return triangle_hit_packet(vertex1, vertex2, vertex3, this, packet, active, hits);
+        }
 
-            return false;
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t active) const override {
+            return triangle_occluded_packet(vertex1, vertex2, vertex3, packet, active);
         }
 
     private:
+        friend class PrimitiveStore;
+
         vec3 vertex1;
         vec3 vertex2;
         vec3 vertex3;
-        shared_ptr<Material> mat;
+        vec3 normal;    // Unit geometric normal, precomputed
+        MaterialId material;
         aabb bbox;
 
-        std::vector<vec3> sortCounterClockwise() const {
-            // Determine vertex-texture mappings
-            std::vector<vec3> vertices = {vertex1, vertex2, vertex3};
-
-            // Sort vertices according to polar angle with centroid
-            vec3 centroid(0.0f, 0.0f, 0.0f);
-            for (const auto& vertex : vertices) {
-                centroid.e[0] += vertex.x();
-                centroid.e[1] += vertex.y();
-                centroid.e[2] += vertex.z();
-            }
-            centroid /= vertices.size();
-
-            std::sort(vertices.begin(), vertices.end(), [centroid](const vec3& v1, const vec3& v2) {
-                return std::atan2(v1.y() - centroid.y(), v1.x() - centroid.x()) < std::atan2(v2.y() - centroid.y(), v2.x() - centroid.x());
-            });
-
-            return vertices;
+        void setup() {
+            bbox = triangle_bounds(vertex1, vertex2, vertex3);
+            normal = triangle_normal(vertex1, vertex2, vertex3);
         }
 };
 
@@ -0,0 +1,168 @@
+// Body of the batched triangle kernel, over GCC vectors. TriangleKernel.h includes it once
+// per SimdLevel, inside that level's namespace and compiled for its target, after defining
+// `width`, the lanes of one register. A vector comparison is typed for the target of the
+// function it is written in, so the code has to be built for each target rather than inlined
+// into one: a 64-byte comparison written for the baseline becomes one compare per lane even
+// inside an AVX-512 function. No include guard, on purpose.
+
+template <uint32_t width>
+struct Block {
+    static_assert(width <= triangle_lanes, "a block never reads past a run's padding");
+    typedef real Lanes __attribute__((vector_size(width * sizeof(real))));
+    typedef Index Mask __attribute__((vector_size(width * sizeof(real))));
+
+    // triangle_hit_axis up to the division: hit distance T and determinant, the edge
+    // functions V and W (weights of p1 and p2), and which lanes pass
+    Lanes T, det, V, W;
+    Mask hit;
+};
+
+// Mask of the first count lanes of a block
+template <typename Mask>
+[[gnu::always_inline]] inline void first_lanes(Mask& out, uint32_t count) {
+    std::memcpy(&out, lane_table.bits + triangle_lanes - count, sizeof(out));
+}
+
+// A block's lanes of a column, which need not be aligned to the block; loaded straight
+// into a register (a memcpy is split into narrower stores and a reload that stalls)
+template <typename Lanes>
+[[gnu::always_inline]] inline void load(Lanes& out, const real* column) {
+    typedef Lanes Unaligned __attribute__((aligned(sizeof(real)), may_alias));
+    out = *reinterpret_cast<const Unaligned*>(column);
+}
+
+template <uint32_t width, int kz>
+[[gnu::always_inline]] inline void test(const TriangleColumns& s, uint32_t j, uint32_t n, const Ray& r, interval ray_t, Block<width>& b) {
+    using Lanes = typename Block<width>::Lanes;
+    using Mask = typename Block<width>::Mask;
+    constexpr int kx = (kz + 1) % 3;
+    constexpr int ky = (kz + 2) % 3;
+
+    // Vertices relative to the ray origin, per axis: rel[k][axis]
+    const point3 origin = r.origin();
+    Lanes rel[3][3];
+    #pragma GCC unroll 3
+    for (int k = 0; k < 3; ++k) {
+        load(rel[k][0], s.x[k] + j);
+        load(rel[k][1], s.y[k] + j);
+        load(rel[k][2], s.z[k] + j);
+        for (int axis = 0; axis < 3; ++axis) rel[k][axis] -= origin[axis];
+    }
+
+    const real Sx = r.shear_x, Sy = r.shear_y, Sz = r.shear_z;
+    const Lanes Ax = rel[0][kx] - Sx * rel[0][kz], Ay = rel[0][ky] - Sy * rel[0][kz];
+    const Lanes Bx = rel[1][kx] - Sx * rel[1][kz], By = rel[1][ky] - Sy * rel[1][kz];
+    const Lanes Cx = rel[2][kx] - Sx * rel[2][kz], Cy = rel[2][ky] - Sy * rel[2][kz];
+
+    const Lanes U = Cx * By - Cy * Bx;
+    b.V = Ax * Cy - Ay * Cx;
+    b.W = Bx * Ay - By * Ax;
+
+    // Inside when the edge functions do not disagree in sign, and not parallel
+    Mask negative = (U < 0) | (b.V < 0) | (b.W < 0);
+    Mask positive = (U > 0) | (b.V > 0) | (b.W > 0);
+    b.det = U + b.V + b.W;
+    b.hit = ~(negative & positive) & (b.det != 0);
+
+    // Scaled hit distance, range-checked without a division; det's sign bit is cleared
+    // from det and flipped in T (a cast between vectors keeps the bits)
+    b.T = Sz * (U * rel[0][kz] + b.V * rel[1][kz] + b.W * rel[2][kz]);
+    const Mask sign = (Mask)b.det & std::numeric_limits<Index>::min();
+    const Lanes abs_det = (Lanes)((Mask)b.det ^ sign);
+    const Lanes signed_T = (Lanes)((Mask)b.T ^ sign);
+    b.hit &= (signed_T > ray_t.min * abs_det) & (signed_T < ray_t.max * abs_det);
+
+    // Lanes past the end of the run
+    if (j + width > n) {
+        Mask in_run;
+        first_lanes(in_run, n - j);
+        b.hit &= in_run;
+    }
+}
+
+template <uint32_t width, int kz>
+[[gnu::always_inline]] inline int nearest_axis(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t, real& b1, real& b2) {
+    int winner = -1;
+
+    for (uint32_t j = 0; j < n; j += width) {
+        Block<width> b;
+        test<width, kz>(s, j, n, r, ray_t, b);
+
+        // Lanes passed against the block's starting t_max; in order, each must also beat
+        // the hits taken since, exactly as when the triangles are tested one by one
+        for (uint32_t lane = 0; lane < width; ++lane) {
+            if (!b.hit[lane]) continue;
+
+            const real abs_det = std::fabs(b.det[lane]);
+            const real signed_T = b.det[lane] < 0 ? -b.T[lane] : b.T[lane];
+            if (signed_T >= ray_t.max * abs_det) continue;
+
+            const real inv_det = 1.0 / b.det[lane];
+            ray_t.max = t = b.T[lane] * inv_det;
+            b1 = b.V[lane] * inv_det;
+            b2 = b.W[lane] * inv_det;
+            winner = static_cast<int>(j + lane);
+        }
+    }
+
+    return winner;
+}
+
+template <uint32_t width, int kz>
+[[gnu::always_inline]] inline bool any_axis(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+    for (uint32_t j = 0; j < n; j += width) {
+        Block<width> b;
+        test<width, kz>(s, j, n, r, ray_t, b);
+
+        Index any = 0;
+        for (uint32_t lane = 0; lane < width; ++lane) any |= b.hit[lane];
+        if (any) return true;
+    }
+
+    return false;
+}
+
+template <uint32_t width>
+[[gnu::always_inline]] inline int nearest_blocks(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t, real& b1, real& b2) {
+    switch (r.kz) {
+        case 0:  return nearest_axis<width, 0>(s, n, r, ray_t, t, b1, b2);
+        case 1:  return nearest_axis<width, 1>(s, n, r, ray_t, t, b1, b2);
+        default: return nearest_axis<width, 2>(s, n, r, ray_t, t, b1, b2);
+    }
+}
+
+template <uint32_t width>
+[[gnu::always_inline]] inline bool any_blocks(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+    switch (r.kz) {
+        case 0:  return any_axis<width, 0>(s, n, r, ray_t);
+        case 1:  return any_axis<width, 1>(s, n, r, ray_t);
+        default: return any_axis<width, 2>(s, n, r, ray_t);
+    }
+}
+
+// Blocks of the narrowest register, down to 16 bytes, that holds a run of up to w triangles:
+// a short run costs less per block than a register of mostly masked-off lanes
+template <uint32_t w>
+[[gnu::always_inline]] inline int nearest_fit(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t, real& b1, real& b2) {
+    if constexpr (w * sizeof(real) > 16) {
+        if (n <= w / 2) return nearest_fit<w / 2>(s, n, r, ray_t, t, b1, b2);
+    }
+    return nearest_blocks<w>(s, n, r, ray_t, t, b1, b2);
+}
+
+template <uint32_t w>
+[[gnu::always_inline]] inline bool any_fit(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+    if constexpr (w * sizeof(real) > 16) {
+        if (n <= w / 2) return any_fit<w / 2>(s, n, r, ray_t);
+    }
+    return any_blocks<w>(s, n, r, ray_t);
+}
+
+// Entry points of the level
+inline int nearest(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t, real& b1, real& b2) {
+    return nearest_fit<width>(s, n, r, ray_t, t, b1, b2);
+}
+
+inline bool any(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+    return any_fit<width>(s, n, r, ray_t);
+}
@@ -0,0 +1,139 @@
+#ifndef TRIANGLEKERNEL_H
+#define TRIANGLEKERNEL_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+#include "../core/Ray.h"
+#include "../math/interval.h"
+#include "../misc/simd.h"
+#include "Triangle.h"
+
+// Triangles in the widest block, one AVX-512 register (eight doubles or sixteen floats)
+constexpr uint32_t triangle_lanes = 64 / sizeof(real);
+
+// Triangle vertices as structure-of-arrays columns; vertex k of triangle j is
+// (x[k][j], y[k][j], z[k][j]). Every column stays readable for triangle_lanes - 1 entries
+// past its last triangle, so the lanes past the end of a run load whatever follows instead
+// of needing a partial load, and are masked off.
+struct TriangleColumns {
+    const real* x[3];
+    const real* y[3];
+    const real* z[3];
+
+    TriangleColumns offset(uint32_t first) const {
+        TriangleColumns columns;
+        for (int k = 0; k < 3; ++k) {
+            columns.x[k] = x[k] + first;
+            columns.y[k] = y[k] + first;
+            columns.z[k] = z[k] + first;
+        }
+        return columns;
+    }
+};
+
+// One ray against n triangles, a block of lanes at a time, with the watertight test of
+// triangle_hit_axis. nearest returns the index of the triangle that testing them one by one
+// in order would end on (the nearest inside ray_t, the lowest index on a tie), or -1, and
+// leaves its distance and the barycentric weights of its second and third vertex in t, b1
+// and b2; any reports whether some triangle is hit inside ray_t.
+struct TriangleKernel {
+    const char* name;
+    uint32_t width;     // Triangles per block
+    int (*nearest)(const TriangleColumns& triangles, uint32_t n, const Ray& r, interval ray_t, real& t, real& b1, real& b2);
+    bool (*any)(const TriangleColumns& triangles, uint32_t n, const Ray& r, interval ray_t);
+};
+
+// Portable build: the triangles one by one through triangle_hit
+inline int triangle_nearest_scalar(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t, real& t, real& b1, real& b2) {
+    int winner = -1;
+
+    for (uint32_t j = 0; j < n; ++j) {
+        real b0;
+        if (triangle_hit(point3(s.x[0][j], s.y[0][j], s.z[0][j]), point3(s.x[1][j], s.y[1][j], s.z[1][j]),
+                         point3(s.x[2][j], s.y[2][j], s.z[2][j]), r, ray_t, t, b0, b1, b2)) {
+            ray_t.max = t;
+            winner = static_cast<int>(j);
+        }
+    }
+
+    return winner;
+}
+
+inline bool triangle_any_scalar(const TriangleColumns& s, uint32_t n, const Ray& r, interval ray_t) {
+    for (uint32_t j = 0; j < n; ++j) {
+        real t, b0, b1, b2;
+        if (triangle_hit(point3(s.x[0][j], s.y[0][j], s.z[0][j]), point3(s.x[1][j], s.y[1][j], s.z[1][j]),
+                         point3(s.x[2][j], s.y[2][j], s.z[2][j]), r, ray_t, t, b0, b1, b2))
+            return true;
+    }
+
+    return false;
+}
+
+#if defined(__SSE2__)
+// The kernel is written once, in TriangleBatch.h, and built for each SimdLevel with a block as
+// wide as one register of the level, like the sphere kernels: two doubles or four floats on
+// SSE2, twice that on AVX2 and four times on AVX-512. Everything that holds a vector is always
+// inlined into a level's entry points, so no vector crosses a call between code built for
+// different targets (see vec3_t::lanes).
+namespace triangle_batch {
+    using Index = std::conditional_t<sizeof(real) == 8, int64_t, int32_t>;
+
+    // triangle_lanes set lanes, then as many clear ones
+    struct LaneTable {
+        Index bits[2 * triangle_lanes];
+    };
+    inline constexpr LaneTable lane_table = [] {
+        LaneTable table{};
+        for (uint32_t lane = 0; lane < triangle_lanes; ++lane) table.bits[lane] = -1;
+        return table;
+    }();
+}
+
+// SSE2 is the baseline
+namespace triangle_batch::sse2 {
+    constexpr uint32_t width = 16 / sizeof(real);
+    #include "TriangleBatch.h"
+}
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace triangle_batch::avx2 {
+    constexpr uint32_t width = 32 / sizeof(real);
+    #include "TriangleBatch.h"
+}
+#pragma GCC pop_options
+
+// AVX-512 implies FMA, and a contracted multiply-add would round the edge functions
+// differently from triangle_hit_axis and open cracks between triangles. DQ converts the
+// comparison masks to vectors.
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512dq")
+#pragma GCC optimize("fp-contract=off")
+namespace triangle_batch::avx512 {
+    constexpr uint32_t width = 64 / sizeof(real);
+    #include "TriangleBatch.h"
+}
+#pragma GCC pop_options
+#endif
+
+// One build per SimdLevel, in order; only the scalar one without SSE2
+inline const TriangleKernel triangle_kernels[] = {
+    {"scalar", 1, triangle_nearest_scalar, triangle_any_scalar},
+#if defined(__SSE2__)
+    {"sse2", triangle_batch::sse2::width, triangle_batch::sse2::nearest, triangle_batch::sse2::any},
+    {"avx2", triangle_batch::avx2::width, triangle_batch::avx2::nearest, triangle_batch::avx2::any},
+    {"avx512", triangle_batch::avx512::width, triangle_batch::avx512::nearest, triangle_batch::avx512::any},
+#endif
+};
+
+// The build for the CPU's SimdLevel
+inline const TriangleKernel& triangle_kernel() {
+    return triangle_kernels[static_cast<int>(simd_level())];
+}
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef TRIANGLEMESH_H
+#define TRIANGLEMESH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "../core/Hittable.h"
+#include "../math/vec3.h"
+#include "Triangle.h"
+
+// Indexed triangle mesh. Vertex attributes live in shared structure-of-arrays float buffers
+// and every triangle is three uint32 indices into them; normals and UVs are optional. A BVH
+// takes the mesh apart into one entry per triangle that refers back to these buffers; on its
+// own, the mesh tests its triangles one by one.
+class TriangleMesh : public Hittable {
+    public:
+        std::vector<float> px, py, pz;      // Positions
+        std::vector<float> nx, ny, nz;      // Per-vertex normals (empty: use face normals)
+        std::vector<float> tu, tv;          // Per-vertex texture coordinates (empty: default mapping)
+        std::vector<uint32_t> indices;      // Three vertex indices per triangle
+        MaterialId material = 0;
+
+        size_t vertexCount() const { return px.size(); }
+        size_t triangleCount() const { return indices.size() / 3; }
+
+        bool hasNormals() const { return !nx.empty(); }
+        bool hasUVs() const { return !tu.empty(); }
+
+        point3 position(uint32_t vertex) const {
+            return point3(px[vertex], py[vertex], pz[vertex]);
+        }
+
+        void vertices(uint32_t triangle, point3& p0, point3& p1, point3& p2) const {
+            const uint32_t* v = &indices[3 * static_cast<size_t>(triangle)];
+            p0 = position(v[0]);
+            p1 = position(v[1]);
+            p2 = position(v[2]);
+        }
+
+        aabb triangleBounds(uint32_t triangle) const {
+            point3 p0, p1, p2;
+            vertices(triangle, p0, p1, p2);
+            return triangle_bounds(p0, p1, p2);
+        }
+
+        // Box around the positions, computed on every call
+        aabb bounding_box() const override {
+            aabb box;
+            for (uint32_t t = 0; t < triangleCount(); ++t) {
+                box = aabb(box, triangleBounds(t));
+            }
+            return box;
+        }
+
+        // The hit's index is the triangle; u and v are the barycentric weights of its second
+        // and third vertex
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
+            bool hit_anything = false;
+
+            for (uint32_t t = 0; t < triangleCount(); ++t) {
+                point3 p0, p1, p2;
+                vertices(t, p0, p1, p2);
+
+                real b0;
+                if (triangle_hit(p0, p1, p2, r, ray_t, hit.t, b0, hit.u, hit.v)) {
+                    ray_t.max = hit.t;
+                    hit.primitive = this;
+                    hit.index = t;
+                    hit_anything = true;
+                }
+            }
+
+            return hit_anything;
+        }
+
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            surface(hit.index, r, hit, rec);
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            for (uint32_t t = 0; t < triangleCount(); ++t) {
+                point3 p0, p1, p2;
+                vertices(t, p0, p1, p2);
+
+                real t_hit, b0, b1, b2;
+                if (triangle_hit(p0, p1, p2, r, ray_t, t_hit, b0, b1, b2)) return true;
+            }
+
+            return false;
+        }
+
+        // Shading data of a hit on the given triangle, whatever the hit's own index means
+        void surface(uint32_t triangle, const Ray& r, const RayHit& hit, HitRecord& rec) const;
+
+        // Approximate heap footprint of the mesh buffers
+        size_t memoryUsage() const {
+            return (px.capacity() + py.capacity() + pz.capacity() + nx.capacity() + ny.capacity() + nz.capacity()
+                    + tu.capacity() + tv.capacity()) * sizeof(float)
+                 + indices.capacity() * sizeof(uint32_t);
+        }
+};
+
+inline void TriangleMesh::surface(uint32_t triangle, const Ray& r, const RayHit& hit, HitRecord& rec) const {
+    const uint32_t* v = &indices[3 * static_cast<size_t>(triangle)];
+    point3 p0 = position(v[0]), p1 = position(v[1]), p2 = position(v[2]);
+    real b1 = hit.u, b2 = hit.v, b0 = 1 - b1 - b2;
+
+    // From the barycentrics, like Triangle: exact up to the vertices' rounding
+    rec.t = hit.t;
+    rec.p = b0 * p0 + b1 * p1 + b2 * p2;
+    rec.material = material;
+
+    // Orient by the geometric normal; interpolated normals only bend the shading
+    vec3 face_normal = unit_vector(cross(p1 - p0, p2 - p0));
+    rec.set_face_normal(r, face_normal);
+
+    if (hasNormals()) {
+        vec3 shading_normal = unit_vector(
+            b0 * vec3(nx[v[0]], ny[v[0]], nz[v[0]]) +
+            b1 * vec3(nx[v[1]], ny[v[1]], nz[v[1]]) +
+            b2 * vec3(nx[v[2]], ny[v[2]], nz[v[2]]));
+        rec.normal = (dot(shading_normal, rec.normal) < 0) ? -shading_normal : shading_normal;
+    }
+
+    if (hasUVs()) {
+        rec.set_uv(b0 * tu[v[0]] + b1 * tu[v[1]] + b2 * tu[v[2]],
+                   b0 * tv[v[0]] + b1 * tv[v[1]] + b2 * tv[v[2]]);
+    } else {
+        // Same default mapping as Triangle: (0, 0), (0, 1), (1, 1)
+        rec.set_uv(b2, b1 + b2);
+    }
+}
+
+#endif
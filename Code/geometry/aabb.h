@@ -3,21 +3,23 @@
 
 #include "../misc/utils.h"
 
-class aabb {
+// Axis-aligned box over the scalar type T; the renderer uses aabb, over the build's `real`
+template <typename T>
+class aabb_t {
     public:
-        interval x, y, z;
+        interval_t<T> x, y, z;
 
-        aabb() {}  // The default AABB is empty, since intervals are empty by default
+        aabb_t() {}  // The default AABB is empty, since intervals are empty by default
 
-        aabb(const interval& ix, const interval& iy, const interval& iz)
+        aabb_t(const interval_t<T>& ix, const interval_t<T>& iy, const interval_t<T>& iz)
             : x(ix), y(iy), z(iz) {}
 
-        aabb(const point3& a, const point3& b) {
+        aabb_t(const vec3_t<T>& a, const vec3_t<T>& b) {
             // Treat two points a and b as extrema for the bounding box, so we don't require
             // a particular minimum/maximum coordinate order
-            x = interval(fmin(a[0], b[0]), fmax(a[0], b[0]));
-            y = interval(fmin(a[1], b[1]), fmax(a[1], b[1]));
-            z = interval(fmin(a[2], b[2]), fmax(a[2], b[2]));
+            x = interval_t<T>(std::fmin(a[0], b[0]), std::fmax(a[0], b[0]));
+            y = interval_t<T>(std::fmin(a[1], b[1]), std::fmax(a[1], b[1]));
+            z = interval_t<T>(std::fmin(a[2], b[2]), std::fmax(a[2], b[2]));
 
             // Check for any empty intervals and pad if necessary
             if (x.size() == 0) x = x.expand(delta);
@@ -25,28 +27,33 @@ class aabb {
             if (z.size() == 0) z = z.expand(delta);
         }
 
-        aabb(const aabb& box0, const aabb& box1) {
-            x = interval(box0.x, box1.x);
-            y = interval(box0.y, box1.y);
-            z = interval(box0.z, box1.z);
+        aabb_t(const aabb_t& box0, const aabb_t& box1) {
+            x = interval_t<T>(box0.x, box1.x);
+            y = interval_t<T>(box0.y, box1.y);
+            z = interval_t<T>(box0.z, box1.z);
         }
 
-        const interval& axis(int n) const {
+        const interval_t<T>& axis(int n) const {
             if (n == 1) return y;
             if (n == 2) return z;
             return x;
         }
 
-        bool hit(const Ray& r, interval ray_t) const {
-            for (int a = 0; a < 3; a++) {
-                auto invD = 1.0f / r.direction()[a];
-                auto orig = r.origin()[a];
-                
-                auto t0 = (axis(a).min - orig) * invD;
-                auto t1 = (axis(a).max - orig) * invD;
+        vec3_t<T> centroid() const {
+            return vec3_t<T>(T(0.5) * (x.min + x.max), T(0.5) * (y.min + y.max), T(0.5) * (z.min + z.max));
+        }
 
-                if (invD < 0)
-                    std::swap(t0, t1);
+        T surface_area() const {
+            // An empty box has negative extents, so report no area rather than a bogus positive one
+            if (x.size() < 0 || y.size() < 0 || z.size() < 0) return 0;
+            return 2.0 * (x.size() * y.size() + y.size() * z.size() + z.size() * x.size());
+        }
+
+        bool hit(const Ray_t<T>& r, interval_t<T> ray_t) const {
+            for (int a = 0; a < 3; a++) {
+                // Pick the near and far slab from the direction sign instead of swapping
+                T t0 = ((r.dir_is_neg[a] ? axis(a).max : axis(a).min) - r.origin()[a]) * r.inv_dir[a];
+                T t1 = ((r.dir_is_neg[a] ? axis(a).min : axis(a).max) - r.origin()[a]) * r.inv_dir[a];
 
                 if (t0 > ray_t.min) ray_t.min = t0;
                 if (t1 < ray_t.max) ray_t.max = t1;
@@ -56,10 +63,12 @@ class aabb {
             }
             return true;
         }
-    
+
     private:
         // Delta to expand intervals if necessary
-        double delta = 0.01;
+        static constexpr T delta = T(0.01);
 };
 
+using aabb = aabb_t<real>;
+
 #endif
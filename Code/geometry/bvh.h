@@ -2,78 +2,1029 @@
 #define BVH_H
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <utility>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "../misc/utils.h"
 
 #include "../core/Hittable.h"
 #include "../core/HittableList.h"
+#include "../core/TaskPool.h"
+#include "PrimitiveStore.h"
 
+// 4-wide BVH from a binned SAH build, nodes in depth-first order so children follow their
+// parent. The tree does not depend on the number of build threads.
 class bvh_node : public Hittable {
     public:
-        bvh_node(const HittableList& list) : bvh_node(list.objects, 0, list.objects.size()) {}
+        // SAH cost of one node traversal relative to one primitive intersection
+        static constexpr double traversal_cost = 0.5;
+        static constexpr double intersection_cost = 1.0;
+
+        // build_threads limits the threads the builder may use (0: every hardware thread)
+        bvh_node(const HittableList& list, int max_leaf_size = 4, int build_threads = 0)
+            : max_leaf_size(std::clamp(max_leaf_size, 1, static_cast<int>(UINT16_MAX))),
+              build_threads(build_threads > 0 ? build_threads : std::max(1, static_cast<int>(std::thread::hardware_concurrency()))) {
+            build(PrimitiveStore(list.objects));
+        }
+
+        bool closestHit(const Ray& r, interval ray_t, RayHit& hit) const override {
+            if (nodes.empty()) return false;
 
-        bvh_node(const std::vector<shared_ptr<Hittable>>& src_objects, size_t start, size_t end) {
-            auto objects = src_objects; // Create modifiable array of source scene objects
+            return closestHitFrom({0, 0, 0}, r, NodeRay(r), ray_t, hit);
+        }
+
+        bool occluded(const Ray& r, interval ray_t) const override {
+            if (nodes.empty()) return false;
+
+            return occludedFrom({0, 0, 0}, r, NodeRay(r), ray_t);
+        }
 
-            int axis = random_int(0, 2);
-            auto comparator = (axis == 0) ? box_x_compare
-                            : (axis == 1) ? box_y_compare
-                                          : box_z_compare;
+        uint32_t closestHitPacket(RayPacket& packet, uint32_t active, RayHit hits[]) const override {
+            if (nodes.empty() || active == 0) return 0;
 
-            size_t object_span = end - start;
+            const PacketRays rays(packet, active);
+            PacketEntry stack[max_stack_size];
+            int stack_size = 0;
+            PacketEntry current = {0, 0, active, 0};
+            uint32_t hit_mask = 0;
 
-            if (object_span == 1) {
-                left = right = objects[start];
-            } else if (object_span == 2) {
-                if (comparator(objects[start], objects[start + 1])) {
-                    left = objects[start];
-                    right = objects[start + 1];
+            while (true) {
+                if (__builtin_popcount(current.active) < packet_min_rays) {
+                    for (uint32_t bits = current.active; bits; bits &= bits - 1) {
+                        int i = first_ray(bits);
+                        if (closestHitFrom({current.index, current.count, current.t_near}, packet.rays[i], rays.ray[i], packet.ray_t[i], hits[i]))
+                            hit_mask |= 1u << i;
+                    }
+                } else if (current.count > 0) {
+                    hit_mask |= store.closestHitPacket(current.index, current.count, packet, current.active, hits);
                 } else {
-                    left = objects[start + 1];
-                    right = objects[start];
+                    PacketEntry children[width];
+                    int child_count = packetIntersect(nodes[current.index], rays, packet, current.active, children);
+
+                    if (child_count > 0) {
+                        // Near to far by the nearest entry of any of their rays, as in closestHit
+                        for (int k = 1; k < child_count; ++k) {
+                            PacketEntry entry = children[k];
+                            int j = k;
+                            for (; j > 0 && children[j - 1].t_near > entry.t_near; --j) {
+                                children[j] = children[j - 1];
+                            }
+                            children[j] = entry;
+                        }
+
+                        for (int k = child_count - 1; k > 0; --k) {
+                            stack[stack_size++] = children[k];
+                        }
+                        current = children[0];
+                        continue;
+                    }
                 }
-            } else {
-                std::sort(objects.begin() + start, objects.begin() + end, comparator);
 
-                auto mid = start + object_span / 2;
-                left = make_shared<bvh_node>(objects, start, mid);
-                right = make_shared<bvh_node>(objects, mid, end);
-            }
+                // Next entry, without the rays whose closest hit so far lies before it
+                do {
+                    if (stack_size == 0) return hit_mask;
+                    current = stack[--stack_size];
 
-            bbox = aabb(left->bounding_box(), right->bounding_box());
+                    for (uint32_t bits = current.active; bits; bits &= bits - 1) {
+                        int i = first_ray(bits);
+                        if (current.t_near > static_cast<float>(packet.ray_t[i].max) * far_scale)
+                            current.active &= ~(1u << i);
+                    }
+                } while (current.active == 0);
+            }
         }
 
-        bool intersect(const Ray& r, interval ray_t, HitRecord& rec) const override {
-            if (!bbox.hit(r, ray_t)) return false;
+        uint32_t occludedPacket(const RayPacket& packet, uint32_t active) const override {
+            if (nodes.empty() || active == 0) return 0;
+
+            const PacketRays rays(packet, active);
+            PacketEntry stack[max_stack_size];
+            int stack_size = 0;
+            PacketEntry current = {0, 0, active, 0};
+            uint32_t blocked = 0;
+
+            // Blocked rays leave the packet; the walk ends once every ray is blocked
+            while (true) {
+                if (__builtin_popcount(current.active) < packet_min_rays) {
+                    for (uint32_t bits = current.active; bits; bits &= bits - 1) {
+                        int i = first_ray(bits);
+                        if (occludedFrom({current.index, current.count, current.t_near}, packet.rays[i], rays.ray[i], packet.ray_t[i]))
+                            blocked |= 1u << i;
+                    }
 
-            bool hit_left = left->intersect(r, ray_t, rec);
-            bool hit_right = right->intersect(r, interval(ray_t.min, hit_left ? rec.t : ray_t.max), rec);
+                    if (blocked == active) return blocked;
+                } else if (current.count > 0) {
+                    blocked |= store.occludedPacket(current.index, current.count, packet, current.active);
 
-            return hit_left || hit_right;
+                    if (blocked == active) return blocked;
+                } else {
+                    PacketEntry children[width];
+                    int child_count = packetIntersect(nodes[current.index], rays, packet, current.active, children);
+
+                    for (int k = 0; k < child_count; ++k) {
+                        stack[stack_size++] = children[k];
+                    }
+                }
+
+                do {
+                    if (stack_size == 0) return blocked;
+                    current = stack[--stack_size];
+                    current.active &= ~blocked;
+                } while (current.active == 0);
+            }
+        }
+
+        // Hits naming the tree itself are on one of its table entries; Custom entries name
+        // whatever they hit themselves
+        void computeSurfaceInteraction(const Ray& r, const RayHit& hit, HitRecord& rec) const override {
+            store.computeSurfaceInteraction(r, hit, rec);
         }
 
         aabb bounding_box() const override { return bbox; }
 
+        // Recompute every node's bounds, keeping the topology; one reverse sweep, since children
+        // follow their parent. Only Custom entries (instances, nested trees) can have moved: the
+        // store holds the only copy of every other primitive.
+        void refit() {
+            for (size_t n = nodes.size(); n-- > 0;) {
+                WideNode& node = nodes[n];
+
+                for (int lane = 0; lane < node.child_count; ++lane) {
+                    aabb box;
+                    if (node.count[lane] > 0) {
+                        for (uint32_t i = node.child[lane]; i < node.child[lane] + node.count[lane]; ++i) {
+                            box = aabb(box, store.bounds(i));
+                        }
+                    } else {
+                        box = nodeBounds(nodes[node.child[lane]]);
+                    }
+
+                    setBounds(node, lane, box);
+                }
+            }
+
+            if (!nodes.empty()) bbox = nodeBounds(nodes[0]);
+            sah_cost = flatSahCost();
+        }
+
+        // Build the tree again from scratch over the same primitives
+        void rebuild() {
+            PrimitiveStore primitives = std::move(store);
+            store = PrimitiveStore();
+            nodes.clear();
+            node_count = 0;
+            build(std::move(primitives));
+        }
+
+        // Build the tree again, keeping the current one if the fresh tree would cost more.
+        // Returns whether the fresh tree was kept, and its cost in fresh_cost either way. The
+        // fresh nodes index the current store; it is reordered only if they are kept.
+        bool rebuildIfCheaper(double& fresh_cost) {
+            std::vector<WideNode> old_nodes = std::move(nodes);
+            aabb old_bbox = bbox;
+            size_t old_node_count = node_count;
+            nodes.clear();
+            node_count = 0;
+
+            buildNodes(store);
+            fresh_cost = flatSahCost([this](uint32_t i) { return store.cost(indices[i]); });
+            bool cheaper = fresh_cost < sah_cost;
+
+            if (cheaper) {
+                store = store.reordered(indices);
+                store.setOwner(this);
+                sah_cost = fresh_cost;
+            } else {
+                nodes = std::move(old_nodes);
+                bbox = old_bbox;
+                node_count = old_node_count;
+            }
+
+            indices = std::vector<uint32_t>();
+            return cheaper;
+        }
+
+        // Expected cost of tracing a ray through the tree, in primitive intersections
+        double sahCost() const { return sah_cost; }
+
+        double intersectionCost() const override { return sah_cost; }
+
+        // Nodes of the 4-wide tree
+        size_t nodeCount() const { return nodes.size(); }
+
+        size_t primitiveCount() const { return store.size(); }
+
     private:
-        shared_ptr<Hittable> left;
-        shared_ptr<Hittable> right;
+        friend class SceneCache;
+
+        // Far slab distances are stretched by 1 + 2 gamma(3) so rounding never drops a grazed box
+        static constexpr float far_scale = 1 + 2 * (3 * 0x1p-24f) / (1 - 3 * 0x1p-24f);
+
+        // Float form of a ray for the slab tests. The origin is rounded ahead of the ray for near
+        // slabs and behind it for far slabs, so rounding never moves the ray off a box edge.
+        struct NodeRay {
+#if defined(__SSE2__)
+            __m128 near_origin[3];
+            __m128 far_origin[3];
+            __m128 inv_dir[3];
+#else
+            float near_origin[3];
+            float far_origin[3];
+            float inv_dir[3];
+#endif
+            int near_row[3];
+            int far_row[3];
+
+            NodeRay() = default;
+
+            explicit NodeRay(const Ray& r) {
+                for (int a = 0; a < 3; ++a) {
+                    float ahead = r.dir_is_neg[a] ? roundDown(r.origin()[a]) : roundUp(r.origin()[a]);
+                    float behind = r.dir_is_neg[a] ? roundUp(r.origin()[a]) : roundDown(r.origin()[a]);
+#if defined(__SSE2__)
+                    near_origin[a] = _mm_set1_ps(ahead);
+                    far_origin[a] = _mm_set1_ps(behind);
+                    inv_dir[a] = _mm_set1_ps(static_cast<float>(r.inv_dir[a]));
+#else
+                    near_origin[a] = ahead;
+                    far_origin[a] = behind;
+                    inv_dir[a] = static_cast<float>(r.inv_dir[a]);
+#endif
+                    near_row[a] = r.dir_is_neg[a] ? a + 3 : a;
+                    far_row[a] = r.dir_is_neg[a] ? a : a + 3;
+                }
+            }
+        };
+
+        // Pending subtree or leaf: count is 0 for a node index, else the leaf's primitive range
+        struct StackEntry {
+            uint32_t index;
+            uint32_t count;
+            float t_near;
+        };
+
+        // Bounds of a packet's origins, inverse directions and ray_t. Only a coherent packet (one
+        // direction sign per axis, no infinite inverse) is culled as a whole.
+        struct PacketBounds {
+#if defined(__SSE2__)
+            __m128 near_origin[3], far_origin[3];
+            __m128 inv_min[3], inv_max[3];
+#else
+            float near_origin[3], far_origin[3];
+            float inv_min[3], inv_max[3];
+#endif
+            int near_row[3];
+            int far_row[3];
+            float t_min, t_max;
+            bool coherent = true;
+
+            PacketBounds(const RayPacket& packet, uint32_t active) {
+                int first = first_ray(active);
+                real low[2][3], high[2][3];   // Origin and inverse direction ranges
+
+                for (int a = 0; a < 3; ++a) {
+                    low[0][a] = high[0][a] = packet.rays[first].origin()[a];
+                    low[1][a] = high[1][a] = packet.rays[first].inv_dir[a];
+                    near_row[a] = packet.rays[first].dir_is_neg[a] ? a + 3 : a;
+                    far_row[a] = packet.rays[first].dir_is_neg[a] ? a : a + 3;
+                }
+                t_min = static_cast<float>(packet.ray_t[first].min);
+                t_max = static_cast<float>(packet.ray_t[first].max);
+
+                for (uint32_t bits = active; bits; bits &= bits - 1) {
+                    const Ray& r = packet.rays[first_ray(bits)];
+                    const interval& ray_t = packet.ray_t[first_ray(bits)];
+
+                    for (int a = 0; a < 3; ++a) {
+                        low[0][a] = std::min(low[0][a], r.origin()[a]);
+                        high[0][a] = std::max(high[0][a], r.origin()[a]);
+                        low[1][a] = std::min(low[1][a], r.inv_dir[a]);
+                        high[1][a] = std::max(high[1][a], r.inv_dir[a]);
+
+                        if (r.dir_is_neg[a] != packet.rays[first].dir_is_neg[a] || !std::isfinite(static_cast<float>(r.inv_dir[a])))
+                            coherent = false;
+                    }
+                    t_min = std::min(t_min, static_cast<float>(ray_t.min));
+                    t_max = std::max(t_max, static_cast<float>(ray_t.max));
+                }
+
+                for (int a = 0; a < 3; ++a) {
+                    bool negative = packet.rays[first].dir_is_neg[a];
+                    float ahead = negative ? roundDown(low[0][a]) : roundUp(high[0][a]);
+                    float behind = negative ? roundUp(high[0][a]) : roundDown(low[0][a]);
+#if defined(__SSE2__)
+                    near_origin[a] = _mm_set1_ps(ahead);
+                    far_origin[a] = _mm_set1_ps(behind);
+                    inv_min[a] = _mm_set1_ps(static_cast<float>(low[1][a]));
+                    inv_max[a] = _mm_set1_ps(static_cast<float>(high[1][a]));
+#else
+                    near_origin[a] = ahead;
+                    far_origin[a] = behind;
+                    inv_min[a] = static_cast<float>(low[1][a]);
+                    inv_max[a] = static_cast<float>(high[1][a]);
+#endif
+                }
+            }
+        };
+
+        // Traversal form of every ray of a packet, next to the bounds of the whole packet
+        struct PacketRays {
+            NodeRay ray[packet_size];
+            PacketBounds bounds;
+
+            PacketRays(const RayPacket& packet, uint32_t active) : bounds(packet, active) {
+                for (uint32_t bits = active; bits; bits &= bits - 1) {
+                    int i = first_ray(bits);
+                    ray[i] = NodeRay(packet.rays[i]);
+                }
+            }
+        };
+
+        // Stack entry of packet traversal: which rays still head into the subtree or leaf, and
+        // the nearest of their entry distances
+        struct PacketEntry {
+            uint32_t index;
+            uint32_t count;
+            uint32_t active;
+            float t_near;
+        };
+
+        static constexpr int width = 4;
+
+        // Up to four children; float boxes rounded outwards, empty boxes in unused lanes
+        struct alignas(64) WideNode {
+            float bounds[6][width];   // Rows: min x, y, z, then max x, y, z; one column per child
+            uint32_t child[width];    // Leaves: first primitive; interior children: node index
+            uint16_t count[width];    // Leaves: number of primitives; 0 for interior children
+            uint8_t child_count;      // Lanes in use, always the first ones
+            uint8_t pad[7];
+
+            // Lanes holding leaves
+            int leafMask() const {
+                int mask = 0;
+                for (int lane = 0; lane < child_count; ++lane) {
+                    if (count[lane] > 0) mask |= 1 << lane;
+                }
+                return mask;
+            }
+
+            // Mask of the children the ray enters within ray_t, with their entry distances.
+            // NaNs from 0 * inf leave the interval as it was.
+            int intersect(const NodeRay& ray, interval ray_t, float t_near[width]) const {
+#if defined(__SSE2__)
+                __m128 t0 = _mm_set1_ps(static_cast<float>(ray_t.min));
+                __m128 t1 = _mm_set1_ps(static_cast<float>(ray_t.max));
+
+                for (int a = 0; a < 3; ++a) {
+                    __m128 near = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[ray.near_row[a]]), ray.near_origin[a]), ray.inv_dir[a]);
+                    __m128 far = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[ray.far_row[a]]), ray.far_origin[a]), ray.inv_dir[a]);
+                    t0 = _mm_max_ps(near, t0);
+                    t1 = _mm_min_ps(far, t1);
+                }
+
+                _mm_storeu_ps(t_near, t0);
+                return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(far_scale))));
+#else
+                int mask = 0;
+                for (int lane = 0; lane < width; ++lane) {
+                    float t0 = static_cast<float>(ray_t.min);
+                    float t1 = static_cast<float>(ray_t.max);
+
+                    for (int a = 0; a < 3; ++a) {
+                        float near = (bounds[ray.near_row[a]][lane] - ray.near_origin[a]) * ray.inv_dir[a];
+                        float far = (bounds[ray.far_row[a]][lane] - ray.far_origin[a]) * ray.inv_dir[a];
+                        if (near > t0) t0 = near;
+                        if (far < t1) t1 = far;
+                    }
+
+                    t_near[lane] = t0;
+                    if (t0 <= t1 * far_scale) mask |= 1 << lane;
+                }
+                return mask;
+#endif
+            }
+
+            // Interval slab test of a coherent packet: a child missed here is missed by every ray,
+            // and t_near is at most any ray's entry distance.
+            int intersect(const PacketBounds& packet, float t_near[width]) const {
+#if defined(__SSE2__)
+                __m128 t0 = _mm_set1_ps(packet.t_min);
+                __m128 t1 = _mm_set1_ps(packet.t_max);
+
+                for (int a = 0; a < 3; ++a) {
+                    __m128 near = _mm_sub_ps(_mm_load_ps(bounds[packet.near_row[a]]), packet.near_origin[a]);
+                    __m128 far = _mm_sub_ps(_mm_load_ps(bounds[packet.far_row[a]]), packet.far_origin[a]);
+                    t0 = _mm_max_ps(_mm_min_ps(_mm_mul_ps(near, packet.inv_min[a]), _mm_mul_ps(near, packet.inv_max[a])), t0);
+                    t1 = _mm_min_ps(_mm_max_ps(_mm_mul_ps(far, packet.inv_min[a]), _mm_mul_ps(far, packet.inv_max[a])), t1);
+                }
+
+                _mm_storeu_ps(t_near, t0);
+                return _mm_movemask_ps(_mm_cmple_ps(t0, _mm_mul_ps(t1, _mm_set1_ps(far_scale))));
+#else
+                int mask = 0;
+                for (int lane = 0; lane < width; ++lane) {
+                    float t0 = packet.t_min;
+                    float t1 = packet.t_max;
+
+                    for (int a = 0; a < 3; ++a) {
+                        float near = bounds[packet.near_row[a]][lane] - packet.near_origin[a];
+                        float far = bounds[packet.far_row[a]][lane] - packet.far_origin[a];
+                        t0 = std::max({t0, near * packet.inv_min[a], near * packet.inv_max[a]});
+                        t1 = std::min({t1, far * packet.inv_min[a], far * packet.inv_max[a]});
+                    }
+
+                    t_near[lane] = t0;
+                    if (t0 <= t1 * far_scale) mask |= 1 << lane;
+                }
+                return mask;
+#endif
+            }
+        };
+
+        static_assert(sizeof(WideNode) == 128, "BVH nodes must fill exactly two cache lines");
+
+        // Children entered by rays of the packet, with the mask of those rays and a lower bound
+        // of their entry distances; returns how many. Coherent packets pass interior children the
+        // rays between the first and last one entering them; leaves always get exact masks.
+        static int packetIntersect(const WideNode& node, const PacketRays& rays, const RayPacket& packet, uint32_t active, PacketEntry children[width]) {
+            uint32_t lane_active[width] = {};
+            float lane_near[width];
+            int entered = 0;
+
+            int candidates = (1 << width) - 1;
+            if (rays.bounds.coherent) {
+                candidates = node.intersect(rays.bounds, lane_near);
+                if (candidates == 0) return 0;
+            } else {
+                std::fill(lane_near, lane_near + width, std::numeric_limits<float>::infinity());
+            }
+
+            uint32_t lane_hit[width] = {};   // Tested rays that enter each child
+            uint32_t untested = active;
+            float t_near[width];
+
+            if (rays.bounds.coherent) {
+                int first[width], last[width];
+
+                // First ray entering each child, front to back, until every candidate has one
+                while (untested && entered != candidates) {
+                    int i = first_ray(untested);
+                    untested &= untested - 1;
+
+                    int mask = node.intersect(rays.ray[i], packet.ray_t[i], t_near) & candidates;
+                    for (int lanes = mask; lanes; lanes &= lanes - 1) {
+                        int lane = __builtin_ctz(lanes);
+                        if (!(entered & (1 << lane))) first[lane] = i;
+                        last[lane] = i;
+                        lane_hit[lane] |= 1u << i;
+                    }
+                    entered |= mask;
+                }
+
+                // Last ray entering each child, back to front over the rays not tested yet
+                int closed = 0;
+                while (untested && closed != entered) {
+                    int i = 31 - __builtin_clz(untested);
+                    untested &= ~(1u << i);
+
+                    int mask = node.intersect(rays.ray[i], packet.ray_t[i], t_near) & entered;
+                    for (int lanes = mask; lanes; lanes &= lanes - 1) {
+                        int lane = __builtin_ctz(lanes);
+                        if (!(closed & (1 << lane))) last[lane] = i;
+                        lane_hit[lane] |= 1u << i;
+                    }
+                    closed |= mask;
+                }
+
+                // Untested rays inside a child's range go along; tested ones only where they hit
+                for (int lanes = entered; lanes; lanes &= lanes - 1) {
+                    int lane = __builtin_ctz(lanes);
+                    uint32_t range = (last[lane] == 31 ? ~0u : (2u << last[lane]) - 1) & ~((1u << first[lane]) - 1);
+                    lane_active[lane] = (untested & range) | lane_hit[lane];
+                }
+
+                // Leaves take only the rays that really enter them
+                uint32_t leaf_rays = 0;
+                for (int lanes = entered & node.leafMask(); lanes; lanes &= lanes - 1) {
+                    leaf_rays |= lane_active[__builtin_ctz(lanes)] & untested;
+                }
+                untested = leaf_rays;
+            }
+
+            // Every ray still untested gets its own slab test
+            for (uint32_t bits = untested; bits; bits &= bits - 1) {
+                int i = first_ray(bits);
+                int mask = node.intersect(rays.ray[i], packet.ray_t[i], t_near) & candidates;
+
+                for (int lane = 0; lane < width; ++lane) {
+                    if (mask & (1 << lane)) {
+                        lane_active[lane] |= 1u << i;
+                        if (!rays.bounds.coherent) lane_near[lane] = std::min(lane_near[lane], t_near[lane]);
+                    } else {
+                        lane_active[lane] &= ~(1u << i);
+                    }
+                }
+            }
+
+            int child_count = 0;
+            for (int lane = 0; lane < width; ++lane) {
+                if (lane_active[lane]) {
+                    children[child_count++] = {node.child[lane], node.count[lane], lane_active[lane], lane_near[lane]};
+                }
+            }
+            return child_count;
+        }
+
+        struct BuildNode {
+            aabb bbox;
+            std::unique_ptr<BuildNode> left;
+            std::unique_ptr<BuildNode> right;
+            size_t first = 0;   // Leaves: first primitive in the reordered primitive array
+            size_t count = 0;   // Leaves: number of primitives (0 for interior nodes)
+        };
+
+        struct Bin {
+            aabb bbox;
+            size_t count = 0;
+        };
+
+        static constexpr int bin_count = 12;
+
+        // Bins of all three axes, filled in one pass over a node's primitives
+        struct Binning {
+            Bin bins[3][bin_count];
+        };
+
+        // Parallel build: ranges below min_parallel_chunk primitives per thread are binned on one
+        // thread, and halves smaller than min_task_size are not worth a task of their own
+        static constexpr size_t min_parallel_chunk = 32 * 1024;
+        static constexpr size_t min_task_size = 4 * 1024;
+
+        // Past max_sah_depth the builder splits at the median; the stack covers the deepest tree
+        static constexpr int max_sah_depth = 64;
+        static constexpr int max_stack_depth = 128;
+        static constexpr int max_stack_size = (width - 1) * max_stack_depth + 1;
+
+        // Subtrees fewer rays of a packet head into are finished one ray at a time: with so few
+        // rays left, the packet bookkeeping costs more than sharing the nodes saves
+        static constexpr int packet_min_rays = 4;
+
+        // Single-ray walks of the subtree or leaf in start: the whole tree for single rays, and
+        // what is left of it for the last rays of a packet. closestHitFrom shrinks ray_t to the
+        // closest hit it finds.
+        bool closestHitFrom(StackEntry current, const Ray& r, const NodeRay& ray, interval& ray_t, RayHit& hit) const {
+            StackEntry stack[max_stack_size];
+            int stack_size = 0;
+            bool hit_anything = false;
+
+            while (true) {
+                if (current.count > 0) {
+                    if (store.closestHit(current.index, current.count, r, ray_t, hit))
+                        hit_anything = true;
+                } else {
+                    const WideNode& node = nodes[current.index];
+                    float t_near[width];
+                    int mask = node.intersect(ray, ray_t, t_near);
+
+                    if (mask != 0) {
+                        // Sort the children that were hit near to far, continue with the nearest
+                        // and stack the others so the next nearest comes off first
+                        StackEntry hits[width];
+                        int hit_count = 0;
+                        for (int lane = 0; lane < width; ++lane) {
+                            if (!(mask & (1 << lane))) continue;
+
+                            StackEntry entry = {node.child[lane], node.count[lane], t_near[lane]};
+                            int k = hit_count++;
+                            for (; k > 0 && hits[k - 1].t_near > entry.t_near; --k) {
+                                hits[k] = hits[k - 1];
+                            }
+                            hits[k] = entry;
+                        }
+
+                        for (int k = hit_count - 1; k > 0; --k) {
+                            stack[stack_size++] = hits[k];
+                        }
+                        current = hits[0];
+                        continue;
+                    }
+                }
+
+                // Next entry, skipping those that start beyond the closest hit found so far
+                do {
+                    if (stack_size == 0) return hit_anything;
+                    current = stack[--stack_size];
+                } while (current.t_near > static_cast<float>(ray_t.max) * far_scale);
+            }
+        }
+
+        bool occludedFrom(StackEntry current, const Ray& r, const NodeRay& ray, interval ray_t) const {
+            StackEntry stack[max_stack_size];
+            int stack_size = 0;
+
+            // Same walk as closestHit, but the first blocker ends it, so the order does not matter
+            while (true) {
+                if (current.count > 0) {
+                    if (store.occluded(current.index, current.count, r, ray_t))
+                        return true;
+                } else {
+                    const WideNode& node = nodes[current.index];
+                    float t_near[width];
+                    int mask = node.intersect(ray, ray_t, t_near);
+
+                    for (int lane = 0; lane < width; ++lane) {
+                        if (mask & (1 << lane)) {
+                            stack[stack_size++] = {node.child[lane], node.count[lane], t_near[lane]};
+                        }
+                    }
+                }
+
+                if (stack_size == 0) return false;
+                current = stack[--stack_size];
+            }
+        }
+
+        // Adopt the nodes of an earlier build (restored from the scene cache): the primitives
+        // are already in leaf order and the nodes index into them
+        bvh_node(PrimitiveStore _store, std::vector<WideNode> _nodes, int max_leaf_size, double _sah_cost)
+            : max_leaf_size(max_leaf_size), build_threads(std::max(1, static_cast<int>(std::thread::hardware_concurrency()))),
+              nodes(std::move(_nodes)), store(std::move(_store)), node_count(nodes.size()), sah_cost(_sah_cost) {
+            if (!nodes.empty()) bbox = nodeBounds(nodes[0]);
+            store.setOwner(this);
+        }
+
+        int max_leaf_size;
+        int build_threads;
         aabb bbox;
+        std::vector<WideNode> nodes;                   // Depth-first order, root first
+        PrimitiveStore store;                          // The primitives, in leaf order
+        std::atomic<size_t> node_count{0};             // Nodes of the binary build tree
+        double sah_cost = 0;
 
-        static bool box_compare(
-            const shared_ptr<Hittable> a, const shared_ptr<Hittable> b, int axis_index
-        ) {
-            return a->bounding_box().axis(axis_index).min < b->bounding_box().axis(axis_index).min;
+        // Build-time state, released once the tree is finished
+        std::vector<uint32_t> indices;
+        std::vector<aabb> prim_bounds;
+        std::vector<point3> centroids;
+        TaskPool* pool = nullptr;                      // build_threads threads for subtrees and chunks
+
+        void build(PrimitiveStore primitives) {
+            buildNodes(primitives);
+            store = primitives.reordered(indices);
+            store.setOwner(this);
+            sah_cost = flatSahCost();
+            indices = std::vector<uint32_t>();
         }
 
-        static bool box_x_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-            return box_compare(a, b, 0);
+        // Build the nodes over primitives, leaving in indices the order in which the leaves
+        // reference them (each leaf a contiguous range, one run per type)
+        void buildNodes(const PrimitiveStore& primitives) {
+            size_t count = primitives.size();
+            indices.resize(count);
+            prim_bounds.resize(count);
+            centroids.resize(count);
+            TaskPool build_pool(build_threads);
+            pool = &build_pool;
+
+            parallelFor(0, count, [&](size_t begin, size_t end) {
+                for (size_t i = begin; i < end; ++i) {
+                    indices[i] = static_cast<uint32_t>(i);
+                    prim_bounds[i] = primitives.bounds(static_cast<uint32_t>(i));
+                    centroids[i] = prim_bounds[i].centroid();
+                }
+            });
+
+            std::unique_ptr<BuildNode> root = buildRecursive(0, count, 0);
+            bbox = root->bbox;
+
+            if (count > 0) {
+                nodes.reserve((node_count + 1) / 2);
+                collapse(root.get());
+            }
+
+            groupLeavesByType(primitives);
+
+            prim_bounds = std::vector<aabb>();
+            centroids = std::vector<point3>();
+            pool = nullptr;
         }
 
-        static bool box_y_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-            return box_compare(a, b, 1);
+        std::unique_ptr<BuildNode> buildRecursive(size_t first, size_t count, int depth) {
+            auto node = std::make_unique<BuildNode>();
+            ++node_count;
+
+            // Bounds of the primitives and of their centroids
+            auto bounds = parallelReduce<std::pair<aabb, aabb>>(first, count, [&](size_t begin, size_t end) {
+                std::pair<aabb, aabb> chunk;
+                for (size_t i = begin; i < end; ++i) {
+                    chunk.first = aabb(chunk.first, prim_bounds[indices[i]]);
+                    chunk.second = aabb(chunk.second, pointBox(centroids[indices[i]]));
+                }
+                return chunk;
+            }, [](std::pair<aabb, aabb>& total, const std::pair<aabb, aabb>& chunk) {
+                total.first = aabb(total.first, chunk.first);
+                total.second = aabb(total.second, chunk.second);
+            });
+
+            node->bbox = bounds.first;
+            const aabb& centroid_bounds = bounds.second;
+
+            // Bin the primitives along every axis with a non-degenerate centroid extent
+            bool splittable[3];
+            for (int axis = 0; axis < 3; ++axis) {
+                splittable[axis] = count > 1 && centroid_bounds.axis(axis).size() > 0;
+            }
+
+            Binning binning;
+            if (splittable[0] || splittable[1] || splittable[2]) {
+                binning = parallelReduce<Binning>(first, count, [&](size_t begin, size_t end) {
+                    Binning chunk;
+                    for (size_t i = begin; i < end; ++i) {
+                        for (int axis = 0; axis < 3; ++axis) {
+                            if (!splittable[axis]) continue;
+
+                            Bin& bin = chunk.bins[axis][binIndex(centroids[indices[i]], axis, centroid_bounds.axis(axis))];
+                            bin.bbox = aabb(bin.bbox, prim_bounds[indices[i]]);
+                            bin.count++;
+                        }
+                    }
+                    return chunk;
+                }, [](Binning& total, const Binning& chunk) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        for (int b = 0; b < bin_count; ++b) {
+                            total.bins[axis][b].bbox = aabb(total.bins[axis][b].bbox, chunk.bins[axis][b].bbox);
+                            total.bins[axis][b].count += chunk.bins[axis][b].count;
+                        }
+                    }
+                });
+            }
+
+            // Find the cheapest binned split over all three axes
+            int best_axis = -1;
+            int best_split = 0;
+            double best_cost = INFTY;
+
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!splittable[axis]) continue;
+                const Bin* bins = binning.bins[axis];
+
+                // Sweep from the right to get the area and count of every right-hand side
+                double right_area[bin_count];
+                size_t right_count[bin_count];
+                aabb right_box;
+                size_t right_total = 0;
+                for (int b = bin_count - 1; b > 0; --b) {
+                    right_box = aabb(right_box, bins[b].bbox);
+                    right_total += bins[b].count;
+                    right_area[b] = right_box.surface_area();
+                    right_count[b] = right_total;
+                }
+
+                // Then sweep from the left, evaluating the split after each bin
+                aabb left_box;
+                size_t left_total = 0;
+                for (int split = 1; split < bin_count; ++split) {
+                    left_box = aabb(left_box, bins[split - 1].bbox);
+                    left_total += bins[split - 1].count;
+                    if (left_total == 0 || right_count[split] == 0) continue;
+
+                    double cost = left_box.surface_area() * left_total + right_area[split] * right_count[split];
+                    if (cost < best_cost) {
+                        best_cost = cost;
+                        best_axis = axis;
+                        best_split = split;
+                    }
+                }
+            }
+
+            double area = node->bbox.surface_area();
+            double split_cost = traversal_cost + intersection_cost * best_cost / (area > 0 ? area : 1);
+            double leaf_cost = intersection_cost * count;
+
+            bool can_split = best_axis >= 0;
+
+            if (count <= static_cast<size_t>(max_leaf_size) && (!can_split || leaf_cost <= split_cost)) {
+                node->first = first;
+                node->count = count;
+                return node;
+            }
+
+            if (!can_split || depth >= max_sah_depth) {
+                // All centroids coincide (or the tree is getting too deep) but the span is too big
+                // for one leaf: halve it
+                buildChildren(node.get(), first, count, first + count / 2, depth);
+                return node;
+            }
+
+            const interval& extent = centroid_bounds.axis(best_axis);
+            auto mid = std::partition(indices.begin() + first, indices.begin() + first + count, [&](uint32_t index) {
+                return binIndex(centroids[index], best_axis, extent) < best_split;
+            });
+
+            buildChildren(node.get(), first, count, static_cast<size_t>(mid - indices.begin()), depth);
+            return node;
         }
 
-        static bool box_z_compare(const shared_ptr<Hittable> a, const shared_ptr<Hittable> b) {
-            return box_compare(a, b, 2);
+        void buildChildren(BuildNode* node, size_t first, size_t count, size_t mid, int depth) {
+            size_t left_count = mid - first;
+            size_t right_count = first + count - mid;
+
+            // Hand the left half to the pool while this thread builds the right half
+            if (build_threads > 1 && std::min(left_count, right_count) >= min_task_size) {
+                TaskPool::Group left;
+                pool->run(left, [&]() { node->left = buildRecursive(first, left_count, depth + 1); });
+                node->right = buildRecursive(mid, right_count, depth + 1);
+                pool->wait(left);
+                return;
+            }
+
+            node->left = buildRecursive(first, left_count, depth + 1);
+            node->right = buildRecursive(mid, right_count, depth + 1);
+        }
+
+        // Split [first, first + count) into chunks of at least min_parallel_chunk primitives, run
+        // fn(begin, end) on each (every chunk after the first as a pool task) and fold the chunk
+        // results together in order with merge(total, chunk)
+        template <typename Result, typename Fn, typename Merge>
+        Result parallelReduce(size_t first, size_t count, Fn fn, Merge merge) const {
+            size_t chunks = std::min(static_cast<size_t>(build_threads), count / min_parallel_chunk);
+            if (chunks <= 1) {
+                return fn(first, first + count);
+            }
+
+            std::vector<Result> results(chunks);
+            TaskPool::Group group;
+            for (size_t c = 1; c < chunks; ++c) {
+                pool->run(group, [&, c]() { results[c] = fn(first + count * c / chunks, first + count * (c + 1) / chunks); });
+            }
+            results[0] = fn(first, first + count / chunks);
+            pool->wait(group);
+
+            for (size_t c = 1; c < chunks; ++c) {
+                merge(results[0], results[c]);
+            }
+            return results[0];
+        }
+
+        template <typename Fn>
+        void parallelFor(size_t first, size_t count, Fn fn) const {
+            parallelReduce<int>(first, count, [&](size_t begin, size_t end) {
+                fn(begin, end);
+                return 0;
+            }, [](int&, int) {});
+        }
+
+        // Append the subtree as 4-wide nodes in depth-first order, opening the largest interior
+        // child until a node has four; returns the index of the subtree's root
+        uint32_t collapse(const BuildNode* node) {
+            const BuildNode* children[width] = {node};
+            int child_count = 1;
+            if (node->left) {
+                children[0] = node->left.get();
+                children[1] = node->right.get();
+                child_count = 2;
+            }
+
+            while (child_count < width) {
+                int largest = -1;
+                double largest_area = -1;
+                for (int c = 0; c < child_count; ++c) {
+                    if (children[c]->left && children[c]->bbox.surface_area() > largest_area) {
+                        largest = c;
+                        largest_area = children[c]->bbox.surface_area();
+                    }
+                }
+                if (largest < 0) break;
+
+                const BuildNode* opened = children[largest];
+                children[largest] = opened->left.get();
+                children[child_count++] = opened->right.get();
+            }
+
+            uint32_t index = static_cast<uint32_t>(nodes.size());
+            nodes.emplace_back();
+
+            WideNode& wide = nodes[index];
+            for (int lane = 0; lane < width; ++lane) {
+                setBounds(wide, lane, aabb());
+                wide.child[lane] = 0;
+                wide.count[lane] = 0;
+            }
+            wide.child_count = static_cast<uint8_t>(child_count);
+            std::fill(std::begin(wide.pad), std::end(wide.pad), 0);
+
+            for (int lane = 0; lane < child_count; ++lane) {
+                const BuildNode* child = children[lane];
+                setBounds(nodes[index], lane, child->bbox);
+
+                if (!child->left) {
+                    nodes[index].child[lane] = static_cast<uint32_t>(child->first);
+                    nodes[index].count[lane] = static_cast<uint16_t>(child->count);
+                } else {
+                    // Collapsing the child appends to the array, so index again afterwards
+                    uint32_t child_index = collapse(child);
+                    nodes[index].child[lane] = child_index;
+                }
+            }
+
+            return index;
+        }
+
+        // Order each leaf's primitives by type, so the leaf is at most one run per type
+        void groupLeavesByType(const PrimitiveStore& primitives) {
+            for (const WideNode& node : nodes) {
+                for (int lane = 0; lane < node.child_count; ++lane) {
+                    if (node.count[lane] < 2) continue;
+
+                    auto begin = indices.begin() + node.child[lane];
+                    std::stable_sort(begin, begin + node.count[lane], [&](uint32_t a, uint32_t b) {
+                        return primitives.type(a) < primitives.type(b);
+                    });
+                }
+            }
+        }
+
+        // Empty boxes store +inf minima and -inf maxima, which every slab test rejects
+        static void setBounds(WideNode& node, int lane, const aabb& box) {
+            for (int a = 0; a < 3; ++a) {
+                bool empty = box.axis(a).size() < 0;
+                node.bounds[a][lane] = empty ? std::numeric_limits<float>::infinity() : roundDown(box.axis(a).min);
+                node.bounds[a + 3][lane] = empty ? -std::numeric_limits<float>::infinity() : roundUp(box.axis(a).max);
+            }
+        }
+
+        static aabb laneBounds(const WideNode& node, int lane) {
+            return aabb(interval(node.bounds[0][lane], node.bounds[3][lane]),
+                        interval(node.bounds[1][lane], node.bounds[4][lane]),
+                        interval(node.bounds[2][lane], node.bounds[5][lane]));
+        }
+
+        // Box around all of a node's children
+        static aabb nodeBounds(const WideNode& node) {
+            aabb box;
+            for (int lane = 0; lane < node.child_count; ++lane) {
+                box = aabb(box, laneBounds(node, lane));
+            }
+            return box;
+        }
+
+        static float roundDown(double v) {
+            float f = static_cast<float>(v);
+            return (f > v) ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static float roundUp(double v) {
+            float f = static_cast<float>(v);
+            return (f < v) ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+        }
+
+        static int binIndex(const point3& centroid, int axis, const interval& extent) {
+            int b = static_cast<int>(bin_count * (centroid[axis] - extent.min) / extent.size());
+            return std::min(b, bin_count - 1);
+        }
+
+        // Degenerate box around a single point (unlike aabb(a, b), which pads flat boxes)
+        static aabb pointBox(const point3& p) {
+            return aabb(interval(p.x(), p.x()), interval(p.y(), p.y()), interval(p.z(), p.z()));
+        }
+
+        // SAH cost of the finished tree relative to the root's area, leaves costing what their
+        // primitives cost
+        double flatSahCost() const {
+            return flatSahCost([this](uint32_t i) { return store.cost(i); });
+        }
+
+        // The same with primitive_cost(i) the cost of the primitive at leaf position i
+        template <typename Cost>
+        double flatSahCost(const Cost& primitive_cost) const {
+            if (nodes.empty()) return 0;
+
+            double root_area = nodeBounds(nodes[0]).surface_area();
+            if (root_area <= 0) return 0;
+
+            double cost = 0;
+            for (const WideNode& node : nodes) {
+                cost += traversal_cost * nodeBounds(node).surface_area();
+
+                for (int lane = 0; lane < node.child_count; ++lane) {
+                    if (node.count[lane] == 0) continue;
+
+                    double leaf_cost = 0;
+                    for (uint32_t i = node.child[lane]; i < node.child[lane] + node.count[lane]; ++i) {
+                        leaf_cost += primitive_cost(i);
+                    }
+                    cost += intersection_cost * leaf_cost * laneBounds(node, lane).surface_area();
+                }
+            }
+
+            return cost / root_area;
         }
 };
 
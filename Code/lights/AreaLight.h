@@ -13,9 +13,9 @@ class AreaLight : public Light {
                 normal = unit_vector(cross(edge1, edge2));
         }
 
-        // Set the position of the light
+        // Move the light, keeping its edges: the position is the corner getPosition reports
         void setPosition(vec3 position) override {
-            edge1 = position;
+            corner = position;
         }
 
         // Get the intensity of the light source
@@ -31,27 +31,39 @@ class AreaLight : public Light {
         // Sample a random point on the light source
         color sampleLight(const HitRecord& rec, const Hittable& world) const override {
             color totalIllumination = color(0, 0, 0);
+            Sampler& sampler = thread_sampler();
 
-            for (int i = 0; i < numSamples; ++i) {
-                // Sample point from surface of area light randomly
-                double u = random_float();
-                double v = random_float();
+            // Shadow rays all leave the same point, so they are traced in packets
+            for (int first = 0; first < numSamples; first += packet_size) {
+                RayPacket packet;
+                point3 sampledPoints[packet_size];
 
-                vec3 sampledPoint = corner + u * edge1 + v * edge2;
+                for (int i = first; i < std::min(first + packet_size, numSamples); ++i) {
+                    // Sample point from surface of area light (each sample is its own sampler dimension)
+                    vec2 uv = sampler.get2D(SampleDimension::Light);
 
-                // Calculate the direction towards the light
-                vec3 toLight = unit_vector(sampledPoint - rec.p);
+                    vec3 sampledPoint = corner + uv.x * edge1 + uv.y * edge2;
 
-                // Check if the point is in shadow
-                Ray shadowRay(rec.p, toLight);
-                HitRecord shadowRec;
-                bool inShadow = world.intersect(shadowRay, interval(0.001, INFTY), shadowRec);
+                    // Calculate the direction towards the light, from just off the surface
+                    point3 origin = rec.spawn_origin(sampledPoint - rec.p);
+                    vec3 toLight = unit_vector(sampledPoint - origin);
+                    real lightDistance = (sampledPoint - origin).length();
 
-                // Accumulate illumination if not in shadow
-                if (!inShadow) {
-                    float cosTheta = dot(rec.normal, toLight);
-                    float distance = (sampledPoint - rec.p).length() * (sampledPoint - rec.p).length();
-                    float attenuation = 1.0 / (1.0 + 0.1 * distance + 0.01 * distance * distance);
+                    // Only blockers in front of the light count
+                    sampledPoints[packet.count] = sampledPoint;
+                    packet.add(Ray(origin, toLight), interval(0, lightDistance));
+                }
+
+                uint32_t inShadow = world.occludedPacket(packet, packet.mask());
+
+                // Accumulate illumination of the samples not in shadow
+                for (int k = 0; k < packet.count; ++k) {
+                    if (inShadow & (1u << k)) continue;
+
+                    const point3& sampledPoint = sampledPoints[k];
+                    real cosTheta = dot(rec.normal, packet.rays[k].direction());
+                    real distance = (sampledPoint - rec.p).length_squared();
+                    real attenuation = 1.0 / (1.0 + 0.1 * distance + 0.01 * distance * distance);
 
                     totalIllumination += attenuation * cosTheta * intensity * 2;
                 }
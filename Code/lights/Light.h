@@ -1,7 +1,7 @@
 #ifndef LIGHT_H
 #define LIGHT_H
 
-#include "../core/Scene.h"
+#include "../core/Hittable.h"
 #include "../math/vec3.h"
 
 using std::string;
@@ -27,17 +27,20 @@ class PointLight : public Light {
 
         // Method to sample the light source
         color sampleLight(const HitRecord& rec, const Hittable& world) const override {
-            vec3 lightDir = unit_vector(position - rec.p);
-            Ray shadowRay(rec.p, lightDir);
-            HitRecord shadowRec;
-            if (world.intersect(shadowRay, interval(0.001, INFTY), shadowRec)) {
-                // Check if intersection is before the light source
+            // Shadow ray from just off the surface, so it cannot hit the surface itself
+            point3 origin = rec.spawn_origin(position - rec.p);
+            vec3 lightDir = unit_vector(position - origin);
+            real lightDistance = (position - origin).length();
+
+            // Only blockers between the surface and the light cast a shadow
+            Ray shadowRay(origin, lightDir);
+            if (world.occluded(shadowRay, interval(0, lightDistance))) {
                 return vec3(0, 0, 0);
             }
 
             // Calculate the attenuation
-            double NdotL = std::max(0.0, dot(rec.normal, lightDir));
-            float distance = (position - rec.p).length() * (position - rec.p).length();
+            real NdotL = std::max<real>(0, dot(rec.normal, lightDir));
+            real distance = (position - rec.p).length_squared();
             return NdotL * intensity * 2 / distance;
         }
 
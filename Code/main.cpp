@@ -1,33 +1,109 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
 #include "misc/utils.h"
 
 #include "core/Scene.h"
+#include "misc/ImageWriter.h"
 #include "misc/JsonParser.h"
+#include "misc/simd.h"
 #include "materials/Texture.h"
 
-int main() {
-    // const int numFrames = 150;
+// Output file for one frame of a sequence: the frame number goes before the extension
+static std::string frame_filename(const std::string& output, int frame) {
+    char number[16];
+    std::snprintf(number, sizeof(number), "%04d", frame);
+
+    size_t dot = output.find_last_of('.');
+    if (dot == std::string::npos) return output + number;
+    return output.substr(0, dot) + number + output.substr(dot);
+}
+
+// Usage: main [--cache dir] [--simd level] [scene.json] [output.ppm | output.pfm ...]
+// Without output files the image is written to stdout as a plain-text PPM. Adaptive renders
+// also write their sample counts to <first output or scene>_samples.pfm. Scenes with an
+// "animation" block render every frame to numbered files instead (output0000.ppm, ...).
+// With --cache, parsed geometry and its BVH are kept in dir and reused while the scene is
+// unchanged. --simd caps the instruction set of the SIMD kernels (scalar, sse2, avx2 or
+// avx512), which otherwise use the widest one the CPU has.
+int main(int argc, char* argv[]) {
+    std::string cache_dir;
+    while (argc > 2) {
+        std::string option = argv[1];
+        if (option == "--cache") {
+            cache_dir = argv[2];
+        } else if (option == "--simd") {
+            if (!parse_simd_level(argv[2], simd_limit())) {
+                std::cerr << "Unknown SIMD level " << argv[2] << '\n';
+                return 1;
+            }
+        } else {
+            break;
+        }
+        argc -= 2;
+        argv += 2;
+    }
+    std::clog << "SIMD kernels: " << simd_level_name(simd_level()) << '\n';
 
     // Load initial scene
-    JsonParser sceneParser("video.json");
+    std::string sceneFile = argc > 1 ? argv[1] : "video.json";
+    JsonParser sceneParser(sceneFile, cache_dir);
     Scene scene = sceneParser.parse();
 
     auto camera = scene.getCamera();
     auto world = scene.getWorld();
     auto lights = scene.getLights();
+    const MaterialTable& materials = scene.getMaterials();
+
+    // Frame sequence: move the animated instances, bring the top-level BVH up to date, render
+    Animation& animation = scene.getAnimation();
+    if (animation.frames > 0) {
+        if (argc <= 2) {
+            std::cerr << "Animated scenes need an output file name\n";
+            return 1;
+        }
+
+        double bvh_milliseconds = 0, render_seconds = 0;
+        int rebuilds = 0;
+
+        for (int frame = 0; frame < animation.frames; ++frame) {
+            Animation::FrameUpdate update = animation.setFrame(frame);
+            bvh_milliseconds += update.milliseconds;
+            rebuilds += update.rebuilt;
+
+            auto start = std::chrono::steady_clock::now();
+            Framebuffer image = camera->renderFramebuffer(world, lights, materials);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            render_seconds += seconds;
+
+            std::clog << "Frame " << frame << ": BVH " << (update.rebuilt ? "rebuild " : "refit ") << update.milliseconds
+                      << " ms (SAH cost " << update.sah_cost << "), render " << seconds << " s\n";
+
+            for (int i = 2; i < argc; ++i) {
+                write_image(frame_filename(argv[i], frame), image, camera->outputExposure());
+            }
+        }
+
+        std::clog << animation.frames << " frames: BVH maintenance " << bvh_milliseconds << " ms (" << rebuilds
+                  << " rebuilds), rendering " << render_seconds << " s\n";
+        return 0;
+    }
+
+    // Render once, then encode the same radiance into every requested file, or to stdout
+    Framebuffer image = camera->renderFramebuffer(world, lights, materials);
+    if (argc <= 2) {
+        write_ppm_ascii(std::cout, image, camera->outputExposure());
+    }
+    for (int i = 2; i < argc; ++i) {
+        write_image(argv[i], image, camera->outputExposure());
+    }
 
-    // Main animation loop
-    // for (int frame = 1; frame <= numFrames; ++frame) {
-    //     // Update primitives in the scene as necessary
-    //     camera->lookfrom += vec3(0.013, 0, 0);
-    //     camera->lookat += vec3(0.013, 0, 0);
-    //     lights[0]->setPosition(lights[0]->getPosition() - vec3(0.013, 0, 0));
-
-    //     // Output the frame to a file
-    //     std::string filename = "output/frame" + std::to_string(frame) + ".ppm";
-    //     std::ofstream file(filename);
-    //     camera->renderToPPM(world, lights, file);
-    //     file.close();
-    // }
-
-    camera->render(world, lights);
+    // Adaptive renders also get their sample-count map, named after the first output (or the
+    // scene file when the image goes to stdout)
+    if (camera->adaptive_sampling) {
+        std::string output = argc > 2 ? argv[2] : sceneFile;
+        write_sample_map(output.substr(0, output.find_last_of('.')) + "_samples.pfm", image);
+    }
 }
@@ -3,18 +3,20 @@
 
 #include <algorithm>
 
+#include "../core/Hittable.h"
 #include "../misc/utils.h"
 #include "../misc/color.h"
-#include "Material.h"
+#include "Texture.h"
 
 // Lambertian BRDF
-class Lambertian : public Material {
+class Lambertian {
     public:
         Lambertian(const vec3& albedo, shared_ptr<Texture>& _texture) : albedo(albedo), texture(_texture) {}
 
-        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const override {
-            vec3 scatter_direction = rec.normal + random_unit_vector();
-            scattered = Ray(rec.p, scatter_direction);
+        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const {
+            vec2 u = thread_sampler().get2D(SampleDimension::BSDF);
+            vec3 scatter_direction = rec.normal + sample_unit_vector(u.x, u.y);
+            scattered = rec.spawn_ray(scatter_direction);
 
             if (texture != nullptr)
                 attenuation = texture->getTextureColor(rec.texture_u, rec.texture_v);
@@ -25,16 +27,18 @@ class Lambertian : public Material {
         }
 
         // Reflectance method
-        color getReflectance(const HitRecord& rec) const override {
+        color getReflectance(const HitRecord& rec) const {
             if (texture != nullptr)
                 return texture->getTextureColor(rec.texture_u, rec.texture_v);
             else
                 return albedo;
         }
-        shared_ptr<Texture> getTexture() const override { return texture; }
-        bool isTextured() const override { return texture != nullptr; }
+        shared_ptr<Texture> getTexture() const { return texture; }
+        bool isTextured() const { return texture != nullptr; }
 
     private:
+        friend class SceneCache;
+
         color albedo = color(0, 0, 0);
         shared_ptr<Texture> texture;
 };
@@ -96,14 +100,14 @@ class Lambertian : public Material {
 // };
 
 // Schlick BRDF (with refractions)
-class SchlickRefractionsBRDF : public Material {
+class SchlickRefractionsBRDF {
     public:
         float fresnelReflectance;
 
         SchlickRefractionsBRDF(float fresnelReflectance) : fresnelReflectance(fresnelReflectance) {}
 
         // Evaluate Schlick BRDF
-        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const override {
+        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const {
             // Calculate the reflection direction
             vec3 reflected = reflect(r_in.direction(), rec.normal);
 
@@ -112,9 +116,9 @@ class SchlickRefractionsBRDF : public Material {
             float F = fresnelSchlick(cosTheta, fresnelReflectance);
 
             // Determine whether to reflect or refract based on Fresnel reflection
-            if (random_float() < F) {
+            if (thread_sampler().get1D(SampleDimension::BSDFChoice) < F) {
                 // Reflect
-                scattered = Ray(rec.p, reflected);
+                scattered = rec.spawn_ray(reflected);
                 attenuation = color(1.0, 1.0, 1.0);  // Reflectance color
             } else {
                 // Refract
@@ -126,7 +130,7 @@ class SchlickRefractionsBRDF : public Material {
                 double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
                 bool cannot_refract = refractiveIndexRatio * sin_theta > 1.0;
                 if (!cannot_refract) {
-                    scattered = Ray(rec.p, refracted);
+                    scattered = rec.spawn_ray(refracted);
                     attenuation = color(1, 1, 1);  // Refractive color
 
                     // Use Beer's Law to attenuate the color based on distance
@@ -134,7 +138,7 @@ class SchlickRefractionsBRDF : public Material {
                     attenuation *= beersLaw;
                 } else {
                     // Total internal reflection
-                    scattered = Ray(rec.p, reflected);
+                    scattered = rec.spawn_ray(reflected);
                     attenuation = color(1.0, 1.0, 1.0);  // Reflectance color
 
                     double beersLaw = exp(-0.2 * rec.t);
@@ -145,11 +149,11 @@ class SchlickRefractionsBRDF : public Material {
             return true;
         }
 
-        color getReflectance(const HitRecord& rec) const override {
+        color getReflectance(const HitRecord& rec) const {
             return color(1, 1, 1);
         }
-        shared_ptr<Texture> getTexture() const override { return nullptr; }
-        bool isTextured() const override { return false; }
+        shared_ptr<Texture> getTexture() const { return nullptr; }
+        bool isTextured() const { return false; }
 
     private:
         float fresnelSchlick(float cosTheta, float reflectance) const {
@@ -158,14 +162,14 @@ class SchlickRefractionsBRDF : public Material {
 };
 
 // Schlick BRDF (without refractions)
-class SchlickBRDF : public Material {
+class SchlickBRDF {
     public:
         float fresnelReflectance;
 
         SchlickBRDF(float fresnelReflectance) : fresnelReflectance(fresnelReflectance) {}
 
         // Evaluate Schlick BRDF
-        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const override {
+        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const {
             // Calculate the reflection direction
             vec3 reflected = reflect(r_in.direction(), rec.normal);
 
@@ -174,20 +178,22 @@ class SchlickBRDF : public Material {
             float F = fresnelSchlick(cosTheta, fresnelReflectance);
 
             // Determine whether to reflect or refract based on Fresnel reflection
-            if (random_float() < F) {
+            if (thread_sampler().get1D(SampleDimension::BSDFChoice) < F) {
                 // Reflect
-                scattered = Ray(rec.p, reflected);
+                scattered = rec.spawn_ray(reflected);
                 attenuation = color(1.0, 1.0, 1.0);  // Reflectance color
+                return true;
             }
 
-            return true;
+            // Not reflected: the ray is absorbed, leaving only the direct lighting at this point
+            return false;
         }
 
-        color getReflectance(const HitRecord& rec) const override {
+        color getReflectance(const HitRecord& rec) const {
             return color(1, 1, 1);
         }
-        shared_ptr<Texture> getTexture() const override { return nullptr; }
-        bool isTextured() const override { return false; }
+        shared_ptr<Texture> getTexture() const { return nullptr; }
+        bool isTextured() const { return false; }
 
     private:
         float fresnelSchlick(float cosTheta, float reflectance) const {
@@ -1,50 +1,190 @@
 #ifndef MATERIAL_H
 #define MATERIAL_H
 
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
 #include "../misc/utils.h"
 #include "../misc/color.h"
 
+#include "../core/Hittable.h"
 #include "../lights/Light.h"
-#include "../materials/Texture.h"
-
-class HitRecord;
+#include "BlinnPhong.h"
+#include "BRDF.h"
+#include "MaterialId.h"
 
-class Material {
+// Scene-owned storage for every material, one flat array per material type. Primitives and hit
+// records refer to materials by MaterialId, and evaluation is a switch over the ID's type tag
+// rather than a virtual call, so a hit never touches a reference count.
+class MaterialTable {
     public:
+        MaterialId add(const Lambertian& material) {
+            return push(lambertians, material, MaterialType::Lambertian);
+        }
 
-        virtual ~Material() = default;
+        MaterialId add(const SchlickBRDF& material) {
+            return push(schlicks, material, MaterialType::SchlickBRDF);
+        }
+
+        MaterialId add(const SchlickRefractionsBRDF& material) {
+            return push(schlick_refractions, material, MaterialType::SchlickRefractionsBRDF);
+        }
+
+        MaterialId add(const BlinnPhong& material) {
+            return push(blinn_phongs, material, MaterialType::BlinnPhong);
+        }
+
+        size_t size() const {
+            return lambertians.size() + schlicks.size() + schlick_refractions.size() + blinn_phongs.size();
+        }
+
+        // Evaluate method for BRDF materials; Blinn-Phong materials do not scatter
+        bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const {
+            uint32_t index = material_index(rec.material);
+
+            switch (material_type(rec.material)) {
+                case MaterialType::Lambertian:
+                    return lambertians[index].evaluate(r_in, rec, attenuation, scattered);
+                case MaterialType::SchlickBRDF:
+                    return schlicks[index].evaluate(r_in, rec, attenuation, scattered);
+                case MaterialType::SchlickRefractionsBRDF:
+                    return schlick_refractions[index].evaluate(r_in, rec, attenuation, scattered);
+                case MaterialType::BlinnPhong:
+                    break;
+            }
 
-        virtual bool isTextured() const = 0;
-        virtual bool isReflective() const {
-            return false;
-        };
-        virtual bool isRefractive() const {
             return false;
-        };
-        virtual color getReflectance(const HitRecord& rec) const {
+        }
+
+        // Shading method for Blinn-Phong materials; BRDF materials shade black
+        color getShading(const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const Ray& r_in, const color& backgroundColor, HitRecord& rec, int depth) const {
+            if (material_type(rec.material) == MaterialType::BlinnPhong) {
+                return blinn_phongs[material_index(rec.material)].getShading(*this, world, lights, r_in, backgroundColor, rec, depth);
+            }
+
             return color(0, 0, 0);
-        };
-        virtual double getRefractiveIndex() const {
-            return 0;
-        };
-        virtual double getReflectivity() const {
-            return 0;
-        };
-        virtual double getTransparency() const {
-            return 0;
-        }
-        virtual shared_ptr<Texture> getTexture() const = 0;
-
-        // Evaluate method for BRDF materials
-        virtual bool evaluate(const Ray& r_in, const HitRecord& rec, vec3& attenuation, Ray& scattered) const {
-            return false;
-        };
+        }
+
+    private:
+        friend class SceneCache;
+
+        std::vector<Lambertian> lambertians;
+        std::vector<SchlickBRDF> schlicks;
+        std::vector<SchlickRefractionsBRDF> schlick_refractions;
+        std::vector<BlinnPhong> blinn_phongs;
+
+        template <typename T>
+        static MaterialId push(std::vector<T>& materials, const T& material, MaterialType type) {
+            if (materials.size() >= material_index_limit) {
+                throw std::runtime_error("Too many materials of one type");
+            }
 
-        // Shading method for Blinn-Phong materials
-        virtual color getShading(
-            const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const Ray& r_in, const color& backgroundColor, HitRecord& rec, int depth) const {
-                return color(0, 0, 0);
-            };
+            materials.push_back(material);
+            return make_material_id(type, static_cast<uint32_t>(materials.size() - 1), material.isTextured());
+        }
 };
 
+inline color BlinnPhong::getShading(const MaterialTable& materials, const Hittable& world, const std::vector<shared_ptr<Light>>& lights, const Ray& r_in, const color& backgroundColor, HitRecord& rec, int depth) const {
+    vec3 view_direction = unit_vector(-r_in.direction());  // Direction from hit point to camera
+
+    // Initialize diffuse and specular components
+    color diffuse(0, 0, 0);
+    color specular(0, 0, 0);
+
+    // Iterate through all light sources            
+    for (const auto& light : lights) {
+        // Calculate the direction from hit point to light source
+        vec3 light_direction = light->getPosition() - rec.p;
+        real distance = light_direction.length_squared();
+        light_direction = unit_vector(light_direction);
+
+        // Calculate halfway vector between view direction and light direction
+        vec3 h = unit_vector(view_direction + light_direction);
+
+        real lambertian = std::max<real>(0, dot(rec.normal, light_direction));
+        real specular_angle = std::max<real>(0, dot(rec.normal, h));
+        vec3 intensity = light->sampleLight(rec, world);
+
+        // Accumulate the diffuse and specular contributions from current light source
+        diffuse += lambertian * intensity * 2 / distance;
+        specular += pow(specular_angle, specular_exponent) * specular_color * intensity * 2 / distance;
+    }
+
+    // If material is textured, multiply diffuse by texture_color
+    if (isTextured()) {
+        diffuse = diffuse * texture->getTextureColor(rec.texture_u, rec.texture_v);
+    } else {
+        diffuse = diffuse * diffuse_color;
+    }
+
+    // Calculate final colour
+    color shading = (kd * diffuse + ks * specular);
+
+    // Add ambient term
+    if (isTextured())
+        shading += color(0.2, 0.2, 0.2) * texture->getTextureColor(rec.texture_u, rec.texture_v);
+    else
+        shading += color(0.2, 0.2, 0.2) * diffuse_color;
+
+    // Handle reflections
+    if (is_reflective && depth > 0 && reflectivity > 0) {
+        // Set the scattered ray to be the reflected ray
+        vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+        Ray reflectedRay = rec.spawn_ray(reflected);
+        color reflection_color = backgroundColor;
+        HitRecord reflectHit;
+        
+        // Calculate the reflection color using the blinn_phong function
+        if (world.intersect(reflectedRay, interval(0, INFTY), reflectHit))
+            reflection_color = materials.getShading(world, lights, reflectedRay, backgroundColor, reflectHit, depth - 1);
+
+        // Multiply the reflection color by the material's reflectivity
+        shading = (reflection_color * reflectivity);
+    }
+
+    // Handle refractions
+    if (is_refractive && depth > 0) {
+        double refractiveIndexRatio = rec.front_face ? 1.0 / refractiveIndex : refractiveIndex;
+
+        vec3 unit_direction = unit_vector(r_in.direction());
+        double cos_theta = dot(-unit_direction, rec.normal);
+        double sin_theta = std::sqrt(1.0 - cos_theta * cos_theta);
+
+        // Total internal reflection if above critical angle or Schlick approx
+        bool cannot_refract = refractiveIndexRatio * sin_theta > 1.0;
+        if (cannot_refract || schlick(cos_theta, refractiveIndexRatio) > random_double()) {
+            // Reflection
+            vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+            Ray reflectedRay = rec.spawn_ray(reflected);
+            color reflection_color = backgroundColor;
+            HitRecord reflectHit;
+            
+            // Calculate the reflection color using the blinn_phong function
+            if (world.intersect(reflectedRay, interval(0, INFTY), reflectHit))
+                reflection_color = materials.getShading(world, lights, reflectedRay, backgroundColor, reflectHit, depth - 1);
+
+            double attenuation = exp(-transparency * rec.t);
+            shading = (reflection_color * attenuation);
+        } else {
+            // Refraction
+            vec3 refracted = refract(unit_direction, rec.normal, refractiveIndexRatio);
+            Ray refractedRay = rec.spawn_ray(refracted);
+            color refraction_color = backgroundColor;
+            HitRecord refractHit;
+
+            // Calculate the refraction color
+            if (world.intersect(refractedRay, interval(0, INFTY), refractHit))
+                refraction_color = materials.getShading(world, lights, refractedRay, backgroundColor, refractHit, depth-1);
+
+            // Use Beer's Law to attenuate the color based on distance
+            double attenuation = exp(-transparency * rec.t);
+            shading = (refraction_color * attenuation);
+        }
+    }
+    
+
+    return shading;  // Reflection always occurs in Blinn-Phong model
+}
+
 #endif
@@ -0,0 +1,39 @@
+#ifndef MATERIALID_H
+#define MATERIALID_H
+
+#include <cstdint>
+
+// Material kinds the MaterialTable can hold; dispatch is a switch over this tag
+enum class MaterialType : uint32_t {
+    Lambertian,
+    SchlickBRDF,
+    SchlickRefractionsBRDF,
+    BlinnPhong
+};
+
+// 32-bit reference to a material in the scene's MaterialTable. Besides the index within its
+// type's array, the ID carries the type tag and whether the material is textured, so hit
+// records and primitives never have to look the material up to dispatch or to decide on UVs.
+//   bits 30-31: MaterialType   bit 29: textured   bits 0-28: index
+using MaterialId = uint32_t;
+
+constexpr uint32_t material_index_bits = 29;
+constexpr uint32_t material_index_limit = 1u << material_index_bits;
+
+inline MaterialId make_material_id(MaterialType type, uint32_t index, bool textured) {
+    return (static_cast<uint32_t>(type) << 30) | (textured ? 1u << material_index_bits : 0u) | index;
+}
+
+inline MaterialType material_type(MaterialId id) {
+    return static_cast<MaterialType>(id >> 30);
+}
+
+inline uint32_t material_index(MaterialId id) {
+    return id & (material_index_limit - 1);
+}
+
+inline bool material_textured(MaterialId id) {
+    return (id >> material_index_bits) & 1u;
+}
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <string>
 #include <vector>
 
 #include "../misc/color.h"
@@ -13,7 +14,7 @@ struct Color {
 
 class Texture {
     public:
-        Texture(const char* _filename) {
+        Texture(const char* _filename) : filename(_filename) {
             loadPPM(_filename);
         }
 
@@ -40,7 +41,13 @@ class Texture {
             return static_cast<int>(texture.size());
         }
 
+        // File the texture was loaded from
+        const std::string& getFilename() const {
+            return filename;
+        }
+
     private:
+        std::string filename;
         std::vector<std::vector<Color>> texture;
 
         // Function to load PPM texture
@@ -1,42 +1,46 @@
 #ifndef INTERVAL_H
 #define INTERVAL_H
 
-class interval {
+// Interval over the scalar type T; the renderer uses interval, over the build's `real`
+template <typename T>
+class interval_t {
     public:
-        double min, max;
+        T min, max;
 
-        interval() : min(+INFTY), max(-INFTY) {} // Default interval is empty
+        interval_t() : min(+INFTY), max(-INFTY) {} // Default interval is empty
 
-        interval(double _min, double _max) : min(_min), max(_max) {}
-        interval(const interval& a, const interval& b)
-            : min(fmin(a.min, b.min)), max(fmax(a.max, b.max)) {}
+        interval_t(T _min, T _max) : min(_min), max(_max) {}
+        interval_t(const interval_t& a, const interval_t& b)
+            : min(std::fmin(a.min, b.min)), max(std::fmax(a.max, b.max)) {}
 
-        bool contains(double x) const {
+        bool contains(T x) const {
             return min <= x && x <= max;
         }
 
-        bool surrounds(double x) const {
+        bool surrounds(T x) const {
             return min < x && x < max;
         }
 
-        double size() const {
+        T size() const {
             return max - min;
         }
 
-        interval expand(double delta) const {
+        interval_t expand(T delta) const {
             auto padding = delta / 2;
-            return interval(min - padding, max + padding);
+            return interval_t(min - padding, max + padding);
         }
 
-        double clamp(double x) const {
+        T clamp(T x) const {
             if (x < min) return min;
             if (x > max) return max;
             return x;
         }
 
-        static const interval empty, universe;
+        static const interval_t empty, universe;
 };
 
+using interval = interval_t<real>;
+
 const static interval empty     (+INFTY, -INFTY);
 const static interval universe  (-INFTY, +INFTY);
 
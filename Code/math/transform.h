@@ -0,0 +1,132 @@
+#ifndef TRANSFORM_H
+#define TRANSFORM_H
+
+#include <cmath>
+
+#include "../misc/utils.h"
+#include "vec3.h"
+
+// Affine transform: the top three rows of a 4x4 matrix, kept together with its inverse so
+// points can be moved either way and normals transformed by the inverse transpose
+class Transform {
+    public:
+        // Identity
+        Transform() {
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    m[i][j] = inv[i][j] = (i == j) ? 1 : 0;
+                }
+            }
+        }
+
+        static Transform translate(const vec3& offset) {
+            Transform t;
+            for (int i = 0; i < 3; ++i) {
+                t.m[i][3] = offset[i];
+                t.inv[i][3] = -offset[i];
+            }
+            return t;
+        }
+
+        static Transform scale(const vec3& factors) {
+            Transform t;
+            for (int i = 0; i < 3; ++i) {
+                t.m[i][i] = factors[i];
+                t.inv[i][i] = 1.0 / factors[i];
+            }
+            return t;
+        }
+
+        // Rotation by an angle in degrees around an axis through the origin (Rodrigues)
+        static Transform rotate(const vec3& axis, double degrees) {
+            vec3 a = unit_vector(axis);
+            double theta = degrees_to_radians(degrees);
+            double c = cos(theta), s = sin(theta);
+
+            Transform t;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    t.m[i][j] = a[i] * a[j] * (1 - c) + (i == j ? c : 0);
+                }
+            }
+            t.m[0][1] -= a[2] * s; t.m[0][2] += a[1] * s;
+            t.m[1][0] += a[2] * s; t.m[1][2] -= a[0] * s;
+            t.m[2][0] -= a[1] * s; t.m[2][1] += a[0] * s;
+
+            // A rotation's inverse is its transpose
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 3; ++j) {
+                    t.inv[i][j] = t.m[j][i];
+                }
+            }
+            return t;
+        }
+
+        // Composition: (a * b) applies b first, then a
+        Transform operator*(const Transform& b) const {
+            Transform t;
+            multiply(m, b.m, t.m);
+            multiply(b.inv, inv, t.inv);
+            return t;
+        }
+
+        Transform inverse() const {
+            Transform t;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    t.m[i][j] = inv[i][j];
+                    t.inv[i][j] = m[i][j];
+                }
+            }
+            return t;
+        }
+
+        point3 point(const point3& p) const {
+            return point3(m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+                          m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+                          m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+        }
+
+        vec3 vector(const vec3& v) const {
+            return vec3(m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+                        m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+                        m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+        }
+
+        // Normals transform by the inverse transpose; the result is not renormalized
+        vec3 normal(const vec3& n) const {
+            return vec3(inv[0][0] * n.x() + inv[1][0] * n.y() + inv[2][0] * n.z(),
+                        inv[0][1] * n.x() + inv[1][1] * n.y() + inv[2][1] * n.z(),
+                        inv[0][2] * n.x() + inv[1][2] * n.y() + inv[2][2] * n.z());
+        }
+
+        // Same transform for a mirrored coordinate system: conjugate by the reflection z -> -z.
+        // Scene files are left-handed, so transforms read from them go through this.
+        Transform mirrorZ() const {
+            Transform t = *this;
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    if ((i == 2) != (j == 2)) {
+                        t.m[i][j] = -t.m[i][j];
+                        t.inv[i][j] = -t.inv[i][j];
+                    }
+                }
+            }
+            return t;
+        }
+
+    private:
+        double m[3][4];
+        double inv[3][4];
+
+        // c = a * b for affine 3x4 matrices (implicit last row 0 0 0 1)
+        static void multiply(const double a[3][4], const double b[3][4], double c[3][4]) {
+            for (int i = 0; i < 3; ++i) {
+                for (int j = 0; j < 4; ++j) {
+                    c[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j] + (j == 3 ? a[i][3] : 0);
+                }
+            }
+        }
+};
+
+#endif
@@ -2,69 +2,96 @@
 #define VEC3_H
 
 #include <cmath>
+#include <cstring>
 #include <iostream>
 
 using std::sqrt;
 
-class vec3 {
+// Three-component vector over the scalar type T. The renderer uses vec3, over the build's
+// `real` (see utils.h); other precisions are for code that needs a wider intermediate.
+//
+// The components are padded to four lanes (the fourth kept zero) and aligned to their width,
+// so a vector is one SSE register of floats or one AVX register of doubles (two SSE registers
+// on the SSE2 baseline) and its arithmetic is whole-register. It is compiled for the baseline
+// ISA like the rest of the renderer; only the kernels of simd.h are dispatched by ISA. Each
+// operation does the same arithmetic in the same order as the three scalar ones.
+template <typename T>
+class vec3_t {
     public:
-        double e[3];
+        using scalar = T;
+
+        alignas(4 * sizeof(T)) T e[4];
 
         // Constructors
-        vec3(): e{0, 0, 0} {}
-        vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
+        vec3_t(): e{0, 0, 0, 0} {}
+        vec3_t(T e0, T e1, T e2) : e{e0, e1, e2, 0} {}
+
+        // Between precisions only on request
+        template <typename U>
+        explicit vec3_t(const vec3_t<U>& v) : e{T(v.e[0]), T(v.e[1]), T(v.e[2]), 0} {}
 
         // Accessors
-        double x() const { return e[0]; }
-        double y() const { return e[1]; }
-        double z() const { return e[2]; }
+        T x() const { return e[0]; }
+        T y() const { return e[1]; }
+        T z() const { return e[2]; }
+
+        // The four lanes as a GCC vector. Vectors only travel by reference: AVX code passes a
+        // 32-byte vector by value in a register and SSE code in memory, so by value they could
+        // not cross between kernels built for different ISAs. vec3_t itself (a plain array)
+        // passes the same way everywhere.
+        typedef T lanes __attribute__((vector_size(4 * sizeof(T))));
+
+        [[gnu::always_inline]] explicit vec3_t(const lanes& l) {
+            std::memcpy(e, &l, sizeof(l));
+        }
+
+        [[gnu::always_inline]] void load(lanes& l) const {
+            std::memcpy(&l, e, sizeof(l));
+        }
 
         // Vector operations
-        vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-        double operator[](int i) const { return e[i]; }
-        double& operator[](int i) { return e[i]; }
-
-        vec3& operator=(const vec3 &v) {
-            e[0] = v.e[0];
-            e[1] = v.e[1];
-            e[2] = v.e[2];
-            return *this;
+        vec3_t operator-() const {
+            lanes a;
+            load(a);
+            return vec3_t(-a);
         }
+        T operator[](int i) const { return e[i]; }
+        T& operator[](int i) { return e[i]; }
 
-        vec3& operator+=(const vec3& v) {
-            e[0] += v.e[0];
-            e[1] += v.e[1];
-            e[2] += v.e[2];
+        vec3_t& operator=(const vec3_t &v) = default;
 
-            return *this;
+        vec3_t& operator+=(const vec3_t& v) {
+            lanes a, b;
+            load(a);
+            v.load(b);
+            return *this = vec3_t(a + b);
         }
 
-        vec3& operator*=(const double t) {
-            e[0] *= t;
-            e[1] *= t;
-            e[2] *= t;
-
-            return *this;
+        vec3_t& operator*=(const T t) {
+            lanes a;
+            load(a);
+            return *this = vec3_t(t * a);
         }
 
-        vec3& operator/=(const double t) {
+        vec3_t& operator/=(const T t) {
             return *this *= 1/t;
         }
 
-        // Component-wise division for Tone Mapping
-        vec3& operator/(const vec3 &v) {
+        // Component-wise division for Tone Mapping (on the three components, so the padding
+        // lane stays zero)
+        vec3_t& operator/(const vec3_t &v) {
             e[0] /= v.e[0];
             e[1] /= v.e[1];
             e[2] /= v.e[2];
             return *this;
         }
 
-        double length() const {
+        T length() const {
             return sqrt(length_squared());
         }
 
-        double length_squared() const {
-            return e[0]*e[0] + e[1]*e[1] + e[2]*e[2];
+        T length_squared() const {
+            return dot(*this, *this);
         }
 
         // Make vector unit length
@@ -73,80 +100,111 @@ class vec3 {
         }
 
         // Static methods for vector operations
-        static double dot(const vec3& v1, const vec3& v2) {
-            return v1.e[0]*v2.e[0]
-                 + v1.e[1]*v2.e[1]
-                 + v1.e[2]*v2.e[2];
+        static T dot(const vec3_t& v1, const vec3_t& v2) {
+            lanes a, b;
+            v1.load(a);
+            v2.load(b);
+            lanes products = a * b;
+            return products[0] + products[1] + products[2];
         }
 
-        static vec3 cross(const vec3& v1, const vec3& v2) {
-            return vec3((v1.e[1]*v2.e[2] - v1.e[2]*v2.e[1]),
-                        (v1.e[2]*v2.e[0] - v1.e[0]*v2.e[2]),
-                        (v1.e[0]*v2.e[1] - v1.e[1]*v2.e[0]));
+        // The shuffles are built from lanes rather than __builtin_shufflevector (GCC 12+), so
+        // older GCC and clang take them too
+        static vec3_t cross(const vec3_t& v1, const vec3_t& v2) {
+            lanes a, b;
+            v1.load(a);
+            v2.load(b);
+            return vec3_t(lanes{a[1], a[2], a[0], 0} * lanes{b[2], b[0], b[1], 0}
+                        - lanes{a[2], a[0], a[1], 0} * lanes{b[1], b[2], b[0], 0});
         }
 
-        static vec3 random() {
-            return vec3(random_double(), random_double(), random_double());
+        static vec3_t random() {
+            return vec3_t(random_double(), random_double(), random_double());
         }
 
-        static vec3 random(double min, double max) {
-            return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
+        static vec3_t random(double min, double max) {
+            return vec3_t(random_double(min, max), random_double(min, max), random_double(min, max));
         }
 };
 
 // Type aliases for vec3
+using vec3 = vec3_t<real>;
 using point3 = vec3;  // 3D point
 using color = vec3;  // RGB color
 
-// Utility functions for vec3
-inline std::ostream& operator<<(std::ostream &out, const vec3 &v) {
+// Utility functions for vec3. Scalars are taken as the vector's own scalar type, so a double
+// constant scales a float vector without a cast.
+template <typename T>
+inline std::ostream& operator<<(std::ostream &out, const vec3_t<T> &v) {
     return out << v.x() << ' ' << v.y() << ' ' << v.z();
 }
 
-inline vec3 operator+(const vec3 &u, const vec3 &v) {
-    return vec3(u.x() + v.x(), u.y() + v.y(), u.z() + v.z());
+template <typename T>
+inline vec3_t<T> operator+(const vec3_t<T> &u, const vec3_t<T> &v) {
+    typename vec3_t<T>::lanes a, b;
+    u.load(a);
+    v.load(b);
+    return vec3_t<T>(a + b);
 }
 
-inline vec3 operator-(const vec3 &u, const vec3 &v) {
-    return vec3(u.x() - v.x(), u.y() - v.y(), u.z() - v.z());
+template <typename T>
+inline vec3_t<T> operator-(const vec3_t<T> &u, const vec3_t<T> &v) {
+    typename vec3_t<T>::lanes a, b;
+    u.load(a);
+    v.load(b);
+    return vec3_t<T>(a - b);
 }
 
-inline vec3 operator*(const vec3 &u, const vec3 &v) {
-    return vec3(u.x() * v.x(), u.y() * v.y(), u.z() * v.z());
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &u, const vec3_t<T> &v) {
+    typename vec3_t<T>::lanes a, b;
+    u.load(a);
+    v.load(b);
+    return vec3_t<T>(a * b);
 }
 
-inline vec3 operator*(double t, const vec3 &v) {
-    return vec3(t * v.x(), t * v.y(), t * v.z());
+template <typename T>
+inline vec3_t<T> operator*(typename vec3_t<T>::scalar t, const vec3_t<T> &v) {
+    typename vec3_t<T>::lanes a;
+    v.load(a);
+    return vec3_t<T>(t * a);
 }
 
-inline vec3 operator*(const vec3 &v, double t) {
+template <typename T>
+inline vec3_t<T> operator*(const vec3_t<T> &v, typename vec3_t<T>::scalar t) {
     return t * v;
 }
 
-inline vec3 operator/(vec3 v, double t) {
+template <typename T>
+inline vec3_t<T> operator/(vec3_t<T> v, typename vec3_t<T>::scalar t) {
     return (1/t) * v;
 }
 
-inline vec3 unit_vector(const vec3& v) {
+template <typename T>
+inline vec3_t<T> unit_vector(const vec3_t<T>& v) {
     return v / v.length();
 }
 
-inline double dot(const vec3 &u, const vec3 &v) {
-    return u.x() * v.x() + u.y() * v.y() + u.z() * v.z();
+template <typename T>
+inline T dot(const vec3_t<T> &u, const vec3_t<T> &v) {
+    return vec3_t<T>::dot(u, v);
 }
 
-inline vec3 cross(const vec3 &u, const vec3 &v) {
-    return vec3(u.y()*v.z() - u.z()*v.y(), u.z()*v.x() - u.x()*v.z(), u.x()*v.y() - u.y()*v.x());
+template <typename T>
+inline vec3_t<T> cross(const vec3_t<T> &u, const vec3_t<T> &v) {
+    return vec3_t<T>::cross(u, v);
 }
 
-vec3 reflect(const vec3& v, const vec3& n) {
+template <typename T>
+inline vec3_t<T> reflect(const vec3_t<T>& v, const vec3_t<T>& n) {
     return v - 2*dot(v, n)*n;
 }
 
-inline vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
-    auto cos_theta = fmin(dot(-uv, n), 1.0);
-    vec3 r_out_perp = etai_over_etat * (uv + cos_theta*n);
-    vec3 r_out_parallel = -sqrt(fabs(1.0 - r_out_perp.length_squared())) * n;
+template <typename T>
+inline vec3_t<T> refract(const vec3_t<T>& uv, const vec3_t<T>& n, typename vec3_t<T>::scalar etai_over_etat) {
+    T cos_theta = std::fmin(dot(-uv, n), T(1));
+    vec3_t<T> r_out_perp = etai_over_etat * (uv + cos_theta*n);
+    vec3_t<T> r_out_parallel = -sqrt(std::fabs(1 - r_out_perp.length_squared())) * n;
     return r_out_perp + r_out_parallel;
 }
 
@@ -158,8 +216,18 @@ inline vec3 random_in_unit_sphere() {
     }
 }
 
+// Map two uniform numbers in [0, 1) straight onto the unit sphere (Archimedes' hat-box
+// theorem), so stratified 2D samples stay stratified on the sphere
+inline vec3 sample_unit_vector(double u, double v) {
+    auto z = 1 - 2 * u;
+    auto phi = 2 * PI * v;
+    auto r = sqrt(fmax(0.0, 1 - z*z));
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
 inline vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    double u = random_double();
+    return sample_unit_vector(u, random_double());
 }
 
 inline vec3 random_on_hemisphere(const vec3& normal) {
@@ -0,0 +1,118 @@
+#ifndef IMAGEWRITER_H
+#define IMAGEWRITER_H
+
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../core/Framebuffer.h"
+#include "color.h"
+
+// Output stage of the renderer: tone mapping and image encoding run on a finished
+// Framebuffer, after all rendering threads are done
+
+// Tone map the linear framebuffer into 8-bit RGB triples, row-major and top-to-bottom
+inline std::vector<unsigned char> tonemap(const Framebuffer& framebuffer, double exposure) {
+    size_t pixel_count = static_cast<size_t>(framebuffer.width()) * framebuffer.height();
+    std::vector<unsigned char> pixels(pixel_count * 3);
+
+    const float* rgb = framebuffer.data();
+    for (size_t p = 0; p < pixel_count; ++p) {
+        quantize_color(color(rgb[3*p], rgb[3*p + 1], rgb[3*p + 2]), exposure, &pixels[3*p]);
+    }
+
+    return pixels;
+}
+
+inline std::ofstream open_image(const std::string& filename) {
+    std::ofstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        throw std::runtime_error("Failed to open output image " + filename);
+    }
+    return file;
+}
+
+inline void check_written(const std::ofstream& file, const std::string& filename) {
+    if (!file) {
+        throw std::runtime_error("Failed to write output image " + filename);
+    }
+}
+
+// Write header and payload straight from the caller's buffer
+inline void write_file(const std::string& filename, const std::string& header, const void* data, size_t size) {
+    std::ofstream file = open_image(filename);
+    file << header;
+    file.write(static_cast<const char*>(data), size);
+    check_written(file, filename);
+}
+
+// Plain-text P3 PPM, tone mapped
+inline void write_ppm_ascii(std::ostream& output, const Framebuffer& framebuffer, double exposure) {
+    std::vector<unsigned char> pixels = tonemap(framebuffer, exposure);
+
+    output << "P3\n" << framebuffer.width() << " " << framebuffer.height() << "\n255\n";
+    for (size_t p = 0; p < pixels.size(); p += 3) {
+        output << static_cast<int>(pixels[p]) << ' '
+               << static_cast<int>(pixels[p + 1]) << ' '
+               << static_cast<int>(pixels[p + 2]) << '\n';
+    }
+}
+
+// Binary P6 PPM, tone mapped
+inline void write_ppm_binary(const std::string& filename, const Framebuffer& framebuffer, double exposure) {
+    std::vector<unsigned char> pixels = tonemap(framebuffer, exposure);
+    std::string header = "P6\n" + std::to_string(framebuffer.width()) + " " + std::to_string(framebuffer.height()) + "\n255\n";
+
+    write_file(filename, header, pixels.data(), pixels.size());
+}
+
+// Portable float map of a row-major, top-to-bottom float image with 1 (greyscale) or 3 (RGB)
+// channels. PFM stores rows bottom-to-top, so they are written straight from the image in
+// reverse order; a negative scale marks the floats as little-endian.
+inline void write_pfm(const std::string& filename, const float* image, int width, int height, int channels) {
+    uint32_t endian_probe = 1;
+    bool little_endian = *reinterpret_cast<unsigned char*>(&endian_probe) == 1;
+
+    std::ofstream file = open_image(filename);
+    file << (channels == 1 ? "Pf\n" : "PF\n") << width << " " << height << "\n" << (little_endian ? "-1.0\n" : "1.0\n");
+
+    size_t row_size = static_cast<size_t>(width) * channels;
+    for (int j = height - 1; j >= 0; --j) {
+        file.write(reinterpret_cast<const char*>(image + static_cast<size_t>(j) * row_size), row_size * sizeof(float));
+    }
+    check_written(file, filename);
+}
+
+// PFM holding the linear radiance
+inline void write_pfm(const std::string& filename, const Framebuffer& framebuffer) {
+    write_pfm(filename, framebuffer.data(), framebuffer.width(), framebuffer.height(), 3);
+}
+
+// Greyscale PFM holding the number of samples each pixel received
+inline void write_sample_map(const std::string& filename, const Framebuffer& framebuffer) {
+    std::vector<float> counts(static_cast<size_t>(framebuffer.width()) * framebuffer.height());
+
+    for (int j = 0; j < framebuffer.height(); ++j) {
+        for (int i = 0; i < framebuffer.width(); ++i) {
+            counts[static_cast<size_t>(j) * framebuffer.width() + i] = static_cast<float>(framebuffer.sampleCount(i, j));
+        }
+    }
+
+    write_pfm(filename, counts.data(), framebuffer.width(), framebuffer.height(), 1);
+}
+
+// Pick the encoder from the file extension: .pfm keeps linear radiance, anything else is P6
+inline void write_image(const std::string& filename, const Framebuffer& framebuffer, double exposure) {
+    bool is_pfm = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".pfm") == 0;
+
+    if (is_pfm) {
+        write_pfm(filename, framebuffer);
+    } else {
+        write_ppm_binary(filename, framebuffer, exposure);
+    }
+}
+
+#endif
@@ -1,8 +1,11 @@
 #ifndef JSONPARSER_H
 #define JSONPARSER_H
 
+#include <chrono>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <sstream>
 #include <string>
 #include <optional>
 #include <json/json.h>
@@ -12,37 +15,77 @@
 #include "../core/Scene.h"
 #include "../geometry/bvh.h"
 #include "../geometry/Cylinder.h"
+#include "../geometry/Instance.h"
 #include "../geometry/Sphere.h"
 #include "../geometry/Triangle.h"
+#include "../geometry/TriangleMesh.h"
 #include "../lights/PointLight.h"
 #include "../lights/AreaLight.h"
 #include "../materials/BlinnPhong.h"
 #include "../materials/BRDF.h"
+#include "MeshLoader.h"
+#include "SceneCache.h"
 
 class JsonParser {
     public:
-        JsonParser(const std::string& filename) : filename(filename) {}
+        // With a cache directory, parsed geometry and its BVH are cached there (see SceneCache)
+        JsonParser(const std::string& filename, const std::string& cache_dir = "") : filename(filename), cache_dir(cache_dir) {}
 
         Scene parse() {
-            std::ifstream file(filename);
+            std::ifstream file(filename, std::ios::binary);
             if (!file.is_open()) {
                 throw std::runtime_error("Failed to open JSON file");
             }
 
-            Json::CharReaderBuilder reader;
-            Json::Value root;
-            std::string errs;
-            Json::parseFromStream(reader, file, &root, &errs);
+            std::stringstream contents;
+            contents << file.rdbuf();
+            std::string text = contents.str();
 
             file.close();
 
+            // An unchanged scene comes straight from its cache file
+            std::string cache_file;
+            uint64_t scene_hash = 0;
+            if (!cache_dir.empty()) {
+                scene_hash = SceneCache::hash(text.data(), text.size());
+                cache_file = SceneCache::fileName(cache_dir, scene_hash);
+
+                auto start = std::chrono::steady_clock::now();
+                std::optional<SceneCache::Contents> cached;
+                try {
+                    cached = SceneCache::load(cache_file, scene_hash);
+                } catch (const std::exception& e) {
+                    std::clog << e.what() << ", ignoring it\n";
+                }
+
+                if (cached) {
+                    Json::Value settings = parseJson(cached->settings);
+                    std::clog << "Scene cache: loaded " << cache_file << " (" << cached->world->primitiveCount() << " primitives, "
+                              << cached->world->nodeCount() << " nodes) in "
+                              << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() << " ms\n";
+
+                    return finishScene(settings, parseCamera(settings), HittableList(cached->world), std::move(cached->materials), Animation());
+                }
+            }
+
+            Json::Value root = parseJson(text);
+
             // Parse render mode and camera settings
             shared_ptr<Camera> cam = parseCamera(root);
 
-            return parseScene(root, cam);
+            return parseScene(root, cam, cache_file, scene_hash);
         }
     
     private:
+        static Json::Value parseJson(const std::string& text) {
+            std::istringstream stream(text);
+            Json::CharReaderBuilder reader;
+            Json::Value root;
+            std::string errs;
+            Json::parseFromStream(reader, stream, &root, &errs);
+            return root;
+        }
+
         static vec3 parseVector(const Json::Value& jsonVector) {
             return vec3(jsonVector[0].asDouble(), jsonVector[1].asDouble(), jsonVector[2].asDouble());
         }
@@ -66,6 +109,7 @@ class JsonParser {
             cam.type = root["camera"]["type"].asString();
             cam.render_mode = root["rendermode"].asString();
             cam.nbounces = root["nbounces"].asInt();
+            cam.rr_min_depth = root.get("rrmindepth", cam.rr_min_depth).asInt();
             cam.background = parseColor(root["scene"]["backgroundcolor"]);
             cam.image_width = root["camera"]["width"].asInt();
             cam.image_height = root["camera"]["height"].asInt();
@@ -75,50 +119,101 @@ class JsonParser {
             cam.vfov = root["camera"]["fov"].asDouble();
             cam.exposure = root["camera"]["exposure"].asDouble();
             cam.lens_radius = root["camera"]["lensRadius"].asDouble();
+            cam.num_threads = root["camera"]["threads"].asInt();
+            cam.tile_size = root["camera"].get("tileSize", cam.tile_size).asInt();
+            cam.seed = root["camera"]["seed"].asUInt();
+
+            // Adaptive sampling is enabled by the presence of its settings block
+            const Json::Value& adaptive = root["camera"]["adaptive"];
+            if (adaptive.isObject()) {
+                cam.adaptive_sampling = true;
+                cam.min_samples = adaptive.get("minSamples", cam.min_samples).asInt();
+                cam.max_samples = adaptive.get("maxSamples", cam.max_samples).asInt();
+                cam.adaptive_threshold = adaptive.get("threshold", cam.adaptive_threshold).asDouble();
+
+                // Every pixel must take at least one sample, or its mean is 0/0
+                if (cam.min_samples < 1 || cam.max_samples < cam.min_samples) {
+                    throw std::runtime_error("Adaptive sampling needs 1 <= minSamples <= maxSamples, got minSamples "
+                                             + std::to_string(cam.min_samples) + ", maxSamples " + std::to_string(cam.max_samples));
+                }
+            }
 
             return make_shared<Camera>(cam);
         }
 
-        // Parse the Scene section of the JSON
-        static Scene parseScene(const Json::Value& root, shared_ptr<Camera> cam) {
+        // Parse the Scene section of the JSON. A non-empty cache_file receives the parsed geometry.
+        static Scene parseScene(const Json::Value& root, shared_ptr<Camera> cam, const std::string& cache_file, uint64_t scene_hash) {
             string renderMode = root["rendermode"].asString();
 
             // Parse scene settings
+            MaterialTable materials;
+            Animation animation;
+            int leafSize = root.get("bvhleafsize", 4).asInt();
+            int buildThreads = cam->num_threads;   // BVH construction uses the render threads
+
+            // Named geometry: each entry becomes one bottom-level BVH, shared by every instance of it
+            std::map<string, shared_ptr<Hittable>> geometries;
+            const Json::Value& geometryJson = root["scene"]["geometry"];
+            for (const string& name : geometryJson.getMemberNames()) {
+                HittableList shapes;
+                for (const auto& shapeJson : geometryJson[name]) {
+                    if (shapeJson["type"].asString() == "instance") {
+                        throw std::runtime_error("Geometry " + name + " contains an instance; instances cannot be nested");
+                    }
+                    parseShape(shapeJson, renderMode, materials, shapes);
+                }
+
+                auto bvh = make_shared<bvh_node>(shapes, leafSize, buildThreads);
+                std::clog << "Geometry " << name << ": " << bvh->primitiveCount() << " primitives, "
+                          << bvh->nodeCount() << " nodes\n";
+                geometries[name] = bvh;
+            }
+
             HittableList objects;
+            HittableList instances;
             const Json::Value& shapesArray = root["scene"]["shapes"];
             for (const auto& shapeJson : shapesArray) {
-                string type = shapeJson["type"].asString();
-                if (type == "sphere") {
-                    if (renderMode == "phong") {
-                        auto sphere_material = parseBlinnPhongMaterial(shapeJson["material"]);
-                        objects.add(make_shared<Sphere>(parseVectorRotate(shapeJson["center"]), shapeJson["radius"].asDouble(), sphere_material));
-                    } else {
-                        auto sphere_material = parseBRDFMaterial(shapeJson["material"]);
-                        objects.add(make_shared<Sphere>(parseVectorRotate(shapeJson["center"]), shapeJson["radius"].asDouble(), sphere_material, 3));
-                    }
-
-                } else if (type == "cylinder") {
-                    if (renderMode == "phong") {
-                        auto cylinder_material = parseBlinnPhongMaterial(shapeJson["material"]);
-                        objects.add(make_shared<Cylinder>(parseVectorRotate(shapeJson["center"]), parseVector(shapeJson["axis"]), shapeJson["radius"].asDouble(), shapeJson["height"].asDouble(), cylinder_material));
-                    } else {
-                        auto cylinder_material = parseBRDFMaterial(shapeJson["material"]);
-                        objects.add(make_shared<Cylinder>(parseVectorRotate(shapeJson["center"]), parseVector(shapeJson["axis"]), shapeJson["radius"].asDouble(), shapeJson["height"].asDouble(), cylinder_material));
-                    }
-                } else if (type == "triangle") {
-                    if (renderMode == "phong") {
-                        auto triangle_material = parseBlinnPhongMaterial(shapeJson["material"]);
-                        objects.add(make_shared<Triangle>(parseVectorRotate(shapeJson["v0"]), parseVectorRotate(shapeJson["v1"]), parseVectorRotate(shapeJson["v2"]), triangle_material));
-                    } else {
-                        auto triangle_material = parseBRDFMaterial(shapeJson["material"]);
-                        objects.add(make_shared<Triangle>(parseVectorRotate(shapeJson["v0"]), parseVectorRotate(shapeJson["v1"]), parseVectorRotate(shapeJson["v2"]), triangle_material));
-                    }
+                if (shapeJson["type"].asString() == "instance") {
+                    instances.add(parseInstance(shapeJson, geometries, animation));
+                } else {
+                    parseShape(shapeJson, renderMode, materials, objects);
                 }
             }
+
             // Turn to BVH tree
-            objects = HittableList(make_shared<bvh_node>(objects));
+            auto build_start = std::chrono::steady_clock::now();
+            auto bvh = make_shared<bvh_node>(objects, leafSize, buildThreads);
+            double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - build_start).count();
+            if (bvh->primitiveCount() > 0 || instances.objects.empty()) {
+                std::clog << "BVH: " << bvh->primitiveCount() << " primitives, " << bvh->nodeCount()
+                          << " nodes, SAH cost " << bvh->sahCost() << ", built in " << build_ms << " ms\n";
+            }
 
-            // Parse light settings
+            if (!cache_file.empty()) {
+                saveCache(root, cache_file, scene_hash, materials, *bvh, geometries.empty() && instances.objects.empty());
+            }
+
+            if (instances.objects.empty()) {
+                objects = HittableList(bvh);
+            } else {
+                // Two levels: a top-level BVH over the instances, with the world-space primitives'
+                // own tree as one more entry. Moving an instance only rebuilds this small tree.
+                HittableList top = instances;
+                if (bvh->primitiveCount() > 0) top.add(bvh);
+
+                auto top_bvh = make_shared<bvh_node>(top, leafSize, buildThreads);
+                std::clog << "Top-level BVH: " << instances.objects.size() << " instances of "
+                          << geometries.size() << " geometries, " << top_bvh->nodeCount() << " nodes\n";
+                objects = HittableList(top_bvh);
+                animation.setTopLevel(top_bvh);
+            }
+
+            return finishScene(root, cam, objects, std::move(materials), std::move(animation));
+        }
+
+        // Lights and frame sequence settings, then the scene around the finished world
+        static Scene finishScene(const Json::Value& root, shared_ptr<Camera> cam, HittableList objects, MaterialTable materials, Animation animation) {
+            // Parse light settings; a light with keyframes moves its position (an area light its corner)
             std::vector<shared_ptr<Light>> lights = {};
             const Json::Value& lightsArray = root["scene"]["lightsources"];
             for (const auto& lightJson : lightsArray) {
@@ -127,19 +222,198 @@ class JsonParser {
                 } else {
                     lights.push_back(make_shared<AreaLight>(parsePoint(lightJson["corner"]), parseVector(lightJson["edge1"]), parseVector(lightJson["edge2"]), parseVector(lightJson["intensity"]), lightJson["samples"].asInt()));
                 }
+
+                if (lightJson["keyframes"].isArray()) {
+                    LightMotion motion;
+                    motion.light = lights.back();
+                    for (const auto& key : lightJson["keyframes"]) {
+                        motion.keyframes.add(key["frame"].asInt(), parsePoint(key["position"]));
+                    }
+                    animation.addLightMotion(motion);
+                }
+            }
+
+            // Camera keyframes; what a keyframe leaves out stays as the camera block sets it
+            const Json::Value& cameraKeys = root["camera"]["keyframes"];
+            if (cameraKeys.isArray()) {
+                Keyframes<CameraPose> keyframes;
+                for (const auto& key : cameraKeys) {
+                    CameraPose pose = {cam->lookfrom, cam->lookat, cam->vup};
+                    if (key["position"].isArray()) pose.lookfrom = parsePoint(key["position"]);
+                    if (key["lookAt"].isArray()) pose.lookat = parsePoint(key["lookAt"]);
+                    if (key["upVector"].isArray()) pose.vup = parseVector(key["upVector"]);
+                    keyframes.add(key["frame"].asInt(), pose);
+                }
+                animation.setCameraMotion(cam, keyframes);
             }
 
-            Scene scene(cam, objects, lights);
+            // Frame sequence settings
+            const Json::Value& animationJson = root["animation"];
+            if (animationJson.isObject()) {
+                animation.frames = animationJson.get("frames", animation.frames).asInt();
+                animation.rebuild_threshold = animationJson.get("rebuildThreshold", animation.rebuild_threshold).asDouble();
+            }
+
+            Scene scene(cam, objects, lights, std::move(materials), std::move(animation));
             return scene;
         }
 
-        static shared_ptr<BlinnPhong> parseBlinnPhongMaterial(const Json::Value& jsonMaterial) {
+        // Write the scene cache. Instanced scenes are not cached, and a failed write only costs
+        // the next run its head start.
+        static void saveCache(const Json::Value& root, const std::string& cache_file, uint64_t scene_hash,
+                              const MaterialTable& materials, const bvh_node& bvh, bool cacheable) {
+            if (!cacheable) {
+                std::clog << "Scene cache: scenes with instances are not cached\n";
+                return;
+            }
+
+            // Everything but the shapes, which the cache replaces
+            Json::Value settings = root;
+            settings["scene"].removeMember("shapes");
+            settings["scene"].removeMember("geometry");
+
+            // Files the shapes read, whose contents the cache depends on
+            std::vector<string> assets;
+            for (const auto& shapeJson : root["scene"]["shapes"]) {
+                for (const Json::Value& asset : {shapeJson["file"], shapeJson["material"]["texture"]}) {
+                    if (asset.isString() && std::find(assets.begin(), assets.end(), asset.asString()) == assets.end()) {
+                        assets.push_back(asset.asString());
+                    }
+                }
+            }
+
+            try {
+                Json::StreamWriterBuilder writer;
+                writer["indentation"] = "";
+                if (SceneCache::save(cache_file, scene_hash, Json::writeString(writer, settings), assets, materials, bvh)) {
+                    std::clog << "Scene cache: wrote " << cache_file << '\n';
+                }
+            } catch (const std::exception& e) {
+                std::clog << e.what() << '\n';
+            }
+        }
+
+        // Parse one primitive shape (anything but an instance) and add it to the list
+        static void parseShape(const Json::Value& shapeJson, const string& renderMode, MaterialTable& materials, HittableList& objects) {
+            string type = shapeJson["type"].asString();
+            if (type == "sphere") {
+                if (renderMode == "phong") {
+                    auto sphere_material = parseBlinnPhongMaterial(shapeJson["material"], materials);
+                    objects.add(make_shared<Sphere>(parseVectorRotate(shapeJson["center"]), shapeJson["radius"].asDouble(), sphere_material));
+                } else {
+                    auto sphere_material = parseBRDFMaterial(shapeJson["material"], materials);
+                    objects.add(make_shared<Sphere>(parseVectorRotate(shapeJson["center"]), shapeJson["radius"].asDouble(), sphere_material, 3));
+                }
+
+            } else if (type == "cylinder") {
+                if (renderMode == "phong") {
+                    auto cylinder_material = parseBlinnPhongMaterial(shapeJson["material"], materials);
+                    objects.add(make_shared<Cylinder>(parseVectorRotate(shapeJson["center"]), parseVector(shapeJson["axis"]), shapeJson["radius"].asDouble(), shapeJson["height"].asDouble(), cylinder_material));
+                } else {
+                    auto cylinder_material = parseBRDFMaterial(shapeJson["material"], materials);
+                    objects.add(make_shared<Cylinder>(parseVectorRotate(shapeJson["center"]), parseVector(shapeJson["axis"]), shapeJson["radius"].asDouble(), shapeJson["height"].asDouble(), cylinder_material));
+                }
+            } else if (type == "triangle") {
+                if (renderMode == "phong") {
+                    auto triangle_material = parseBlinnPhongMaterial(shapeJson["material"], materials);
+                    objects.add(make_shared<Triangle>(parseVectorRotate(shapeJson["v0"]), parseVectorRotate(shapeJson["v1"]), parseVectorRotate(shapeJson["v2"]), triangle_material));
+                } else {
+                    auto triangle_material = parseBRDFMaterial(shapeJson["material"], materials);
+                    objects.add(make_shared<Triangle>(parseVectorRotate(shapeJson["v0"]), parseVectorRotate(shapeJson["v1"]), parseVectorRotate(shapeJson["v2"]), triangle_material));
+                }
+            } else if (type == "mesh") {
+                auto mesh = parseMesh(shapeJson);
+                if (renderMode == "phong") {
+                    mesh->material = parseBlinnPhongMaterial(shapeJson["material"], materials);
+                } else {
+                    mesh->material = parseBRDFMaterial(shapeJson["material"], materials);
+                }
+                objects.add(mesh);
+            }
+        }
+
+        // Place named geometry in the world. An optional "motion" block gives the rotation and
+        // translation added every frame of an animation, or keyframes of the placement.
+        static shared_ptr<Instance> parseInstance(const Json::Value& shapeJson, const std::map<string, shared_ptr<Hittable>>& geometries, Animation& animation) {
+            string name = shapeJson["geometry"].asString();
+            auto geometry = geometries.find(name);
+            if (geometry == geometries.end()) {
+                throw std::runtime_error("Instance of unknown geometry " + name);
+            }
+
+            // Empty geometry has infinite bounds, which turn into NaNs once transformed
+            aabb box = geometry->second->bounding_box();
+            for (int a = 0; a < 3; ++a) {
+                if (!std::isfinite(box.axis(a).min) || !std::isfinite(box.axis(a).max)) {
+                    throw std::runtime_error("Instance of geometry " + name + ", which is empty");
+                }
+            }
+
+            Placement placement = parsePlacement(shapeJson, Placement(), name);
+            auto instance = make_shared<Instance>(geometry->second, placement.transform());
+
+            const Json::Value& motion = shapeJson["motion"];
+            if (motion.isObject()) {
+                InstanceMotion instance_motion;
+                instance_motion.instance = instance;
+                instance_motion.start = placement;
+                if (motion["rotate"].isArray()) instance_motion.rotate_step = parseVector(motion["rotate"]);
+                if (motion["translate"].isArray()) instance_motion.translate_step = parseVector(motion["translate"]);
+                for (const auto& key : motion["keyframes"]) {
+                    instance_motion.keyframes.add(key["frame"].asInt(), parsePlacement(key, placement, name));
+                }
+                animation.addMotion(instance_motion);
+            }
+
+            return instance;
+        }
+
+        // Scale, rotation and translation of an instance, or of a keyframe over the instance's own
+        static Placement parsePlacement(const Json::Value& json, Placement placement, const string& name) {
+            const Json::Value& scale = json["scale"];
+            if (scale.isNumeric()) {
+                placement.scale = vec3(scale.asDouble(), scale.asDouble(), scale.asDouble());
+            } else if (scale.isArray()) {
+                placement.scale = parseVector(scale);
+            }
+            if (json["rotate"].isArray()) placement.rotate = parseVector(json["rotate"]);
+            if (json["translate"].isArray()) placement.translate = parseVector(json["translate"]);
+            checkScale(placement.scale, name);
+            return placement;
+        }
+
+        // An instance's world_to_object divides by its scale
+        static void checkScale(const vec3& scale, const string& name) {
+            for (int a = 0; a < 3; ++a) {
+                if (scale[a] == 0 || !std::isfinite(scale[a])) {
+                    throw std::runtime_error("Instance of geometry " + name + " has scale " + std::to_string(scale[a]) + " on axis "
+                                             + "xyz"[a] + ", which cannot be inverted");
+                }
+            }
+        }
+
+        // Load an OBJ/PLY mesh file. Mesh files share the scene file's coordinate convention, so
+        // z is flipped the same way parseVectorRotate does.
+        static shared_ptr<TriangleMesh> parseMesh(const Json::Value& shapeJson) {
+            string file = shapeJson["file"].asString();
+            auto mesh = load_mesh(file);
+
+            for (float& z : mesh->pz) z = -z;
+            for (float& z : mesh->nz) z = -z;
+
+            std::clog << "Mesh " << file << ": " << mesh->triangleCount() << " triangles, " << mesh->vertexCount()
+                      << " vertices, " << mesh->memoryUsage() / (1024.0 * 1024.0) << " MiB\n";
+            return mesh;
+        }
+
+        // Material parsers add the material to the scene's table and return its ID
+        static MaterialId parseBlinnPhongMaterial(const Json::Value& jsonMaterial, MaterialTable& materials) {
             shared_ptr<Texture> texture;
             if (jsonMaterial["texture"]) {
                 texture = make_shared<Texture>(jsonMaterial["texture"].asCString());
             }
 
-            auto material = make_shared<BlinnPhong>(
+            BlinnPhong material(
                 texture,
                 parseColor(jsonMaterial["diffusecolor"]),
                 parseColor(jsonMaterial["specularcolor"]),
@@ -153,34 +427,28 @@ class JsonParser {
                 jsonMaterial["transparency"].asDouble()
             );
 
-            return material;
+            return materials.add(material);
         }
 
-        static shared_ptr<Material> parseBRDFMaterial(const Json::Value& jsonMaterial) {
+        static MaterialId parseBRDFMaterial(const Json::Value& jsonMaterial, MaterialTable& materials) {
             shared_ptr<Texture> texture;
             if (jsonMaterial["texture"]) {
                 texture = make_shared<Texture>(jsonMaterial["texture"].asCString());
             }
 
             if (jsonMaterial["brdfType"] == "lambertian") {
-                auto material = make_shared<Lambertian>(parseColor(jsonMaterial["diffusecolor"]), texture);
-                return material;
+                return materials.add(Lambertian(parseColor(jsonMaterial["diffusecolor"]), texture));
             } else if (jsonMaterial["brdfType"] == "schlick") {
                 // Schlick material (without refractions)
-                auto material = make_shared<SchlickBRDF>(
-                    jsonMaterial["reflectance"].asFloat()
-                );
-                return material;
+                return materials.add(SchlickBRDF(jsonMaterial["reflectance"].asFloat()));
             } else {
                 // Schlick material (with refractions)
-                auto material = make_shared<SchlickRefractionsBRDF>(
-                    jsonMaterial["reflectance"].asFloat()
-                );
-                return material;
+                return materials.add(SchlickRefractionsBRDF(jsonMaterial["reflectance"].asFloat()));
             }
         }
 
         std::string filename;
+        std::string cache_dir;
 };
 
 #endif
@@ -0,0 +1,457 @@
+#ifndef MESHLOADER_H
+#define MESHLOADER_H
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "../geometry/TriangleMesh.h"
+
+// Streaming loaders for Wavefront OBJ and PLY (ASCII and binary) triangle meshes. Files are
+// read one line or one element at a time straight into the mesh buffers; polygons are
+// triangulated as fans.
+
+// OBJ indexes positions, texture coordinates and normals separately, so every distinct
+// (position, uv, normal) corner becomes one mesh vertex
+class ObjLoader {
+    public:
+        shared_ptr<TriangleMesh> load(const std::string& filename) {
+            std::ifstream file(filename);
+            if (!file.is_open()) {
+                throw std::runtime_error("Failed to open mesh file " + filename);
+            }
+
+            mesh = make_shared<TriangleMesh>();
+
+            std::string line;
+            std::vector<uint32_t> polygon;
+            size_t line_number = 0;
+
+            while (std::getline(file, line)) {
+                ++line_number;
+                const char* c = line.c_str();
+                std::string_view keyword = nextToken(c);
+
+                if (keyword == "v") {
+                    parseFloats(c, 3, positions);
+                } else if (keyword == "vn") {
+                    parseFloats(c, 3, normals);
+                } else if (keyword == "vt") {
+                    parseFloats(c, 2, uvs);
+                } else if (keyword == "f") {
+                    polygon.clear();
+
+                    for (std::string_view corner = nextToken(c); !corner.empty(); corner = nextToken(c)) {
+                        polygon.push_back(parseCorner(corner, filename, line_number));
+                    }
+
+                    for (size_t k = 2; k < polygon.size(); ++k) {
+                        mesh->indices.insert(mesh->indices.end(), {polygon[0], polygon[k - 1], polygon[k]});
+                    }
+                }
+            }
+
+            // Attributes only survive if every vertex has them
+            if (!all_normals) {
+                mesh->nx.clear(); mesh->ny.clear(); mesh->nz.clear();
+            }
+            if (!all_uvs) {
+                mesh->tu.clear(); mesh->tv.clear();
+            }
+
+            return mesh;
+        }
+
+    private:
+        struct CornerKey {
+            uint32_t position, uv, normal;
+
+            bool operator==(const CornerKey& other) const {
+                return position == other.position && uv == other.uv && normal == other.normal;
+            }
+        };
+
+        struct CornerHash {
+            size_t operator()(const CornerKey& key) const {
+                uint64_t h = key.position * 0x9E3779B97F4A7C15ull;
+                h ^= (h >> 29) + key.uv * 0xBF58476D1CE4E5B9ull;
+                h ^= (h >> 31) + key.normal * 0x94D049BB133111EBull;
+                return static_cast<size_t>(h ^ (h >> 32));
+            }
+        };
+
+        shared_ptr<TriangleMesh> mesh;
+        std::vector<float> positions, normals, uvs;
+
+        // Corners without uv or normal map straight from the position index; the rest go through a hash map
+        std::vector<uint32_t> position_vertices;
+        std::unordered_map<CornerKey, uint32_t, CornerHash> corner_vertices;
+        bool all_normals = true;
+        bool all_uvs = true;
+
+        static bool isSpace(char c) {
+            return std::isspace(static_cast<unsigned char>(c)) != 0;
+        }
+
+        // The whitespace-delimited token at c, empty at the end of the line; c moves past it
+        static std::string_view nextToken(const char*& c) {
+            while (isSpace(*c)) ++c;
+            const char* start = c;
+            while (*c != '\0' && !isSpace(*c)) ++c;
+            return std::string_view(start, static_cast<size_t>(c - start));
+        }
+
+        static void parseFloats(const char* c, int count, std::vector<float>& out) {
+            for (int k = 0; k < count; ++k) {
+                char* end;
+                out.push_back(std::strtof(c, &end));
+                c = end;
+            }
+        }
+
+        // OBJ indices are 1-based; negative ones count back from the latest element
+        static uint32_t resolveIndex(long index, size_t count, const std::string& filename, size_t line_number) {
+            long resolved = (index < 0) ? static_cast<long>(count) + index : index - 1;
+            if (resolved < 0 || static_cast<size_t>(resolved) >= count) {
+                throw std::runtime_error(filename + ":" + std::to_string(line_number) + ": face index out of range");
+            }
+            return static_cast<uint32_t>(resolved);
+        }
+
+        // Parse one "p", "p/t", "p//n" or "p/t/n" face corner and return its mesh vertex
+        uint32_t parseCorner(std::string_view corner, const std::string& filename, size_t line_number) {
+            const char* c = corner.data();
+            const char* end = c + corner.size();
+            long p = 0, t = 0, n = 0;
+
+            c = std::from_chars(c, end, p).ptr;
+            if (c != end && *c == '/') {
+                ++c;
+                if (c != end && *c != '/') c = std::from_chars(c, end, t).ptr;
+                if (c != end && *c == '/') c = std::from_chars(c + 1, end, n).ptr;
+            }
+
+            CornerKey key;
+            key.position = resolveIndex(p, positions.size() / 3, filename, line_number);
+            key.uv = (t != 0) ? resolveIndex(t, uvs.size() / 2, filename, line_number) : UINT32_MAX;
+            key.normal = (n != 0) ? resolveIndex(n, normals.size() / 3, filename, line_number) : UINT32_MAX;
+
+            if (key.uv == UINT32_MAX && key.normal == UINT32_MAX) {
+                if (position_vertices.size() <= key.position) {
+                    position_vertices.resize(positions.size() / 3, UINT32_MAX);
+                }
+                uint32_t& vertex = position_vertices[key.position];
+                if (vertex == UINT32_MAX) {
+                    vertex = addVertex(key);
+                }
+                return vertex;
+            }
+
+            auto found = corner_vertices.find(key);
+            if (found != corner_vertices.end()) {
+                return found->second;
+            }
+
+            uint32_t vertex = addVertex(key);
+            corner_vertices.emplace(key, vertex);
+            return vertex;
+        }
+
+        uint32_t addVertex(const CornerKey& key) {
+            uint32_t vertex = static_cast<uint32_t>(mesh->px.size());
+
+            mesh->px.push_back(positions[3 * key.position]);
+            mesh->py.push_back(positions[3 * key.position + 1]);
+            mesh->pz.push_back(positions[3 * key.position + 2]);
+
+            if (key.normal != UINT32_MAX) {
+                mesh->nx.push_back(normals[3 * key.normal]);
+                mesh->ny.push_back(normals[3 * key.normal + 1]);
+                mesh->nz.push_back(normals[3 * key.normal + 2]);
+            } else {
+                all_normals = false;
+            }
+
+            if (key.uv != UINT32_MAX) {
+                mesh->tu.push_back(uvs[2 * key.uv]);
+                mesh->tv.push_back(uvs[2 * key.uv + 1]);
+            } else {
+                all_uvs = false;
+            }
+
+            return vertex;
+        }
+};
+
+// PLY with a "vertex" element (x, y, z and optionally nx, ny, nz and u, v / s, t) and a "face"
+// element holding a vertex index list. Other elements and properties are skipped.
+class PlyLoader {
+    public:
+        shared_ptr<TriangleMesh> load(const std::string& filename) {
+            std::ifstream file(filename, std::ios::binary);
+            if (!file.is_open()) {
+                throw std::runtime_error("Failed to open mesh file " + filename);
+            }
+
+            readHeader(file, filename);
+
+            auto mesh = make_shared<TriangleMesh>();
+
+            for (const Element& element : elements) {
+                if (element.name == "vertex") {
+                    readVertices(file, element, *mesh);
+                } else if (element.name == "face") {
+                    readFaces(file, element, *mesh);
+                } else {
+                    for (size_t k = 0; k < element.count; ++k) {
+                        for (const Property& property : element.properties) {
+                            readProperty(file, property);
+                        }
+                    }
+                }
+
+                if (!file) {
+                    throw std::runtime_error("Unexpected end of mesh file " + filename);
+                }
+            }
+
+            for (uint32_t index : mesh->indices) {
+                if (index >= mesh->vertexCount()) {
+                    throw std::runtime_error(filename + ": face index out of range");
+                }
+            }
+
+            return mesh;
+        }
+
+    private:
+        enum class Format { Ascii, BinaryLittleEndian, BinaryBigEndian };
+        enum class Type { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+        struct Property {
+            std::string name;
+            Type type = Type::Float32;
+            bool is_list = false;
+            Type count_type = Type::UInt8;
+        };
+
+        struct Element {
+            std::string name;
+            size_t count = 0;
+            std::vector<Property> properties;
+        };
+
+        Format format = Format::Ascii;
+        std::vector<Element> elements;
+
+        static Type parseType(const std::string& name, const std::string& filename) {
+            if (name == "char" || name == "int8") return Type::Int8;
+            if (name == "uchar" || name == "uint8") return Type::UInt8;
+            if (name == "short" || name == "int16") return Type::Int16;
+            if (name == "ushort" || name == "uint16") return Type::UInt16;
+            if (name == "int" || name == "int32") return Type::Int32;
+            if (name == "uint" || name == "uint32") return Type::UInt32;
+            if (name == "float" || name == "float32") return Type::Float32;
+            if (name == "double" || name == "float64") return Type::Float64;
+            throw std::runtime_error(filename + ": unknown PLY type " + name);
+        }
+
+        static size_t typeSize(Type type) {
+            switch (type) {
+                case Type::Int8: case Type::UInt8: return 1;
+                case Type::Int16: case Type::UInt16: return 2;
+                case Type::Int32: case Type::UInt32: case Type::Float32: return 4;
+                case Type::Float64: return 8;
+            }
+            return 0;
+        }
+
+        void readHeader(std::istream& file, const std::string& filename) {
+            std::string line;
+            if (!std::getline(file, line) || line.compare(0, 3, "ply") != 0) {
+                throw std::runtime_error(filename + " is not a PLY file");
+            }
+
+            while (std::getline(file, line)) {
+                std::istringstream words(line);
+                std::string keyword;
+                words >> keyword;
+
+                if (keyword == "format") {
+                    std::string name;
+                    words >> name;
+                    if (name == "ascii") format = Format::Ascii;
+                    else if (name == "binary_little_endian") format = Format::BinaryLittleEndian;
+                    else if (name == "binary_big_endian") format = Format::BinaryBigEndian;
+                    else throw std::runtime_error(filename + ": unknown PLY format " + name);
+                } else if (keyword == "element") {
+                    Element element;
+                    words >> element.name >> element.count;
+                    elements.push_back(element);
+                } else if (keyword == "property") {
+                    if (elements.empty()) {
+                        throw std::runtime_error(filename + ": PLY property outside an element");
+                    }
+
+                    Property property;
+                    std::string type;
+                    words >> type;
+                    if (type == "list") {
+                        std::string count_type;
+                        words >> count_type >> type;
+                        property.is_list = true;
+                        property.count_type = parseType(count_type, filename);
+                    }
+                    property.type = parseType(type, filename);
+                    words >> property.name;
+                    elements.back().properties.push_back(property);
+                } else if (keyword == "end_header") {
+                    return;
+                }
+            }
+
+            throw std::runtime_error(filename + ": PLY header has no end_header");
+        }
+
+        // Read one scalar of the given type as a double
+        double readValue(std::istream& file, Type type) const {
+            if (format == Format::Ascii) {
+                double value = 0;
+                file >> value;
+                return value;
+            }
+
+            unsigned char bytes[8];
+            size_t size = typeSize(type);
+            file.read(reinterpret_cast<char*>(bytes), size);
+
+            uint32_t endian_probe = 1;
+            bool little_endian = *reinterpret_cast<unsigned char*>(&endian_probe) == 1;
+            if (little_endian != (format == Format::BinaryLittleEndian)) {
+                std::reverse(bytes, bytes + size);
+            }
+
+            switch (type) {
+                case Type::Int8:    { int8_t v;   std::memcpy(&v, bytes, 1); return v; }
+                case Type::UInt8:   { uint8_t v;  std::memcpy(&v, bytes, 1); return v; }
+                case Type::Int16:   { int16_t v;  std::memcpy(&v, bytes, 2); return v; }
+                case Type::UInt16:  { uint16_t v; std::memcpy(&v, bytes, 2); return v; }
+                case Type::Int32:   { int32_t v;  std::memcpy(&v, bytes, 4); return v; }
+                case Type::UInt32:  { uint32_t v; std::memcpy(&v, bytes, 4); return v; }
+                case Type::Float32: { float v;    std::memcpy(&v, bytes, 4); return v; }
+                case Type::Float64: { double v;   std::memcpy(&v, bytes, 8); return v; }
+            }
+            return 0;
+        }
+
+        void readProperty(std::istream& file, const Property& property) const {
+            size_t count = property.is_list ? static_cast<size_t>(readValue(file, property.count_type)) : 1;
+            for (size_t k = 0; k < count; ++k) {
+                readValue(file, property.type);
+            }
+        }
+
+        void readVertices(std::istream& file, const Element& element, TriangleMesh& mesh) const {
+            // Destination buffer of every property, nullptr for the ones we skip
+            std::vector<std::vector<float>*> targets;
+            bool has_normals = false, has_uvs = false;
+
+            for (const Property& property : element.properties) {
+                const std::string& n = property.name;
+                std::vector<float>* target = nullptr;
+
+                if (property.is_list) target = nullptr;
+                else if (n == "x") target = &mesh.px;
+                else if (n == "y") target = &mesh.py;
+                else if (n == "z") target = &mesh.pz;
+                else if (n == "nx") { target = &mesh.nx; has_normals = true; }
+                else if (n == "ny") target = &mesh.ny;
+                else if (n == "nz") target = &mesh.nz;
+                else if (n == "u" || n == "s" || n == "texture_u") { target = &mesh.tu; has_uvs = true; }
+                else if (n == "v" || n == "t" || n == "texture_v") target = &mesh.tv;
+
+                targets.push_back(target);
+                if (target) target->reserve(element.count);
+            }
+
+            for (size_t k = 0; k < element.count; ++k) {
+                for (size_t p = 0; p < element.properties.size(); ++p) {
+                    if (targets[p]) {
+                        targets[p]->push_back(static_cast<float>(readValue(file, element.properties[p].type)));
+                    } else {
+                        readProperty(file, element.properties[p]);
+                    }
+                }
+            }
+
+            // Drop attributes that are incomplete (e.g. nx without ny)
+            if (mesh.px.size() != element.count || mesh.py.size() != element.count || mesh.pz.size() != element.count) {
+                throw std::runtime_error("PLY vertices need x, y and z");
+            }
+            if (!has_normals || mesh.ny.size() != element.count || mesh.nz.size() != element.count) {
+                mesh.nx.clear(); mesh.ny.clear(); mesh.nz.clear();
+            }
+            if (!has_uvs || mesh.tv.size() != element.count) {
+                mesh.tu.clear(); mesh.tv.clear();
+            }
+        }
+
+        void readFaces(std::istream& file, const Element& element, TriangleMesh& mesh) const {
+            std::vector<uint32_t> polygon;
+            mesh.indices.reserve(element.count * 3);
+
+            for (size_t k = 0; k < element.count; ++k) {
+                for (const Property& property : element.properties) {
+                    if (!property.is_list || (property.name != "vertex_indices" && property.name != "vertex_index")) {
+                        readProperty(file, property);
+                        continue;
+                    }
+
+                    size_t count = static_cast<size_t>(readValue(file, property.count_type));
+                    polygon.resize(count);
+                    for (size_t c = 0; c < count; ++c) {
+                        polygon[c] = static_cast<uint32_t>(readValue(file, property.type));
+                    }
+
+                    for (size_t c = 2; c < count; ++c) {
+                        mesh.indices.insert(mesh.indices.end(), {polygon[0], polygon[c - 1], polygon[c]});
+                    }
+                }
+            }
+        }
+};
+
+// Pick the loader from the file extension
+inline shared_ptr<TriangleMesh> load_mesh(const std::string& filename) {
+    std::string extension = filename.substr(filename.find_last_of('.') + 1);
+    for (char& c : extension) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+
+    shared_ptr<TriangleMesh> mesh;
+    if (extension == "obj") {
+        mesh = ObjLoader().load(filename);
+    } else if (extension == "ply") {
+        mesh = PlyLoader().load(filename);
+    } else {
+        throw std::runtime_error("Unsupported mesh format " + filename);
+    }
+
+    // Growth slack of the streamed buffers is a large share of a big mesh
+    for (auto* buffer : {&mesh->px, &mesh->py, &mesh->pz, &mesh->nx, &mesh->ny, &mesh->nz, &mesh->tu, &mesh->tv}) {
+        buffer->shrink_to_fit();
+    }
+    mesh->indices.shrink_to_fit();
+
+    return mesh;
+}
+
+#endif
@@ -0,0 +1,648 @@
+#ifndef SCENECACHE_H
+#define SCENECACHE_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../geometry/bvh.h"
+#include "../geometry/Cylinder.h"
+#include "../geometry/Sphere.h"
+#include "../geometry/Triangle.h"
+#include "../geometry/TriangleMesh.h"
+#include "../materials/Material.h"
+
+// Read-only memory mapping of a whole file
+class MappedFile {
+    public:
+        explicit MappedFile(const std::string& filename) {
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return;
+            opened = true;
+
+            struct stat info;
+            if (fstat(fd, &info) == 0 && info.st_size > 0) {
+                void* mapping = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mapping != MAP_FAILED) {
+                    bytes = static_cast<const char*>(mapping);
+                    length = static_cast<size_t>(info.st_size);
+                }
+            }
+            close(fd);
+        }
+
+        ~MappedFile() {
+            if (bytes) munmap(const_cast<char*>(bytes), length);
+        }
+
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        bool isOpen() const { return opened; }
+        const char* data() const { return bytes; }
+        size_t size() const { return length; }
+
+    private:
+        const char* bytes = nullptr;
+        size_t length = 0;
+        bool opened = false;
+};
+
+// On-disk cache of a scene's geometry, materials and BVH, keyed by a hash of the scene file
+// and of the assets it reads. The file holds position-independent arrays of plain records;
+// settings stay JSON and are parsed on every run. Scenes with instances are not cached.
+class SceneCache {
+    public:
+        // What a cache file restores
+        struct Contents {
+            std::string settings;        // Scene JSON without its shapes
+            MaterialTable materials;
+            shared_ptr<bvh_node> world;
+        };
+
+        // 64-bit FNV-1a, chainable through `h`
+        static uint64_t hash(const char* data, size_t size, uint64_t h = 14695981039346656037ull) {
+            for (size_t i = 0; i < size; ++i) {
+                h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+            }
+            return h;
+        }
+
+        // Cache file for a scene, named after the hash of its JSON, the cache format and the
+        // precision the renderer was built with (float and double builds keep separate caches)
+        static std::string fileName(const std::string& directory, uint64_t scene_hash) {
+            char name[32];
+            uint64_t key = scene_hash ^ format_version ^ (static_cast<uint64_t>(sizeof(real)) << 56);
+            std::snprintf(name, sizeof(name), "%016llx.scache", static_cast<unsigned long long>(key));
+            return directory + "/" + name;
+        }
+
+        // Restore a cached scene. Returns nothing when there is no cache for the scene or its
+        // assets have changed since it was written; throws on a damaged cache file.
+        static std::optional<Contents> load(const std::string& filename, uint64_t scene_hash) {
+            MappedFile file(filename);
+            if (!file.data()) return std::nullopt;
+
+            Reader reader(file, filename);
+            const Header& header = reader.header;
+            if (header.scene_hash != scene_hash) return std::nullopt;
+
+            // Assets: every file the scene read must still have the contents it was cached with
+            size_t asset_count;
+            const uint64_t* asset_hashes = reader.array<uint64_t>(AssetHashes, asset_count);
+            std::vector<std::string> asset_names = reader.strings(AssetNames);
+            if (asset_names.size() != asset_count) reader.fail();
+            for (size_t i = 0; i < asset_count; ++i) {
+                if (fileHash(asset_names[i]) != asset_hashes[i]) return std::nullopt;
+            }
+
+            Contents contents;
+            size_t settings_size;
+            const char* settings = reader.array<char>(Settings, settings_size);
+            contents.settings.assign(settings, settings_size);
+
+            loadMaterials(reader, contents.materials);
+            contents.world = loadWorld(reader, header);
+            return contents;
+        }
+
+        // Write the cache file for a scene. The file is written under a temporary name and
+        // renamed into place, so concurrent runs never see a partial cache. Returns false for
+        // worlds holding primitives the cache has no record for.
+        static bool save(const std::string& filename, uint64_t scene_hash, const std::string& settings,
+                         const std::vector<std::string>& assets, const MaterialTable& materials, const bvh_node& world) {
+            Writer writer;
+            writer.header.scene_hash = scene_hash;
+            writer.header.max_leaf_size = static_cast<uint32_t>(world.max_leaf_size);
+            writer.header.sah_cost = world.sah_cost;
+
+            std::vector<uint64_t> asset_hashes;
+            for (const std::string& asset : assets) {
+                asset_hashes.push_back(fileHash(asset));
+            }
+            writer.strings(AssetNames, assets);
+            writer.array(AssetHashes, asset_hashes);
+            writer.array(Settings, std::vector<char>(settings.begin(), settings.end()));
+
+            saveMaterials(writer, materials);
+            if (!saveWorld(writer, world)) return false;
+
+            std::string temporary = filename + ".tmp" + std::to_string(getpid());
+            {
+                std::ofstream file(temporary, std::ios::binary);
+                if (!file.is_open()) {
+                    throw std::runtime_error("Failed to open scene cache file " + temporary);
+                }
+
+                std::memcpy(writer.data.data(), &writer.header, sizeof(Header));
+                file.write(writer.data.data(), writer.data.size());
+                if (!file) {
+                    std::remove(temporary.c_str());
+                    throw std::runtime_error("Failed to write scene cache file " + temporary);
+                }
+            }
+
+            if (std::rename(temporary.c_str(), filename.c_str()) != 0) {
+                std::remove(temporary.c_str());
+                throw std::runtime_error("Failed to write scene cache file " + filename);
+            }
+            return true;
+        }
+
+    private:
+        // Bumped whenever a record or the BVH node layout changes, or primitives' bounds do
+        static constexpr uint64_t format_version = 4;
+        static constexpr size_t alignment = 64;
+
+        enum SectionId {
+            Settings, AssetNames, AssetHashes, TextureNames,
+            Lambertians, Schlicks, SchlickRefractions, BlinnPhongs,
+            Spheres, Cylinders, Triangles, Meshes, MeshData,
+            Nodes, Leaves, SectionCount
+        };
+
+        struct Section {
+            uint64_t offset;
+            uint64_t size;      // Bytes
+        };
+
+        struct Header {
+            char magic[8] = {'S', 'C', 'N', 'C', 'A', 'C', 'H', 'E'};
+            uint64_t version = format_version;
+            uint64_t node_size = sizeof(bvh_node::WideNode);
+            uint64_t scene_hash = 0;
+            double sah_cost = 0;
+            uint32_t max_leaf_size = 0;
+            uint32_t real_size = sizeof(real);  // Node bounds are rounded from primitives' bounds in this precision
+            Section sections[SectionCount] = {};
+        };
+
+        // Records. Textures are indices into the TextureNames list, -1 for none.
+        struct LambertianRecord {
+            double albedo[3];
+            int32_t texture;
+            uint32_t pad;
+        };
+
+        struct SchlickRecord {
+            float reflectance;
+        };
+
+        struct BlinnPhongRecord {
+            double diffuse_color[3];
+            double specular_color[3];
+            double specular_exponent, ks, kd, reflectivity, refractive_index, transparency;
+            int32_t texture;
+            uint8_t is_reflective, is_refractive;
+            uint16_t pad;
+        };
+
+        struct SphereRecord {
+            double center[3];
+            double radius;
+            double rotation_angle;
+            MaterialId material;
+            uint32_t pad;
+        };
+
+        struct CylinderRecord {
+            double center[3];
+            double axis[3];
+            double radius;
+            double height;
+            MaterialId material;
+            uint32_t pad;
+        };
+
+        // Vertices in the counter-clockwise order the constructor sorted them into
+        struct TriangleRecord {
+            double vertices[3][3];
+            MaterialId material;
+            uint32_t pad;
+        };
+
+        // A mesh's buffers sit back to back at `data` in the MeshData section: positions,
+        // normals and UVs if present, then the indices
+        struct MeshRecord {
+            uint64_t vertex_count;
+            uint64_t index_count;
+            uint64_t data;
+            MaterialId material;
+            uint32_t has_normals : 1;
+            uint32_t has_uvs : 1;
+        };
+
+        enum class PrimitiveKind : uint32_t { Sphere, Cylinder, Triangle, MeshTriangle };
+
+        // One BVH leaf slot: the primitive's kind and its index among the records of that kind
+        // (mesh triangles count on across meshes, in mesh order)
+        struct LeafRecord {
+            PrimitiveKind kind;
+            uint32_t index;
+        };
+
+        struct Writer {
+            Header header;
+            std::vector<char> data = std::vector<char>(sizeof(Header));
+
+            template <typename T>
+            void array(SectionId id, const std::vector<T>& items) {
+                data.resize((data.size() + alignment - 1) / alignment * alignment);
+                header.sections[id] = {data.size(), items.size() * sizeof(T)};
+
+                const char* bytes = reinterpret_cast<const char*>(items.data());
+                data.insert(data.end(), bytes, bytes + items.size() * sizeof(T));
+            }
+
+            // Strings stored back to back, each with its terminating zero
+            void strings(SectionId id, const std::vector<std::string>& items) {
+                std::vector<char> bytes;
+                for (const std::string& item : items) {
+                    bytes.insert(bytes.end(), item.begin(), item.end());
+                    bytes.push_back('\0');
+                }
+                array(id, bytes);
+            }
+        };
+
+        // Bounds-checked view of a mapped cache file
+        struct Reader {
+            const MappedFile& file;
+            const std::string& filename;
+            Header header;
+
+            Reader(const MappedFile& _file, const std::string& _filename) : file(_file), filename(_filename) {
+                if (file.size() < sizeof(Header)) fail();
+                std::memcpy(&header, file.data(), sizeof(Header));
+
+                Header expected;
+                if (std::memcmp(header.magic, expected.magic, sizeof(header.magic)) != 0 ||
+                    header.version != expected.version || header.node_size != expected.node_size ||
+                    header.real_size != expected.real_size) {
+                    throw std::runtime_error("Scene cache file " + filename + " has an incompatible format");
+                }
+            }
+
+            template <typename T>
+            const T* array(SectionId id, size_t& count) const {
+                const Section& section = header.sections[id];
+                if (section.offset % alignment != 0 || section.size % sizeof(T) != 0 ||
+                    section.offset > file.size() || section.size > file.size() - section.offset) {
+                    fail();
+                }
+
+                count = section.size / sizeof(T);
+                return reinterpret_cast<const T*>(file.data() + section.offset);
+            }
+
+            std::vector<std::string> strings(SectionId id) const {
+                size_t size;
+                const char* bytes = array<char>(id, size);
+                if (size > 0 && bytes[size - 1] != '\0') fail();
+
+                std::vector<std::string> items;
+                for (size_t start = 0; start < size; start += items.back().size() + 1) {
+                    items.emplace_back(bytes + start);
+                }
+                return items;
+            }
+
+            [[noreturn]] void fail() const {
+                throw std::runtime_error("Scene cache file " + filename + " is damaged");
+            }
+        };
+
+        static uint64_t fileHash(const std::string& filename) {
+            MappedFile file(filename);
+            if (!file.isOpen()) return 0;
+            return hash(file.data(), file.size());
+        }
+
+        static void toArray(const vec3& v, double out[3]) {
+            out[0] = v.x(); out[1] = v.y(); out[2] = v.z();
+        }
+
+        static vec3 fromArray(const double v[3]) {
+            return vec3(v[0], v[1], v[2]);
+        }
+
+        static void saveMaterials(Writer& writer, const MaterialTable& materials) {
+            // Textures are recorded by file name; materials sharing a texture share its entry
+            std::vector<std::string> texture_names;
+            std::unordered_map<const Texture*, int32_t> texture_indices;
+            auto texture_index = [&](const shared_ptr<Texture>& texture) -> int32_t {
+                if (!texture) return -1;
+
+                auto found = texture_indices.find(texture.get());
+                if (found != texture_indices.end()) return found->second;
+
+                int32_t index = static_cast<int32_t>(texture_names.size());
+                texture_names.push_back(texture->getFilename());
+                texture_indices[texture.get()] = index;
+                return index;
+            };
+
+            std::vector<LambertianRecord> lambertians;
+            for (const Lambertian& material : materials.lambertians) {
+                LambertianRecord record = {};
+                toArray(material.albedo, record.albedo);
+                record.texture = texture_index(material.texture);
+                lambertians.push_back(record);
+            }
+
+            std::vector<SchlickRecord> schlicks, schlick_refractions;
+            for (const SchlickBRDF& material : materials.schlicks) {
+                schlicks.push_back({material.fresnelReflectance});
+            }
+            for (const SchlickRefractionsBRDF& material : materials.schlick_refractions) {
+                schlick_refractions.push_back({material.fresnelReflectance});
+            }
+
+            std::vector<BlinnPhongRecord> blinn_phongs;
+            for (const BlinnPhong& material : materials.blinn_phongs) {
+                BlinnPhongRecord record = {};
+                toArray(material.diffuse_color, record.diffuse_color);
+                toArray(material.specular_color, record.specular_color);
+                record.specular_exponent = material.specular_exponent;
+                record.ks = material.ks;
+                record.kd = material.kd;
+                record.reflectivity = material.reflectivity;
+                record.refractive_index = material.refractiveIndex;
+                record.transparency = material.transparency;
+                record.texture = texture_index(material.texture);
+                record.is_reflective = material.is_reflective;
+                record.is_refractive = material.is_refractive;
+                blinn_phongs.push_back(record);
+            }
+
+            writer.strings(TextureNames, texture_names);
+            writer.array(Lambertians, lambertians);
+            writer.array(Schlicks, schlicks);
+            writer.array(SchlickRefractions, schlick_refractions);
+            writer.array(BlinnPhongs, blinn_phongs);
+        }
+
+        // Materials are added back in their original order, so every MaterialId stays valid
+        static void loadMaterials(const Reader& reader, MaterialTable& materials) {
+            std::vector<shared_ptr<Texture>> textures;
+            for (const std::string& name : reader.strings(TextureNames)) {
+                textures.push_back(make_shared<Texture>(name.c_str()));
+            }
+            auto texture = [&](int32_t index) -> shared_ptr<Texture> {
+                if (index < 0) return nullptr;
+                if (static_cast<size_t>(index) >= textures.size()) reader.fail();
+                return textures[index];
+            };
+
+            size_t count;
+            const LambertianRecord* lambertians = reader.array<LambertianRecord>(Lambertians, count);
+            for (size_t i = 0; i < count; ++i) {
+                shared_ptr<Texture> lambertian_texture = texture(lambertians[i].texture);
+                materials.add(Lambertian(fromArray(lambertians[i].albedo), lambertian_texture));
+            }
+
+            const SchlickRecord* schlicks = reader.array<SchlickRecord>(Schlicks, count);
+            for (size_t i = 0; i < count; ++i) {
+                materials.add(SchlickBRDF(schlicks[i].reflectance));
+            }
+
+            const SchlickRecord* schlick_refractions = reader.array<SchlickRecord>(SchlickRefractions, count);
+            for (size_t i = 0; i < count; ++i) {
+                materials.add(SchlickRefractionsBRDF(schlick_refractions[i].reflectance));
+            }
+
+            const BlinnPhongRecord* blinn_phongs = reader.array<BlinnPhongRecord>(BlinnPhongs, count);
+            for (size_t i = 0; i < count; ++i) {
+                const BlinnPhongRecord& record = blinn_phongs[i];
+                shared_ptr<Texture> blinn_phong_texture = texture(record.texture);
+                materials.add(BlinnPhong(blinn_phong_texture, fromArray(record.diffuse_color), fromArray(record.specular_color),
+                                         record.specular_exponent, record.ks, record.kd, record.reflectivity,
+                                         record.refractive_index, record.is_reflective, record.is_refractive, record.transparency));
+            }
+        }
+
+        static bool saveWorld(Writer& writer, const bvh_node& world) {
+            const PrimitiveStore& store = world.store;
+            std::vector<SphereRecord> spheres;
+            std::vector<CylinderRecord> cylinders;
+            std::vector<TriangleRecord> triangles;
+            std::vector<MeshRecord> meshes;
+            std::vector<char> mesh_data;
+            std::vector<LeafRecord> leaves;
+
+            // Meshes are numbered as the leaves first reach them; the value is the global number
+            // of the mesh's first triangle
+            std::unordered_map<const TriangleMesh*, uint32_t> mesh_first_triangle;
+            uint32_t mesh_triangles = 0;
+
+            auto append = [&](const void* bytes, size_t size) {
+                mesh_data.insert(mesh_data.end(), static_cast<const char*>(bytes), static_cast<const char*>(bytes) + size);
+            };
+
+            for (uint32_t entry = 0; entry < store.size(); ++entry) {
+                uint32_t slot = store.slots[entry];
+
+                switch (store.types[entry]) {
+                    case PrimitiveType::Sphere: {
+                        SphereRecord record = {};
+                        toArray(store.spheres.center(slot), record.center);
+                        record.radius = store.spheres.radius[slot];
+                        record.rotation_angle = store.spheres.rotation[slot];
+                        record.material = store.spheres.material[slot];
+                        leaves.push_back({PrimitiveKind::Sphere, static_cast<uint32_t>(spheres.size())});
+                        spheres.push_back(record);
+                        break;
+                    }
+                    case PrimitiveType::Cylinder: {
+                        CylinderRecord record = {};
+                        toArray(store.cylinders.frame[slot].center, record.center);
+                        toArray(store.cylinders.frame[slot].axis, record.axis);
+                        record.radius = store.cylinders.radius[slot];
+                        record.height = store.cylinders.height[slot];
+                        record.material = store.cylinders.material[slot];
+                        leaves.push_back({PrimitiveKind::Cylinder, static_cast<uint32_t>(cylinders.size())});
+                        cylinders.push_back(record);
+                        break;
+                    }
+                    case PrimitiveType::Triangle: {
+                        TriangleRecord record = {};
+                        point3 p0, p1, p2;
+                        store.triangles.vertices(slot, p0, p1, p2);
+                        toArray(p0, record.vertices[0]);
+                        toArray(p1, record.vertices[1]);
+                        toArray(p2, record.vertices[2]);
+                        record.material = store.triangles.material[slot];
+                        leaves.push_back({PrimitiveKind::Triangle, static_cast<uint32_t>(triangles.size())});
+                        triangles.push_back(record);
+                        break;
+                    }
+                    case PrimitiveType::MeshTriangle: {
+                        const TriangleMesh* mesh = store.meshes[store.mesh_triangles.mesh[slot]].get();
+
+                        auto found = mesh_first_triangle.find(mesh);
+                        if (found == mesh_first_triangle.end()) {
+                            MeshRecord record = {};
+                            record.vertex_count = mesh->vertexCount();
+                            record.index_count = mesh->indices.size();
+                            record.data = mesh_data.size();
+                            record.material = mesh->material;
+                            record.has_normals = mesh->hasNormals();
+                            record.has_uvs = mesh->hasUVs();
+                            meshes.push_back(record);
+
+                            size_t floats = mesh->vertexCount() * sizeof(float);
+                            append(mesh->px.data(), floats);
+                            append(mesh->py.data(), floats);
+                            append(mesh->pz.data(), floats);
+                            if (mesh->hasNormals()) {
+                                append(mesh->nx.data(), floats);
+                                append(mesh->ny.data(), floats);
+                                append(mesh->nz.data(), floats);
+                            }
+                            if (mesh->hasUVs()) {
+                                append(mesh->tu.data(), floats);
+                                append(mesh->tv.data(), floats);
+                            }
+                            append(mesh->indices.data(), mesh->indices.size() * sizeof(uint32_t));
+
+                            found = mesh_first_triangle.emplace(mesh, mesh_triangles).first;
+                            mesh_triangles += static_cast<uint32_t>(mesh->triangleCount());
+                        }
+
+                        leaves.push_back({PrimitiveKind::MeshTriangle, found->second + store.mesh_triangles.triangle[slot]});
+                        break;
+                    }
+                    case PrimitiveType::Custom:
+                        return false;
+                }
+            }
+
+            writer.array(Spheres, spheres);
+            writer.array(Cylinders, cylinders);
+            writer.array(Triangles, triangles);
+            writer.array(Meshes, meshes);
+            writer.array(MeshData, mesh_data);
+            writer.array(Nodes, world.nodes);
+            writer.array(Leaves, leaves);
+            return true;
+        }
+
+        static shared_ptr<bvh_node> loadWorld(const Reader& reader, const Header& header) {
+            size_t sphere_count, cylinder_count, triangle_count, mesh_count, data_size, count;
+            const SphereRecord* spheres = reader.array<SphereRecord>(Spheres, sphere_count);
+            const CylinderRecord* cylinders = reader.array<CylinderRecord>(Cylinders, cylinder_count);
+            const TriangleRecord* triangles = reader.array<TriangleRecord>(Triangles, triangle_count);
+            const MeshRecord* mesh_records = reader.array<MeshRecord>(Meshes, mesh_count);
+            const char* mesh_data = reader.array<char>(MeshData, data_size);
+            PrimitiveStore store;
+
+            // Meshes get their buffers back; mesh_of and first_triangle turn a global triangle
+            // number back into its mesh and the triangle within
+            std::vector<uint32_t> first_triangle;
+            uint64_t mesh_triangles = 0;
+            for (size_t i = 0; i < mesh_count; ++i) {
+                const MeshRecord& record = mesh_records[i];
+                size_t floats = record.vertex_count * (3 + 3 * record.has_normals + 2 * record.has_uvs);
+                if (record.data > data_size || floats * sizeof(float) + record.index_count * sizeof(uint32_t) > data_size - record.data) {
+                    reader.fail();
+                }
+
+                const char* cursor = mesh_data + record.data;
+                auto take = [&](auto& buffer) {
+                    using Element = typename std::remove_reference_t<decltype(buffer)>::value_type;
+                    size_t n = (std::is_same_v<Element, uint32_t>) ? record.index_count : record.vertex_count;
+                    buffer.resize(n);
+                    std::memcpy(buffer.data(), cursor, n * sizeof(Element));
+                    cursor += n * sizeof(Element);
+                };
+
+                auto mesh = make_shared<TriangleMesh>();
+                take(mesh->px); take(mesh->py); take(mesh->pz);
+                if (record.has_normals) {
+                    take(mesh->nx); take(mesh->ny); take(mesh->nz);
+                }
+                if (record.has_uvs) {
+                    take(mesh->tu); take(mesh->tv);
+                }
+                take(mesh->indices);
+                mesh->material = record.material;
+
+                for (uint32_t index : mesh->indices) {
+                    if (index >= record.vertex_count) reader.fail();
+                }
+
+                first_triangle.push_back(static_cast<uint32_t>(mesh_triangles));
+                mesh_triangles += mesh->triangleCount();
+                if (mesh_triangles > UINT32_MAX) reader.fail();
+                store.addMesh(mesh);
+            }
+
+            // Primitives in leaf order
+            const LeafRecord* leaves = reader.array<LeafRecord>(Leaves, count);
+            for (size_t i = 0; i < count; ++i) {
+                uint32_t index = leaves[i].index;
+
+                switch (leaves[i].kind) {
+                    case PrimitiveKind::Sphere: {
+                        if (index >= sphere_count) reader.fail();
+                        const SphereRecord& record = spheres[index];
+                        store.addSphere(fromArray(record.center), record.radius, record.material, record.rotation_angle);
+                        break;
+                    }
+                    case PrimitiveKind::Cylinder: {
+                        if (index >= cylinder_count) reader.fail();
+                        const CylinderRecord& record = cylinders[index];
+                        store.addCylinder(CylinderFrame(fromArray(record.center), fromArray(record.axis)), record.radius, record.height, record.material);
+                        break;
+                    }
+                    case PrimitiveKind::Triangle: {
+                        if (index >= triangle_count) reader.fail();
+                        const TriangleRecord& record = triangles[index];
+                        store.addTriangle(fromArray(record.vertices[0]), fromArray(record.vertices[1]), fromArray(record.vertices[2]), record.material);
+                        break;
+                    }
+                    case PrimitiveKind::MeshTriangle: {
+                        if (index >= mesh_triangles) reader.fail();
+                        uint32_t mesh = static_cast<uint32_t>(std::upper_bound(first_triangle.begin(), first_triangle.end(), index) - first_triangle.begin() - 1);
+                        store.addMeshTriangle(mesh, index - first_triangle[mesh]);
+                        break;
+                    }
+                    default:
+                        reader.fail();
+                }
+            }
+            store.finish();
+
+            // Children must lie inside the arrays and after their parent, so traversal terminates
+            const bvh_node::WideNode* node_records = reader.array<bvh_node::WideNode>(Nodes, count);
+            std::vector<bvh_node::WideNode> nodes(node_records, node_records + count);
+            for (size_t i = 0; i < count; ++i) {
+                const bvh_node::WideNode& node = nodes[i];
+                if (node.child_count < 1 || node.child_count > bvh_node::width) reader.fail();
+
+                for (int lane = 0; lane < node.child_count; ++lane) {
+                    bool valid = node.count[lane] > 0 ? node.child[lane] + static_cast<size_t>(node.count[lane]) <= store.size()
+                                                      : node.child[lane] > i && node.child[lane] < count;
+                    if (!valid) reader.fail();
+                }
+            }
+
+            return shared_ptr<bvh_node>(new bvh_node(std::move(store), std::move(nodes),
+                                                     static_cast<int>(header.max_leaf_size), header.sah_cost));
+        }
+};
+
+#endif
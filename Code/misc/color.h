@@ -11,6 +11,11 @@ inline double linear_to_gamma(double linear_component) {
     return pow(linear_component, 1.0 / 2.0);
 }
 
+// Relative luminance (Rec. 709 weights) of a linear colour
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 inline color reinhardToneMapping(const color& pixel_color, double exposure) {
     double r = pixel_color.x() * exposure;
     double g = pixel_color.y() * exposure;
@@ -40,13 +45,10 @@ inline color exponentialToneMapping(const color& pixel_color, double exposure) {
     return color(tone_mapped_r, tone_mapped_g, tone_mapped_b);
 }
 
-void write_color(std::ostream &out, color pixel_color, int samples_per_pixel, double exposure) {
-    // Divide the color by the number of samples
-    auto scale = 1.0 / samples_per_pixel;
-    auto scaled_color = pixel_color * scale;
-
+// Tone map a sample-averaged HDR colour and quantise it to [0, 255] per channel
+inline void quantize_color(const color& pixel_color, double exposure, unsigned char rgb[3]) {
     // Apply Reinhard tone mapping
-    auto tone_mapped = reinhardToneMapping(scaled_color, exposure);
+    auto tone_mapped = reinhardToneMapping(pixel_color, exposure);
     auto r = tone_mapped.x();
     auto g = tone_mapped.y();
     auto b = tone_mapped.z();
@@ -56,11 +58,27 @@ void write_color(std::ostream &out, color pixel_color, int samples_per_pixel, do
     g = linear_to_gamma(g);
     b = linear_to_gamma(b);
 
-    // Write translated [0, 255] value of each color component
+    // Translate to [0, 255] value of each color component (NaN samples map to black)
     static const interval intensity(0.000, 0.9999);
-    out << static_cast<int>(256 * intensity.clamp(r)) << ' '
-        << static_cast<int>(256 * intensity.clamp(g)) << ' '
-        << static_cast<int>(256 * intensity.clamp(b)) << '\n';
+    if (std::isnan(r)) r = 0;
+    if (std::isnan(g)) g = 0;
+    if (std::isnan(b)) b = 0;
+    rgb[0] = static_cast<unsigned char>(256 * intensity.clamp(r));
+    rgb[1] = static_cast<unsigned char>(256 * intensity.clamp(g));
+    rgb[2] = static_cast<unsigned char>(256 * intensity.clamp(b));
+}
+
+void write_color(std::ostream &out, const color& pixel_color, int samples_per_pixel, double exposure) {
+    // Divide the color by the number of samples
+    auto scale = 1.0 / samples_per_pixel;
+    auto scaled_color = pixel_color * scale;
+
+    // Write translated [0, 255] value of each color component
+    unsigned char rgb[3];
+    quantize_color(scaled_color, exposure, rgb);
+    out << static_cast<int>(rgb[0]) << ' '
+        << static_cast<int>(rgb[1]) << ' '
+        << static_cast<int>(rgb[2]) << '\n';
 }
 
 #endif
@@ -0,0 +1,101 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <cstdint>
+
+// Counter-based random number generator built on Philox4x32-10 (Salmon et al., "Parallel
+// Random Numbers: As Easy as 1, 2, 3"). Every number is a pure function of the key
+// (seed, pixel, sample, bounce, dimension) rather than of a shared state, so streams need no
+// locks and a render reproduces exactly regardless of how work is spread over threads.
+class CounterRNG {
+    public:
+        CounterRNG(uint32_t seed = 0) : seed(seed) {}
+
+        void setSeed(uint32_t _seed) {
+            seed = _seed;
+            invalidate();
+        }
+
+        // Start the stream of one camera sample; resets the bounce and dimension counters
+        void startSample(uint64_t _pixel, uint32_t _sample) {
+            pixel = _pixel;
+            sample = _sample;
+            bounce = 0;
+            dimension = 0;
+            invalidate();
+        }
+
+        // Move on to another path vertex of the current sample
+        void setBounce(uint32_t _bounce) {
+            bounce = _bounce;
+            dimension = 0;
+            invalidate();
+        }
+
+        // Next 32 random bits of the stream (one Philox block serves four dimensions)
+        uint32_t nextUint() {
+            uint32_t block = dimension >> 2;
+            if (block != cached_block) {
+                generate(block);
+                cached_block = block;
+            }
+
+            return output[dimension++ & 3];
+        }
+
+        // Returns a random real in [0, 1)
+        double nextDouble() {
+            return nextUint() * (1.0 / 4294967296.0);
+        }
+
+        // Returns a random real in [0, 1) using the top 24 bits (the float mantissa width)
+        float nextFloat() {
+            return (nextUint() >> 8) * (1.0f / 16777216.0f);
+        }
+
+    private:
+        uint32_t seed;
+        uint64_t pixel     = 0;
+        uint32_t sample    = 0;
+        uint32_t bounce    = 0;
+        uint32_t dimension = 0;
+
+        uint32_t output[4];
+        uint32_t cached_block = UINT32_MAX;
+
+        void invalidate() {
+            cached_block = UINT32_MAX;
+        }
+
+        void generate(uint32_t block) {
+            uint32_t ctr[4] = {block, bounce, sample, static_cast<uint32_t>(pixel)};
+            uint32_t key[2] = {seed, static_cast<uint32_t>(pixel >> 32)};
+
+            for (int round = 0; round < 10; ++round) {
+                if (round > 0) {
+                    key[0] += 0x9E3779B9u;
+                    key[1] += 0xBB67AE85u;
+                }
+
+                uint64_t product0 = static_cast<uint64_t>(0xD2511F53u) * ctr[0];
+                uint64_t product1 = static_cast<uint64_t>(0xCD9E8D57u) * ctr[2];
+
+                ctr[0] = static_cast<uint32_t>(product1 >> 32) ^ ctr[1] ^ key[0];
+                ctr[1] = static_cast<uint32_t>(product1);
+                ctr[2] = static_cast<uint32_t>(product0 >> 32) ^ ctr[3] ^ key[1];
+                ctr[3] = static_cast<uint32_t>(product0);
+            }
+
+            for (int i = 0; i < 4; ++i) {
+                output[i] = ctr[i];
+            }
+        }
+};
+
+// The calling thread's random stream; the renderer re-keys it for every camera sample
+inline CounterRNG& thread_rng() {
+    thread_local CounterRNG rng;
+    return rng;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <array>
+#include <cstdint>
+
+#include "random.h"
+#include "../math/vec2.h"
+
+// What a sample is used for. Every purpose draws from its own scrambled sequence, so the
+// pixel jitter of a sample never lines up with its lens, light or BSDF sample.
+enum class SampleDimension : uint32_t {
+    PixelJitter,
+    Lens,
+    Light,
+    BSDF,
+    BSDFChoice,
+    Roulette,
+    Count
+};
+
+// Low-discrepancy sampler: a 2D Sobol sequence with hash-based Owen scrambling (Burley,
+// "Practical Hash-based Owen Scrambling", 2020). Higher dimensions are padded with
+// independently scrambled and shuffled copies of the same 2D sequence, keyed by
+// (seed, pixel, bounce, purpose, request), so pixels are decorrelated while the samples of
+// one pixel stay stratified. A sample costs a hash and a handful of integer operations.
+class Sampler {
+    public:
+        void setSeed(uint32_t _seed) {
+            seed = _seed;
+            thread_rng().setSeed(_seed);
+        }
+
+        // Start one camera sample of a pixel. The thread's CounterRNG is re-keyed as well, so
+        // code drawing plain uniforms stays on the same (pixel, sample, bounce) stream.
+        void startSample(uint64_t pixel, uint32_t _sample) {
+            sample = _sample;
+            pixel_hash = hash(seed ^ hash(static_cast<uint32_t>(pixel) ^ hash(static_cast<uint32_t>(pixel >> 32))));
+            thread_rng().startSample(pixel, _sample);
+            startBounce(0);
+        }
+
+        // Move on to another path vertex of the current sample
+        void setBounce(uint32_t bounce) {
+            thread_rng().setBounce(bounce);
+            startBounce(bounce);
+        }
+
+        // Next 2D sample for a purpose. Repeated requests at one vertex (several light samples,
+        // say) each get their own dimension, allocated in request order.
+        vec2 get2D(SampleDimension dimension) {
+            uint32_t key = dimensionKey(dimension);
+
+            uint32_t index = nested_uniform_scramble(sample, hash(key));
+            uint32_t x = nested_uniform_scramble(sobol(index, 0), hash(key ^ 0x68bc21ebu));
+            uint32_t y = nested_uniform_scramble(sobol(index, 1), hash(key ^ 0x02e5be93u));
+
+            return vec2(to_unit_float(x), to_unit_float(y));
+        }
+
+        float get1D(SampleDimension dimension) {
+            uint32_t key = dimensionKey(dimension);
+
+            uint32_t index = nested_uniform_scramble(sample, hash(key));
+            return to_unit_float(nested_uniform_scramble(sobol(index, 0), hash(key ^ 0x68bc21ebu)));
+        }
+
+    private:
+        static constexpr int dimension_count = static_cast<int>(SampleDimension::Count);
+
+        uint32_t seed       = 0;
+        uint32_t sample     = 0;
+        uint32_t pixel_hash = 0;
+        uint32_t bounce_hash = 0;
+        std::array<uint32_t, dimension_count> requests{};
+
+        void startBounce(uint32_t bounce) {
+            bounce_hash = hash(pixel_hash ^ hash(bounce));
+            requests.fill(0);
+        }
+
+        uint32_t dimensionKey(SampleDimension dimension) {
+            uint32_t purpose = static_cast<uint32_t>(dimension);
+            return hash(bounce_hash ^ hash((purpose << 16) | requests[purpose]++));
+        }
+
+        // Direction numbers of the first two Sobol dimensions: van der Corput and its companion
+        static constexpr std::array<std::array<uint32_t, 32>, 2> directions() {
+            std::array<std::array<uint32_t, 32>, 2> table{};
+            uint32_t v = 1u << 31;
+
+            for (int bit = 0; bit < 32; ++bit) {
+                table[0][bit] = 1u << (31 - bit);
+                table[1][bit] = v;
+                v ^= v >> 1;
+            }
+
+            return table;
+        }
+
+        static uint32_t sobol(uint32_t index, int dimension) {
+            static constexpr std::array<std::array<uint32_t, 32>, 2> table = directions();
+
+            uint32_t result = 0;
+            for (int bit = 0; index != 0; index >>= 1, ++bit) {
+                if (index & 1)
+                    result ^= table[dimension][bit];
+            }
+
+            return result;
+        }
+
+        static uint32_t hash(uint32_t x) {
+            x ^= x >> 16;
+            x *= 0x7feb352du;
+            x ^= x >> 15;
+            x *= 0x846ca68bu;
+            x ^= x >> 16;
+            return x;
+        }
+
+        static uint32_t reverse_bits(uint32_t x) {
+            x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+            x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+            x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+            x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+            return (x >> 16) | (x << 16);
+        }
+
+        // Owen scrambling: the Laine-Karras hash only lets lower bits affect higher ones, so it
+        // runs on the bit-reversed value
+        static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+            x = reverse_bits(x);
+            x ^= x * 0x3d20adeau;
+            x += seed;
+            x *= (seed >> 16) | 1;
+            x ^= x * 0x05526c56u;
+            x ^= x * 0x53a22864u;
+            return reverse_bits(x);
+        }
+
+        // Top 24 bits as a float in [0, 1)
+        static float to_unit_float(uint32_t x) {
+            return (x >> 8) * (1.0f / 16777216.0f);
+        }
+};
+
+// The calling thread's sampler; the renderer re-keys it for every camera sample
+inline Sampler& thread_sampler() {
+    thread_local Sampler sampler;
+    return sampler;
+}
+
+#endif
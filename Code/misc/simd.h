@@ -0,0 +1,61 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <algorithm>
+#include <string>
+
+// Instruction sets the SIMD kernels are built for, narrowest first. One binary carries a
+// build of each hot kernel (TriangleKernel.h, SphereKernel.h) per level, compiled for the
+// matching target, and runs the widest one the CPU has, so it needs no -march and runs
+// anywhere x86-64 does. SSE2 is part of x86-64, so it is the baseline the rest of the
+// renderer is compiled for. Elsewhere only the portable scalar kernels are built.
+enum class SimdLevel { Scalar, SSE2, AVX2, AVX512 };
+
+inline const char* simd_level_name(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::Scalar: return "scalar";
+        case SimdLevel::SSE2:   return "sse2";
+        case SimdLevel::AVX2:   return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+    }
+    return "unknown";
+}
+
+inline bool parse_simd_level(const std::string& name, SimdLevel& level) {
+    for (SimdLevel candidate : {SimdLevel::Scalar, SimdLevel::SSE2, SimdLevel::AVX2, SimdLevel::AVX512}) {
+        if (name == simd_level_name(candidate)) {
+            level = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Widest level this CPU runs, from CPUID. AVX2 and AVX-512 also need the OS to save the wide
+// registers, which __builtin_cpu_supports checks. The AVX-512 kernels use the DQ extension
+// too, which every AVX-512 CPU but the Xeon Phi has.
+inline SimdLevel cpu_simd_level() {
+#if defined(__SSE2__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq")) return SimdLevel::AVX512;
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+    return SimdLevel::SSE2;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+// Highest level the kernels may use; lowering it only has an effect before the first kernel
+// is chosen (main's --simd option sets it before the scene is loaded)
+inline SimdLevel& simd_limit() {
+    static SimdLevel limit = SimdLevel::AVX512;
+    return limit;
+}
+
+// Level the kernels are chosen for, fixed on first use
+inline SimdLevel simd_level() {
+    static const SimdLevel level = std::min(cpu_simd_level(), simd_limit());
+    return level;
+}
+
+#endif  // SIMD_H
@@ -0,0 +1,104 @@
+// Parallel BVH build: same tree at every thread count, and no more threads than asked for.
+//
+// Usage: bvh_threads [triangles]
+// A triangle soup with spheres among it is built with 1, 2, 4 and 8 build threads. The trees
+// are serialized through the scene cache and must be byte-identical. While each build runs,
+// the process's threads are counted from /proc: beside the sampling thread there may be at
+// most build_threads of them. Build times are printed as the scaling numbers.
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/Sphere.h"
+#include "../geometry/TriangleMesh.h"
+#include "../geometry/bvh.h"
+#include "../misc/SceneCache.h"
+
+// Threads of this process, or -1 where /proc is not available
+static int live_threads() {
+    std::error_code error;
+    std::filesystem::directory_iterator tasks("/proc/self/task", error);
+    if (error) return -1;
+    return static_cast<int>(std::distance(tasks, std::filesystem::directory_iterator()));
+}
+
+static std::string read_file(const std::string& filename) {
+    std::ifstream file(filename, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+int main(int argc, char* argv[]) {
+    const uint32_t triangles = argc > 1 ? static_cast<uint32_t>(std::atoi(argv[1])) : 300000;
+
+    auto mesh = make_shared<TriangleMesh>();
+    for (uint32_t t = 0; t < triangles; ++t) {
+        point3 center = 10 * vec3::random(-1, 1);
+        for (int k = 0; k < 3; ++k) {
+            point3 p = center + 0.1 * vec3::random(-1, 1);
+            mesh->px.push_back(static_cast<float>(p.x()));
+            mesh->py.push_back(static_cast<float>(p.y()));
+            mesh->pz.push_back(static_cast<float>(p.z()));
+            mesh->indices.push_back(3 * t + k);
+        }
+    }
+
+    HittableList list;
+    list.add(mesh);
+    for (int s = 0; s < 1000; ++s) {
+        list.add(make_shared<Sphere>(10 * vec3::random(-1, 1), 0.2, 0));
+    }
+
+    const std::string cache = (std::filesystem::temp_directory_path() / "bvh_threads.scache").string();
+    std::string reference;
+    int failures = 0;
+
+    for (int threads : {1, 2, 4, 8}) {
+        std::atomic<bool> building{true};
+        std::atomic<int> most_threads{0};
+        std::thread sampler([&]() {
+            while (building) {
+                most_threads = std::max(most_threads.load(), live_threads() - 1);
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+            }
+        });
+
+        auto start = std::chrono::steady_clock::now();
+        bvh_node world(list, 4, threads);
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        building = false;
+        sampler.join();
+
+        std::printf("%d build threads: %.1f ms, at most %d threads running, SAH cost %.6f, %zu nodes\n", threads, ms,
+                    most_threads.load(), world.sahCost(), world.nodeCount());
+
+        if (most_threads > threads) {
+            std::fprintf(stderr, "%d build threads ran as %d threads\n", threads, most_threads.load());
+            ++failures;
+        }
+
+        if (!SceneCache::save(cache, 0, "", {}, MaterialTable(), world)) {
+            std::fprintf(stderr, "could not serialize the tree to %s\n", cache.c_str());
+            return 1;
+        }
+        std::string tree = read_file(cache);
+        if (threads == 1) {
+            reference = tree;
+        } else if (tree != reference) {
+            std::fprintf(stderr, "the tree built with %d threads differs from the single-threaded one\n", threads);
+            ++failures;
+        }
+    }
+
+    std::filesystem::remove(cache);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+// Axis-aligned triangles shade the same in float and double builds.
+//
+// Usage: triangle_precision
+// A scene of triangles in the planes x, y and z = c, for offsets c that neither precision
+// represents exactly, each listed in both windings. Rays from both sides of every triangle hit
+// points of known barycentric weights, through the Triangle itself and through a BVH over the
+// scene. The normal, front_face and texture coordinates of each hit are checked against a
+// reference computed in double from the vertices as the scene lists them, so a float build has
+// to agree with a double one on every triangle's orientation and texture mapping.
+
+#include <cstdio>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/Triangle.h"
+#include "../geometry/bvh.h"
+
+using dvec3 = vec3_t<double>;
+
+struct Reference {
+    dvec3 v[3];
+    shared_ptr<Triangle> triangle;
+};
+
+int main() {
+    const MaterialId textured = make_material_id(MaterialType::Lambertian, 0, true);
+
+    // In-plane corners with shared coordinates: the layouts a sort by polar angle cannot order
+    // robustly once the plane offset rounds differently
+    const double corners[][3][2] = {
+        {{0.1, 0.2}, {1.3, 0.2}, {0.1, 1.1}},
+        {{0.7, 0.3}, {0.7, 1.4}, {-0.6, 0.3}},
+        {{0.2, 0.9}, {1.1, 0.9}, {0.65, -0.4}},
+    };
+
+    std::vector<Reference> references;
+    HittableList list;
+
+    for (int kz = 0; kz < 3; ++kz) {
+        const int kx = (kz + 1) % 3, ky = (kz + 2) % 3;
+        for (double offset : {0.3, -1.7, 2.1}) {
+            for (const auto& corner : corners) {
+                for (bool reversed : {false, true}) {
+                    // Far from every other triangle, so rays only meet their own
+                    const double shift = 10.0 * references.size();
+                    Reference ref;
+                    for (int k = 0; k < 3; ++k) {
+                        const auto& c = corner[reversed ? 2 - k : k];
+                        ref.v[k].e[kx] = c[0] + shift;
+                        ref.v[k].e[ky] = c[1] + shift;
+                        ref.v[k].e[kz] = offset + shift;
+                    }
+                    ref.triangle = make_shared<Triangle>(point3(ref.v[0]), point3(ref.v[1]), point3(ref.v[2]), textured);
+                    list.add(ref.triangle);
+                    references.push_back(ref);
+                }
+            }
+        }
+    }
+
+    bvh_node world(list);
+
+    const double weights[][3] = {{1.0 / 3, 1.0 / 3, 1.0 / 3}, {0.6, 0.3, 0.1}, {0.1, 0.2, 0.7}};
+    const double tolerance = 1e-4;
+    long rays = 0, failures = 0;
+
+    for (const Reference& ref : references) {
+        const dvec3 outward = unit_vector(cross(ref.v[1] - ref.v[0], ref.v[2] - ref.v[0]));
+
+        for (const auto& b : weights) {
+            const dvec3 target = b[0] * ref.v[0] + b[1] * ref.v[1] + b[2] * ref.v[2];
+
+            for (double side : {1.0, -1.0}) {
+                const dvec3 origin = target + side * (2.0 * outward + dvec3(0.05, -0.03, 0.04));
+                const dvec3 direction = target - origin;
+                const bool front_face = dot(direction, outward) < 0;
+                const dvec3 normal = front_face ? outward : -outward;
+                const double u = b[2], v = b[1] + b[2];
+
+                const Ray r(static_cast<point3>(origin), static_cast<vec3>(direction));
+                const Hittable* paths[] = {ref.triangle.get(), &world};
+                for (const Hittable* path : paths) {
+                    ++rays;
+                    HitRecord rec;
+                    const char* what = nullptr;
+
+                    if (!path->intersect(r, interval(0, INFTY), rec) || std::fabs(rec.t - 1) > tolerance) {
+                        what = "missed the target";
+                    } else if (rec.front_face != front_face || dot(dvec3(rec.normal), normal) < 1 - tolerance) {
+                        what = "normal does not face the ray";
+                    } else if (std::fabs(rec.texture_u - u) > tolerance || std::fabs(rec.texture_v - v) > tolerance) {
+                        what = "texture coordinates differ";
+                    }
+
+                    if (what && failures++ < 5) {
+                        std::fprintf(stderr, "%s: %s, triangle (%g %g %g) (%g %g %g) (%g %g %g)\n",
+                                     path == &world ? "BVH" : "Triangle", what, ref.v[0].x(), ref.v[0].y(), ref.v[0].z(),
+                                     ref.v[1].x(), ref.v[1].y(), ref.v[1].z(), ref.v[2].x(), ref.v[2].y(), ref.v[2].z());
+                    }
+                }
+            }
+        }
+    }
+
+    std::printf("%ld rays at %zu axis-aligned triangles, %ld failures\n", rays, references.size(), failures);
+    return failures == 0 ? 0 : 1;
+}
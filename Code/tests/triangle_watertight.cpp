@@ -0,0 +1,190 @@
+// Edge and vertex hits of the watertight triangle test.
+//
+// Usage: triangle_watertight
+// Rays are aimed at every vertex and at points along every edge of two meshes whose triangles
+// share those edges and vertices: a flat grid, whose vertices and edge midpoints are exact, and
+// a tessellated sphere. Every ray must hit the surface where it was aimed (no crack lets it
+// through) and cross it only once there (adjacent triangles never report separate hits at one
+// crossing). The rays go through both triangle_hit and a BVH over a TriangleMesh.
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "../misc/utils.h"
+
+#include "../geometry/TriangleMesh.h"
+#include "../geometry/bvh.h"
+
+struct Mesh {
+    std::vector<point3> vertices;
+    std::vector<uint32_t> indices;
+    real rim = INFTY;   // Open meshes: targets at |x| or |y| >= rim are on the outer edge
+
+    void add(uint32_t a, uint32_t b, uint32_t c) {
+        indices.insert(indices.end(), {a, b, c});
+    }
+};
+
+// Flat n x n grid in the z = 0 plane, cells split along alternating diagonals
+static Mesh make_grid(int n) {
+    Mesh mesh;
+    mesh.rim = n / 2;
+    for (int j = 0; j <= n; ++j) {
+        for (int i = 0; i <= n; ++i) mesh.vertices.push_back(point3(i - n / 2, j - n / 2, 0));
+    }
+
+    for (int j = 0; j < n; ++j) {
+        for (int i = 0; i < n; ++i) {
+            uint32_t v00 = j * (n + 1) + i, v10 = v00 + 1, v01 = v00 + n + 1, v11 = v01 + 1;
+            if ((i + j) % 2 == 0) {
+                mesh.add(v00, v10, v11);
+                mesh.add(v00, v11, v01);
+            } else {
+                mesh.add(v00, v10, v01);
+                mesh.add(v10, v11, v01);
+            }
+        }
+    }
+
+    return mesh;
+}
+
+// Unit sphere of latitude rings and longitude segments, closed by a vertex at each pole.
+// Positions are rounded to float like a loaded mesh's.
+static Mesh make_sphere(int rings, int segments) {
+    Mesh mesh;
+    mesh.vertices.push_back(point3(0, 1, 0));
+    for (int r = 1; r < rings; ++r) {
+        double theta = PI * r / rings;
+        for (int s = 0; s < segments; ++s) {
+            double phi = 2 * PI * s / segments;
+            mesh.vertices.push_back(point3(static_cast<float>(sin(theta) * cos(phi)), static_cast<float>(cos(theta)),
+                                           static_cast<float>(sin(theta) * sin(phi))));
+        }
+    }
+    mesh.vertices.push_back(point3(0, -1, 0));
+
+    auto ring = [&](int r, int s) { return static_cast<uint32_t>(1 + (r - 1) * segments + (s % segments)); };
+    uint32_t south = static_cast<uint32_t>(mesh.vertices.size() - 1);
+
+    for (int s = 0; s < segments; ++s) {
+        mesh.add(0, ring(1, s + 1), ring(1, s));
+        mesh.add(south, ring(rings - 1, s), ring(rings - 1, s + 1));
+        for (int r = 1; r < rings - 1; ++r) {
+            mesh.add(ring(r, s), ring(r, s + 1), ring(r + 1, s + 1));
+            mesh.add(ring(r, s), ring(r + 1, s + 1), ring(r + 1, s));
+        }
+    }
+
+    return mesh;
+}
+
+// Vertices, and points a quarter, a third and half of the way along every edge. Nothing lies
+// beyond an open mesh's outer edge, and a ray grazing it may miss by the rounding of its own
+// direction, so targets there are left out.
+static std::vector<point3> make_targets(const Mesh& mesh) {
+    std::vector<point3> targets = mesh.vertices;
+
+    for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+        for (int k = 0; k < 3; ++k) {
+            uint32_t a = mesh.indices[t + k], b = mesh.indices[t + (k + 1) % 3];
+            if (a > b) continue;  // Every shared edge once
+            for (real f : {real(0.25), real(1) / 3, real(0.5)}) {
+                targets.push_back(mesh.vertices[a] + f * (mesh.vertices[b] - mesh.vertices[a]));
+            }
+        }
+    }
+
+    targets.erase(std::remove_if(targets.begin(), targets.end(),
+                                 [&](const point3& p) { return std::fabs(p.x()) >= mesh.rim || std::fabs(p.y()) >= mesh.rim; }),
+                  targets.end());
+    return targets;
+}
+
+struct Result {
+    long rays = 0;
+    long failures = 0;
+
+    void fail(const char* mesh, const char* what, const point3& target, const Ray& r) {
+        if (failures++ < 5) {
+            std::fprintf(stderr, "%s: %s, ray aimed at (%.9g %.9g %.9g) with direction (%.9g %.9g %.9g)\n", mesh, what,
+                         target.x(), target.y(), target.z(), r.direction().x(), r.direction().y(), r.direction().z());
+        }
+    }
+};
+
+// Shoot rays at every target from directions around `outward`, which must leave the surface
+// crossing there exactly `crossings` times in total
+template <typename Outward>
+static void check(const char* name, const Mesh& mesh, int crossings, const Outward& outward, Result& result) {
+    auto triangle_mesh = make_shared<TriangleMesh>();
+    for (const point3& p : mesh.vertices) {
+        triangle_mesh->px.push_back(static_cast<float>(p.x()));
+        triangle_mesh->py.push_back(static_cast<float>(p.y()));
+        triangle_mesh->pz.push_back(static_cast<float>(p.z()));
+    }
+    triangle_mesh->indices = mesh.indices;
+
+    HittableList list;
+    list.add(triangle_mesh);
+    bvh_node world(list);
+
+    // Distances along a ray agree to a few ulps of the unit-scale coordinates
+    const real tolerance = 64 * std::numeric_limits<real>::epsilon();
+
+    for (const point3& target : make_targets(mesh)) {
+        for (int k = 0; k < 8; ++k) {
+            // From outside, transversal to the surface; t = 1 at the target
+            vec3 side = random_unit_vector();
+            vec3 away = unit_vector(outward(target) + 0.7 * (dot(side, outward(target)) < 0 ? -side : side));
+            point3 origin = target + 3 * away;
+            Ray r(origin, target - origin);
+            ++result.rays;
+
+            // Every triangle's answer: distinct crossings are hits further apart than rounding
+            std::vector<real> hits;
+            for (size_t t = 0; t < mesh.indices.size(); t += 3) {
+                real hit_t, b0, b1, b2;
+                if (triangle_hit(mesh.vertices[mesh.indices[t]], mesh.vertices[mesh.indices[t + 1]], mesh.vertices[mesh.indices[t + 2]],
+                                 r, interval(0, INFTY), hit_t, b0, b1, b2)) {
+                    hits.push_back(hit_t);
+                }
+            }
+            std::sort(hits.begin(), hits.end());
+
+            int distinct = 0;
+            for (size_t h = 0; h < hits.size(); ++h) {
+                if (h == 0 || hits[h] - hits[h - 1] > tolerance) ++distinct;
+            }
+
+            if (hits.empty() || std::fabs(hits[0] - 1) > tolerance) {
+                result.fail(name, "slipped through at the target", target, r);
+            } else if (distinct != crossings) {
+                result.fail(name, "wrong number of separate crossings", target, r);
+            }
+
+            // The same through the BVH
+            RayHit hit;
+            if (!world.closestHit(r, interval(0, INFTY), hit) || std::fabs(hit.t - 1) > tolerance) {
+                result.fail(name, "BVH closest hit missed the target", target, r);
+            }
+            if (!world.occluded(r, interval(0, 1 + tolerance))) {
+                result.fail(name, "BVH any-hit missed the target", target, r);
+            }
+        }
+    }
+}
+
+int main() {
+    Result result;
+
+    // Above and below the grid the ray crosses it once
+    check("grid", make_grid(16), 1, [](const point3& p) { return vec3(0, 0, (p.x() + p.y() > 0) ? 1 : -1); }, result);
+
+    // Into the sphere where aimed, and out again on the far side
+    check("sphere", make_sphere(24, 48), 2, [](const point3& p) { return unit_vector(p); }, result);
+
+    std::printf("%ld rays at vertices and edges, %ld failures\n", result.rays, result.failures);
+    return result.failures == 0 ? 0 : 1;
+}